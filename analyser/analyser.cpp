@@ -1,5 +1,6 @@
 #include "analyser.h"
 
+#include <algorithm>
 #include <climits>
 #include <sstream>
 #include <cstdio>
@@ -14,6 +15,59 @@ namespace miniplc0 {
 		}
 	}
 
+	void Analyser::OutputText(std::ostream& output, bool lines) {
+		output << ".constants:\n";
+		int i = 0;
+		for (auto cons : _constants) {
+			if (cons.type == 'S')
+				output << i << " S " << '"' << cons.value << '"' << '\n';
+			else
+				output << i << " " << cons.type << " " << cons.value << '\n';
+			i++;
+		}
+		output << ".start:\n";
+		for (int i = 0; i < start.size(); i++)
+		{
+			output << i << " " << start.at(i) << std::endl;
+		}
+		output << ".functions:\n";
+		i = 0;
+		for (auto fun : functions) {
+			// 参数大小以栈单元计，double 参数占两个
+			int32_t paramSlots = 0;
+			for (auto type : fun.paraType)
+				paramSlots += slotsOf(type);
+			output << i << " " << fun.nameIndex << " " << paramSlots << " " << 1 << '\n';
+			i++;
+		}
+		for (int i = 0; i < functions.size(); i++)
+		{
+			output << ".F" << i << ":\n";
+			auto ins = functions.at(i).instructions;
+			for (int j = 0; j < ins.size(); j++)
+			{
+				output << j << " " << ins.at(j) << std::endl;
+			}
+		}
+		if (!lines)
+			return;
+		// {.start 或 .Fn} {指令下标} {行号}，没有生成指令的最后一项不输出
+		output << ".lines:\n";
+		for (auto& entry : startLines)
+		{
+			if (entry.first < start.size())
+				output << ".start " << entry.first << " " << entry.second << '\n';
+		}
+		for (int i = 0; i < functions.size(); i++)
+		{
+			for (auto& entry : functions.at(i).lines)
+			{
+				if (entry.first < functions.at(i).instructions.size())
+					output << ".F" << i << " " << entry.first << " " << entry.second << '\n';
+			}
+		}
+	}
+
 
 	// <主过程> ::= <变量声明><函数声明>
 	// 需要补全
@@ -25,6 +79,7 @@ namespace miniplc0 {
 		{
 			return var;
 		}
+		flushZeroVariables();
 		// <函数序列>
 		auto seq = analyseFunctionDeclaration();
 		if (seq.has_value())
@@ -34,7 +89,7 @@ namespace miniplc0 {
 		return {};
 	}
 	// <变量声明> ::= {<变量声明语句>}
-// <变量声明语句> ::= 'int'|'char' <标识符>['='<表达式>]';'
+// <变量声明语句> ::= 'int'|'char'|'double' <标识符>['='<表达式>]';'
 // 需要补全
 	std::optional<CompilationError> Analyser::analyseVariableDeclaration() {
 		// 变量声明语句可能有一个或者多个
@@ -48,7 +103,7 @@ namespace miniplc0 {
 			if (next.value().GetType() ==TokenType::CONST)
 			{
 				next = nextToken();
-				if(!next.has_value() || next.value().GetType() != INT&& next.value().GetType() != CHAR)
+				if(!next.has_value() || next.value().GetType() != INT&& next.value().GetType() != CHAR && next.value().GetType() != DOUBLE)
 					return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrInvalidVariableDeclaration);
 				auto type = next.value().GetType();
 				auto err = analyseInitDeclaratorList(true, type);
@@ -64,7 +119,7 @@ namespace miniplc0 {
 				}
 			}
 			// 'int'
-			if (next.value().GetType() != TokenType::INT&& next.value().GetType() != TokenType::CHAR)
+			if (next.value().GetType() != TokenType::INT&& next.value().GetType() != TokenType::CHAR && next.value().GetType() != TokenType::DOUBLE)
 			{
 				unreadToken();
 				return {};
@@ -143,6 +198,7 @@ namespace miniplc0 {
 			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrNeedIdentifier);
 		}
 		auto tk = next.value();
+		markLine(tk);
 		next = nextToken();
 		if (!next.has_value())
 		{
@@ -151,17 +207,16 @@ namespace miniplc0 {
 		// 试探 initializer 的 '='
 		if (next.value().GetType() == TokenType::ASSIGN)
 		{
+			// 初始化表达式可能用到前面的变量，它们要先在栈上
+			flushZeroVariables();
 			TokenType exprtype;
 			auto err = analyseExpression(exprtype);
 			if (err.has_value())
 			{
 				return err;
 			}
-			//如果是char 则截断
-			if (type == TokenType::CHAR && exprtype == TokenType::INT)
-			{
-				crtInstructions.emplace_back("i2c");
-			}
+			// 转换为变量的类型，char 会被截断
+			convert(exprtype, type);
 		}
 		// 否则回退
 		else
@@ -170,7 +225,8 @@ namespace miniplc0 {
 			{
 				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrConstantNeedValue);
 			}
-			crtInstructions.emplace_back("ipush 0");
+			// 连续的未初始化变量一起清零，见 flushZeroVariables
+			_zeroVariables.push_back(type);
 			unreadToken();
 		}
 		// 防止重复声明
@@ -184,19 +240,25 @@ namespace miniplc0 {
 
 	// 函数声明
 	//<function-definition> ::= 
-	//<type - specifier><identifier><parameter - clause><compound - statement>
+	//<type - specifier><identifier><parameter - clause>(<compound - statement>|';')
+	// 以 ; 结尾的是函数原型，没有指令，由链接时同名的定义补上
 	
 	std::optional<CompilationError> Analyser::analyseFunctionDeclaration() {
 		// 获取 函数类型
 		while (true)
 		{
-			if (level == 0)start = crtInstructions;
+			if (level == 0)
+			{
+				start = crtInstructions;
+				startLines = crtLines;
+			}
 			auto next = nextToken();
 			if (!next.has_value())
 			{
 				return {};
 			}
-			if (!next.has_value()||next.value().GetType()!=TokenType::VOID && next.value().GetType() != TokenType::INT && next.value().GetType() != TokenType::CHAR)
+			if (!next.has_value()||next.value().GetType()!=TokenType::VOID && next.value().GetType() != TokenType::INT && next.value().GetType() != TokenType::CHAR
+				&& next.value().GetType() != TokenType::DOUBLE)
 			{
 				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
 			}
@@ -208,9 +270,15 @@ namespace miniplc0 {
 			{
 				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrNeedIdentifier);
 			}
-			if (funcExist(next.value().GetValueString()))
+			// 只有原型的函数可以再次声明或定义，签名要一致
+			int prototype = -1;
+			for (int i = 0; i < functions.size(); i++)
 			{
-				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrDuplicateDeclaration);
+				if (functions.at(i).name != next.value().GetValueString())
+					continue;
+				if (!functions.at(i).instructions.empty())
+					return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrDuplicateDeclaration);
+				prototype = i;
 			}
 
 			std::vector<std::string> instru;
@@ -225,25 +293,44 @@ namespace miniplc0 {
 			}
 			addConstant(name);
 			int nameIndex = _constants.size() - 1;
-			function fun = function{ nameIndex,name,type,paraType,isConstant,paraSize,level, instru };
+			function fun = function{ nameIndex,name,type,paraType,isConstant,paraSize,level, instru, {} };
 			auto err = analyseParameterClause(fun);
 			if (err.has_value())
 			{
 				return err;
 			}
+			if (prototype >= 0 && (functions.at(prototype).type != type || functions.at(prototype).paraType != functions.back().paraType))
+			{
+				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrDuplicateDeclaration);
+			}
+			next = nextToken();
+			if (next.has_value() && next.value().GetType() == SEMICOLON)
+			{
+				// 原型的参数不留在符号表里，以免算进定义的局部变量
+				symbols.erase(std::remove_if(symbols.begin(), symbols.end(),
+					[&](const symbol& sb) { return sb.func == name; }), symbols.end());
+				continue;
+			}
+			unreadToken();
 			err = analyseCompoundStatement();
 			if (err.has_value())
 			{
 				return err;
 			}
-			auto ins = crtInstructions.at(crtInstructions.size() - 1);
-			std::string ret = "ret",iret="iret";
-			if (ins != ret && ins != iret)
+			std::string ret = "ret",iret="iret",dret="dret";
+			if (crtInstructions.empty() || crtInstructions.back() != ret && crtInstructions.back() != iret && crtInstructions.back() != dret)
 			{
-				if (functions.at(functions.size() - 1).type == VOID)
+				auto type = functions.at(functions.size() - 1).type;
+				if (type == VOID)
 				{
 					crtInstructions.push_back(ret);
 				}
+				else if (type == DOUBLE)
+				{
+					crtInstructions.push_back("ipush 0");
+					crtInstructions.push_back("i2d");
+					crtInstructions.push_back(dret);
+				}
 				else
 				{
 					crtInstructions.push_back("ipush 0");
@@ -251,6 +338,7 @@ namespace miniplc0 {
 				}
 			}
 			functions.at(functions.size() - 1).instructions = crtInstructions;
+			functions.at(functions.size() - 1).lines = crtLines;
 		}
 		return {};
 	}
@@ -266,6 +354,7 @@ namespace miniplc0 {
 		{
 			return err;
 		}
+		flushZeroVariables();
 		err = analyseStatementSequence();
 		if (err.has_value())
 		{
@@ -276,6 +365,8 @@ namespace miniplc0 {
 		{
 			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
 		}
+		// 补上的返回指令算在 } 这一行
+		markLine(next.value());
 		return {};
 	}
 	// <函数参数>
@@ -295,7 +386,8 @@ namespace miniplc0 {
 			next = nextToken();
 			// 判断是否为 const 或 int
 			if (!next.has_value() || next.value().GetType() != TokenType::CONST
-				&& next.value().GetType() != TokenType::INT && next.value().GetType() != TokenType::CHAR)
+				&& next.value().GetType() != TokenType::INT && next.value().GetType() != TokenType::CHAR
+				&& next.value().GetType() != TokenType::DOUBLE)
 			{
 				unreadToken();
 				break;
@@ -307,7 +399,7 @@ namespace miniplc0 {
 				next = nextToken();
 			}
 			// 读取 type-specifier 类型
-			if (!next.has_value() || next.value().GetType() != INT && next.value().GetType() != CHAR)
+			if (!next.has_value() || next.value().GetType() != INT && next.value().GetType() != CHAR && next.value().GetType() != DOUBLE)
 			{
 				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
 			}
@@ -345,6 +437,7 @@ namespace miniplc0 {
 		}
 		functions.emplace_back(fun);
 		crtInstructions = functions.at(functions.size() - 1).instructions;
+		crtLines.clear();
 		return {};
 	}
 	// <语句序列> ::= {<语句>}
@@ -362,6 +455,8 @@ namespace miniplc0 {
 			if (token != TokenType::LEFTBRACE &&    // {
 				token != TokenType::IF &&			// if
 				token != TokenType::WHILE &&		// while
+				token != TokenType::SWITCH &&		// switch
+				token != TokenType::BREAK &&		// break
 				token != TokenType::RETURN &&		// return
 				token != TokenType::PRINT &&			// print
 				token != TokenType::SCAN &&			// scan
@@ -392,6 +487,8 @@ namespace miniplc0 {
 		if (token != TokenType::LEFTBRACE &&    // {
 			token != TokenType::IF &&			// if
 			token != TokenType::WHILE &&		// while
+			token != TokenType::SWITCH &&		// switch
+			token != TokenType::BREAK &&		// break
 			token != TokenType::RETURN &&		// return
 			token != TokenType::PRINT&&			// print
 			token != TokenType::SCAN&&			// scan
@@ -400,6 +497,7 @@ namespace miniplc0 {
 			) {
 			return  std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
 		}
+		markLine(next.value());
 		std::optional<CompilationError> err;
 		switch (next.value().GetType()) {
 			// 这里需要你针对不同的预读结果来调用不同的子程序
@@ -482,6 +580,24 @@ namespace miniplc0 {
 			}
 			break;
 		}
+		case TokenType::SWITCH:
+		{
+			err = analyseSwitchStatement();
+			if (err.has_value())
+			{
+				return err;
+			}
+			break;
+		}
+		case TokenType::BREAK:
+		{
+			err = analyseBreakStatement();
+			if (err.has_value())
+			{
+				return err;
+			}
+			break;
+		}
 		case TokenType::RETURN:
 		{
 			err = analyseJumpStatement();
@@ -534,11 +650,8 @@ namespace miniplc0 {
 		{
 			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
 		}
-		if (fun.type == CHAR && exprType == INT)
-		{
-			crtInstructions.emplace_back("i2c");
-		}
-		crtInstructions.emplace_back("iret");
+		convert(exprType, fun.type);
+		crtInstructions.emplace_back(fun.type == DOUBLE ? "dret" : "iret");
 		return {};
 	}
 	// <循环语句>
@@ -546,6 +659,7 @@ namespace miniplc0 {
 		std::stringstream ss;
 		auto next = nextToken();
 		auto token = next.value().GetType();
+		auto keyword = next.value();
 		switch (token)
 		{
 		//'while' '(' <condition> ')' <statement>
@@ -574,10 +688,12 @@ namespace miniplc0 {
 				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
 
 			// 读取statement
+			_breakJumps.emplace_back();
 			err = analyseStatement();
 			if (err.has_value())return err;
 
-			// 跳转回到condition前面
+			// 跳转回到condition前面，算在 while 这一行
+			markLine(keyword);
 			std::string tmp = "jmp ";
 			ss << tmp << jmpBack;
 			tmp = ss.str();
@@ -587,6 +703,13 @@ namespace miniplc0 {
 			ss << crtInstructions[jmpOut] << crtInstructions.size();
 			tmp = ss.str();
 			crtInstructions[jmpOut] = tmp;
+
+			// 回填 break
+			for (auto jmp : _breakJumps.back())
+			{
+				crtInstructions[jmp] += std::to_string(crtInstructions.size());
+			}
+			_breakJumps.pop_back();
 			break;
 		}
 		case DO: {
@@ -599,6 +722,210 @@ namespace miniplc0 {
 		return {};
 	}
 
+	// <开关语句>
+	// 'switch' '(' <expression> ')' '{' {<labeled-statement>} '}'
+	// <labeled-statement> ::= 'case' (<integer-literal>|<char-literal>) ':' {<statement>}
+	//                       | 'default' ':' {<statement>}
+	// 各分支按源码顺序生成（自然 fall through），分发表放在所有分支之后：
+	//     <expression>
+	//     jmp dispatch
+	//     <分支...>
+	//     jmp end
+	// dispatch:
+	//     tableswitch low,count / lookupswitch count
+	//     <跳转表>
+	// end:
+	std::optional<CompilationError> Analyser::analyseSwitchStatement() {
+		auto next = nextToken();
+		// 读取 switch
+		if (!next.has_value() || next.value().GetType() != SWITCH)
+		{
+			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
+		}
+		auto keyword = next.value();
+		next = nextToken();
+		// 读取 (
+		if (!next.has_value() || next.value().GetType() != LEFT_BRACKET)
+		{
+			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
+		}
+		TokenType exprType;
+		auto err = analyseExpression(exprType);
+		if (err.has_value())
+		{
+			return err;
+		}
+		// 只能按整数分发
+		if (exprType == DOUBLE)
+		{
+			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrInvalidType);
+		}
+		next = nextToken();
+		// 读取 )
+		if (!next.has_value() || next.value().GetType() != RIGHT_BRACKET)
+		{
+			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
+		}
+		next = nextToken();
+		// 读取 {
+		if (!next.has_value() || next.value().GetType() != LEFTBRACE)
+		{
+			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
+		}
+		int jmpDispatch = crtInstructions.size();
+		crtInstructions.push_back("jmp ");
+
+		// case 的值 -> 分支入口
+		std::map<int32_t, int> cases;
+		int defaultEntry = -1;
+		_breakJumps.emplace_back();
+		while (true)
+		{
+			next = nextToken();
+			if (!next.has_value())
+			{
+				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
+			}
+			auto type = next.value().GetType();
+			if (type == RIGHTBRACE)
+			{
+				break;
+			}
+			if (type == CASE)
+			{
+				// [<符号>] (<integer-literal>|<char-literal>)
+				int64_t sign = 1;
+				next = nextToken();
+				if (next.has_value() && (next.value().GetType() == PLUS_SIGN || next.value().GetType() == MINUS_SIGN))
+				{
+					sign = next.value().GetType() == MINUS_SIGN ? -1 : 1;
+					next = nextToken();
+				}
+				int64_t value;
+				if (next.has_value() && next.value().GetType() == UNSIGNED_INTEGER)
+				{
+					value = std::stoll(next.value().GetValueString());
+				}
+				else if (next.has_value() && next.value().GetType() == CHAR_VALUE)
+				{
+					value = next.value().GetValueString().at(0);
+				}
+				else
+				{
+					return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
+				}
+				auto key = static_cast<int32_t>(sign * value);
+				if (cases.count(key))
+				{
+					return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrDuplicateCase);
+				}
+				cases[key] = crtInstructions.size();
+			}
+			else if (type == DEFAULT)
+			{
+				if (defaultEntry != -1)
+				{
+					return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrDuplicateCase);
+				}
+				defaultEntry = crtInstructions.size();
+			}
+			else
+			{
+				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
+			}
+			next = nextToken();
+			// 读取 :
+			if (!next.has_value() || next.value().GetType() != COLON)
+			{
+				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
+			}
+			err = analyseStatementSequence();
+			if (err.has_value())
+			{
+				return err;
+			}
+		}
+		// 最后一个分支执行完后跳过分发表
+		int jmpEnd = crtInstructions.size();
+		crtInstructions.push_back("jmp ");
+
+		// 稠密的 case 用跳转表 O(1) 分发，稀疏的用有序表二分查找
+		// 代价估计与 javac 相同：空间 + 3 * 时间
+		int64_t count = cases.size();
+		int64_t low = count ? cases.begin()->first : 0;
+		int64_t high = count ? cases.rbegin()->first : -1;
+		int64_t range = high - low + 1;
+		bool dense = count > 0 && range <= UINT16_MAX
+			&& (4 + range) + 3 * 3 <= (3 + 2 * count) + 3 * count;
+		int64_t tableSize = 2 + (dense ? range : count);
+
+		// 分发表算在 switch 这一行
+		markLine(keyword);
+		int dispatch = crtInstructions.size();
+		int end = dispatch + tableSize;
+		if (defaultEntry == -1)
+		{
+			defaultEntry = end;
+		}
+		crtInstructions[jmpDispatch] += std::to_string(dispatch);
+		crtInstructions[jmpEnd] += std::to_string(end);
+		std::stringstream ss;
+		if (dense)
+		{
+			ss << "tableswitch " << low << "," << range;
+			crtInstructions.push_back(ss.str());
+			crtInstructions.push_back("jmp " + std::to_string(defaultEntry));
+			for (int64_t key = low; key <= high; key++)
+			{
+				auto it = cases.find(static_cast<int32_t>(key));
+				int target = it == cases.end() ? defaultEntry : it->second;
+				crtInstructions.push_back("jmp " + std::to_string(target));
+			}
+		}
+		else
+		{
+			ss << "lookupswitch " << count;
+			crtInstructions.push_back(ss.str());
+			crtInstructions.push_back("jmp " + std::to_string(defaultEntry));
+			for (auto& c : cases)
+			{
+				ss.str("");
+				ss << "case " << c.first << "," << c.second;
+				crtInstructions.push_back(ss.str());
+			}
+		}
+
+		// 回填 break
+		for (auto jmp : _breakJumps.back())
+		{
+			crtInstructions[jmp] += std::to_string(end);
+		}
+		_breakJumps.pop_back();
+		return {};
+	}
+
+	// <跳出语句> ::= 'break' ';'
+	std::optional<CompilationError> Analyser::analyseBreakStatement() {
+		auto next = nextToken();
+		if (!next.has_value() || next.value().GetType() != BREAK)
+		{
+			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
+		}
+		if (_breakJumps.empty())
+		{
+			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrInvalidBreak);
+		}
+		next = nextToken();
+		if (!next.has_value() || next.value().GetType() != SEMICOLON)
+		{
+			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrNoSemicolon);
+		}
+		// 跳转目标在 while/switch 结束时回填
+		_breakJumps.back().push_back(crtInstructions.size());
+		crtInstructions.push_back("jmp ");
+		return {};
+	}
+
 	// <表达式> ::= <项>{<加法型运算符><项>}
 	std::optional<CompilationError> Analyser::analyseExpression(TokenType &myType) {
 		// <项>
@@ -620,23 +947,26 @@ namespace miniplc0 {
 			}
 
 			// <项>
+			std::size_t leftEnd = crtInstructions.size();
 			err = analyseItem(tmp);
 			if (err.has_value())
 				return err;
-			
-			myType = INT;
+
+			// 有一个操作数是 double 时，另一个也转换为 double
+			auto resultType = arithmeticType(myType, tmp);
+			if (resultType == DOUBLE && myType != DOUBLE)
+				convertLeftOperand(leftEnd);
+			convert(tmp, resultType);
+			myType = resultType;
 
 			// 根据结果生成指令
+			std::string prefix = myType == DOUBLE ? "d" : "i";
 			if (type == TokenType::PLUS_SIGN)
-				crtInstructions.emplace_back("iadd");
+				crtInstructions.emplace_back(prefix + "add");
 				//_instructions.emplace_back(Operation::ADD, 0);
 			else if (type == TokenType::MINUS_SIGN)
-				crtInstructions.emplace_back("isub");
+				crtInstructions.emplace_back(prefix + "sub");
 				//_instructions.emplace_back(Operation::SUB, 0);
-			if (tmp == INT)
-			{
-				type = INT;
-			}
 		}
 		return {};
 	}
@@ -692,31 +1022,10 @@ namespace miniplc0 {
 			return err;
 		}
 
-		int tableIndex = -1;
-		for (int i = symbols.size() - 1; i >= 0; i--)
-		{
-			if (token.GetValueString() == symbols[i].name && symbols[i].func == functions.at(functions.size() - 1).name) {
-				tableIndex = i;
-				break;
-			}
-		}
-		if (tableIndex == -1)
-		{
-			for (int i = 0; i < symbols.size(); i++)
-			{
-				if (token.GetValueString() == symbols[i].name && symbols[i].func == "") {
-					tableIndex = i;
-					break;
-				}
-			}
-		}
-		TokenType tokentype = symbols[tableIndex].type;
-		if (exprType == INT && tokentype == CHAR)
-		{
-			crtInstructions.emplace_back("i2c");
-		}
+		TokenType tokentype = getType(token.GetValueString());
+		convert(exprType, tokentype);
 		// 保存修改
-		crtInstructions.emplace_back("istore");
+		crtInstructions.emplace_back(tokentype == DOUBLE ? "dstore" : "istore");
 		// _instructions.emplace_back(Operation::STO, getIndex(token.GetValueString()));
 		//;
 		next = nextToken();
@@ -772,6 +1081,10 @@ namespace miniplc0 {
 				{
 					crtInstructions.emplace_back("cprint");
 				}
+				else if (exprType == DOUBLE)
+				{
+					crtInstructions.emplace_back("dprint");
+				}
 				else{
 					return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrInvalidPrint);
 				}
@@ -868,8 +1181,16 @@ namespace miniplc0 {
 			ins = ss.str();
 			crtInstructions.emplace_back(ins);
 		}
-		crtInstructions.emplace_back("iscan");
-		crtInstructions.emplace_back("istore");
+		if (getType(token.GetValueString()) == DOUBLE)
+		{
+			crtInstructions.emplace_back("dscan");
+			crtInstructions.emplace_back("dstore");
+		}
+		else
+		{
+			crtInstructions.emplace_back("iscan");
+			crtInstructions.emplace_back("istore");
+		}
 		return {};
 	}
 	// <条件>
@@ -879,6 +1200,11 @@ namespace miniplc0 {
 		// 分析 condition
 		TokenType type;
 		auto err = analyseExpression(type);
+		if (err.has_value())
+		{
+			return err;
+		}
+		std::size_t leftEnd = crtInstructions.size();
 		// 试探 关系符
 		auto next = nextToken();
 		if (!next.has_value())
@@ -890,44 +1216,74 @@ namespace miniplc0 {
 			next.value().GetType() != NOT_GREATER && next.value().GetType() != NOT_SMALLER &&
 			next.value().GetType() != EQUAL && next.value().GetType() != NOT_EQUAL) {
 			unreadToken();
+			// double 先与 0.0 比较
+			if (type == DOUBLE)
+			{
+				crtInstructions.push_back("ipush 0");
+				crtInstructions.push_back("i2d");
+				crtInstructions.push_back("dcmp");
+			}
 			crtInstructions.push_back("je ");
 		}
 		else
 		{
-			auto type = next.value().GetType();
+			auto relation = next.value().GetType();
 			TokenType exprType;
 			auto err = analyseExpression(exprType);
 			if (err.has_value())
 			{
 				return err;
 			}
-			crtInstructions.push_back("isub");
-			switch (type)
+			// 有 double 时用 dcmp 比较，再按比较结果跳转
+			if (arithmeticType(type, exprType) == DOUBLE)
+			{
+				if (type != DOUBLE)
+					convertLeftOperand(leftEnd);
+				convert(exprType, DOUBLE);
+				crtInstructions.push_back("dcmp");
+				switch (relation)
+				{
+					case GREATER:     crtInstructions.push_back("jle "); break;
+					case NOT_GREATER: crtInstructions.push_back("jg ");  break;
+					case NOT_EQUAL:   crtInstructions.push_back("je ");  break;
+					case EQUAL:       crtInstructions.push_back("jne "); break;
+					case SMAllER:     crtInstructions.push_back("jge "); break;
+					case NOT_SMALLER: crtInstructions.push_back("jl ");  break;
+					// relation 只会是上面的关系运算符
+					default: break;
+				}
+				return {};
+			}
+			// 直接比较两个操作数后跳转，不经过 isub（避免溢出）
+			switch (relation)
 			{
 				case GREATER: {
-					crtInstructions.push_back("jle ");
+					crtInstructions.push_back("if_icmple ");
 					break;
 				}
 				case NOT_GREATER: {
-					crtInstructions.push_back("jg ");
+					crtInstructions.push_back("if_icmpgt ");
 					break;
 				}
 				case NOT_EQUAL: {
-					crtInstructions.push_back("je ");
+					crtInstructions.push_back("if_icmpeq ");
 					break;
 				}
 				case EQUAL: {
-					crtInstructions.push_back("jne ");
+					crtInstructions.push_back("if_icmpne ");
 					break;
 				}
 				case SMAllER: {
-					crtInstructions.push_back("jge ");
+					crtInstructions.push_back("if_icmpge ");
 					break;
 				}
 				case NOT_SMALLER: {
-					crtInstructions.push_back("jl ");
+					crtInstructions.push_back("if_icmplt ");
 					break;
 				}
+				// 其余的 token（如 ':'）不是关系运算符
+				default:
+					break;
 			}
 		}
 		return {};
@@ -1017,27 +1373,34 @@ namespace miniplc0 {
 			}
 
 			//因子
+			std::size_t leftEnd = crtInstructions.size();
 			err = analyseFactor(tmpType);
 			if (err.has_value())
 				return err;
-			mytype = INT;
+
+			auto resultType = arithmeticType(mytype, tmpType);
+			if (resultType == DOUBLE && mytype != DOUBLE)
+				convertLeftOperand(leftEnd);
+			convert(tmpType, resultType);
+			mytype = resultType;
 
 			// 根据结果生成指令
+			std::string prefix = mytype == DOUBLE ? "d" : "i";
 			if (type == TokenType::MULTIPLICATION_SIGN)
-				crtInstructions.emplace_back("imul");
+				crtInstructions.emplace_back(prefix + "mul");
 				//_instructions.emplace_back(Operation::MUL, 0);
 			else if (type == TokenType::DIVISION_SIGN)
-				crtInstructions.emplace_back("idiv");
+				crtInstructions.emplace_back(prefix + "div");
 				//_instructions.emplace_back(Operation::DIV, 0);
 		}
 		return {};
 	}
 
-	// <因子> ::= [<符号>]( <标识符> | <无符号整数> | '('<表达式>')' | <函数调用>)
+	// <因子> ::= {'(' <类型> ')'} [<符号>]( <标识符> | <无符号整数> | <浮点数> | '('<表达式>')' | <函数调用>)
 	// 需要补全
 	std::optional<CompilationError> Analyser::analyseFactor(TokenType &type) {
-		bool change = false;
-		type = VOID;
+		// 类型转换，最内层的最先执行
+		std::vector<TokenType> casts;
 		//预读 类型看是否需要转换
 		while (true)
 		{
@@ -1049,24 +1412,18 @@ namespace miniplc0 {
 			next = nextToken();
 			if (!next.has_value() || next.value().GetType() != TokenType::INT
 								  && next.value().GetType() != TokenType::CHAR
+								  && next.value().GetType() != TokenType::DOUBLE
 								  && next.value().GetType() != TokenType::VOID)
 			{
 				unreadToken();
 				unreadToken();
 				break;
 			}
-			if (next.value().GetType() == TokenType::CHAR)
-			{
-				change == true;
-			}
 			if (next.value().GetType() == TokenType::VOID)
 			{
 				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrInvalidInput);
 			}
-			if (type == VOID)
-			{
-				type = next.value().GetType();
-			}
+			casts.push_back(next.value().GetType());
 			next = nextToken();
 			if (!next.has_value() || next.value().GetType() != TokenType::RIGHT_BRACKET) {
 				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
@@ -1079,15 +1436,12 @@ namespace miniplc0 {
 			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
 		if (next.value().GetType() == TokenType::PLUS_SIGN)
 			prefix = 1;
-		else if (next.value().GetType() == TokenType::MINUS_SIGN) {
+		else if (next.value().GetType() == TokenType::MINUS_SIGN)
 			prefix = -1;
-			crtInstructions.emplace_back("ipush 0");
-			//_instructions.emplace_back(Operation::LIT, 0);
-		}
 		else
 			unreadToken();
 
-		// 预读( <标识符> | <无符号整数> | '('<表达式>')' | <函数调用>)
+		// 预读( <标识符> | <无符号整数> | <浮点数> | '('<表达式>')' | <函数调用>)
 		next = nextToken();
 		if (!next.has_value())
 			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
@@ -1106,14 +1460,11 @@ namespace miniplc0 {
 				unreadToken();
 				unreadToken();
 				int index = getFunctionIndex(token.GetValueString());
-				if (functions.at(index).type != INT && functions.at(index).type != CHAR)
+				type = functions.at(index).type;
+				if (type != INT && type != CHAR && type != DOUBLE)
 				{
 					return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrInvalidIdentifier);
 				}
-				if (type == VOID)
-				{
-					type = functions.at(index).type;
-				}
 				auto err = analyseFunctionCall();
 				if (err.has_value())
 				{
@@ -1130,29 +1481,7 @@ namespace miniplc0 {
 				return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrNotDeclared);
 			}
 			int index = getIndex(token.GetValueString());
-			
-			if (type == VOID)
-			{
-				int tableIndex = -1;
-				for (int i = symbols.size() - 1; i >= 0; i--)
-				{
-					if (token.GetValueString() == symbols[i].name && symbols[i].func == functions.at(functions.size() - 1).name) {
-						tableIndex = i;
-						break;
-					}
-				}
-				if (tableIndex == -1)
-				{
-					for (int i = 0; i < symbols.size(); i++)
-					{
-						if (token.GetValueString() == symbols[i].name && symbols[i].func == "") {
-							tableIndex = i;
-							break;
-						}
-					}
-				}
-				type = symbols[tableIndex].type;
-			}
+			type = getType(token.GetValueString());
 			if (isDeclaredLocal(token.GetValueString()))
 			{
 				std::stringstream ss;
@@ -1169,30 +1498,28 @@ namespace miniplc0 {
 				ins = ss.str();
 				crtInstructions.emplace_back(ins);
 			}
-			crtInstructions.emplace_back("iload");
+			crtInstructions.emplace_back(type == DOUBLE ? "dload" : "iload");
 			//_instructions.emplace_back(Operation::LOD, getIndex(token.GetValueString()));
 			break;
 		}
 		case TokenType::UNSIGNED_INTEGER: {
-			int index = getIndex(next.value().GetValueString());
-			if (type == VOID)
-			{
-				type = INT;
-			}
+			type = INT;
 			crtInstructions.emplace_back("ipush "+next.value().GetValueString());
 			//_instructions.emplace_back(Operation::LIT, std::stoi(next.value().GetValueString()));
 			break;
 		}
+		// 浮点数放在常量表中
+		case TokenType::DOUBLE_VALUE: {
+			type = DOUBLE;
+			addConstant(next.value().GetValueString(), 'D');
+			crtInstructions.emplace_back("loadc " + std::to_string(_constants.size() - 1));
+			break;
+		}
 		case TokenType::LEFT_BRACKET: {
 			// <表达式>
-			TokenType exprType;
-			auto err = analyseExpression(exprType);
+			auto err = analyseExpression(type);
 			if (err.has_value())
 				return err;
-			if (type == VOID)
-			{
-				type = exprType;
-			}
 			// ')'
 			next = nextToken();
 			if (!next.has_value() || next.value().GetType() != TokenType::RIGHT_BRACKET)
@@ -1201,10 +1528,7 @@ namespace miniplc0 {
 			break;
 		}
 		case TokenType::CHAR_VALUE:{
-			if (type == VOID)
-			{
-				type = CHAR;
-			}
+			type = CHAR;
 			std::string ins;
 			std::stringstream ss;
 			auto s = next.value().GetValueString();
@@ -1220,13 +1544,23 @@ namespace miniplc0 {
 			return std::make_optional<CompilationError>(_current_pos, ErrorCode::ErrIncompleteExpression);
 		}
 
-		// 取负
+		// 取负，char 取负后是 int
 		if (prefix == -1)
-			crtInstructions.emplace_back("isub");
-			//_instructions.emplace_back(Operation::SUB, 0);
-		if (change)
 		{
-			crtInstructions.emplace_back("i2c");
+			if (type == DOUBLE)
+			{
+				crtInstructions.emplace_back("dneg");
+			}
+			else
+			{
+				crtInstructions.emplace_back("ineg");
+				type = INT;
+			}
+		}
+		for (auto it = casts.rbegin(); it != casts.rend(); ++it)
+		{
+			convert(type, *it);
+			type = *it;
 		}
 		return {};
 	}
@@ -1265,10 +1599,7 @@ namespace miniplc0 {
 				auto err = analyseExpression(exprType);
 				if (err.has_value())
 					return err;
-				if (types[i]==CHAR && exprType == INT)
-				{
-					crtInstructions.emplace_back("i2c");
-				}
+				convert(exprType, types[i]);
 				// 试探 ,
 				next = nextToken();
 				if (!next.has_value())
@@ -1322,8 +1653,8 @@ namespace miniplc0 {
 		symbol sb = symbol{ tk.GetValueString(),crtFuntion,isConst,type,level };
 		symbols.push_back(sb);
 	}
-	void Analyser::addConstant(std::string s) {
-		_constants.push_back(s);
+	void Analyser::addConstant(std::string s, char type) {
+		_constants.push_back(constant{ type, s });
 	}
 	bool Analyser::funcExist(std::string funcName) {
 		for (auto i : functions)
@@ -1357,7 +1688,7 @@ namespace miniplc0 {
 				}
 				else if (i.name != s)
 				{
-					index++;
+					index += slotsOf(i.type);
 				}
 				else
 				{
@@ -1375,7 +1706,7 @@ namespace miniplc0 {
 				}
 				else if (i.name != s)
 				{
-					index++;
+					index += slotsOf(i.type);
 				}
 				else
 				{
@@ -1385,6 +1716,91 @@ namespace miniplc0 {
 		}
 		return index;
 	}
+	// 先在当前函数中查找，否则查找全局的
+	TokenType Analyser::getType(const std::string& s) {
+		for (int i = symbols.size() - 1; i >= 0; i--)
+		{
+			if (s == symbols[i].name && symbols[i].func == crtFuntion)
+				return symbols[i].type;
+		}
+		for (auto& i : symbols)
+		{
+			if (s == i.name && i.func == "")
+				return i.type;
+		}
+		return INT;
+	}
+
+	int32_t Analyser::slotsOf(TokenType type) {
+		return type == DOUBLE ? 2 : 1;
+	}
+
+	TokenType Analyser::arithmeticType(TokenType lhs, TokenType rhs) {
+		return lhs == DOUBLE || rhs == DOUBLE ? DOUBLE : INT;
+	}
+
+	void Analyser::convert(TokenType from, TokenType to) {
+		if (from == to)
+			return;
+		if (to == DOUBLE)
+		{
+			crtInstructions.emplace_back("i2d");
+			return;
+		}
+		if (from == DOUBLE)
+			crtInstructions.emplace_back("d2i");
+		if (to == CHAR)
+			crtInstructions.emplace_back("i2c");
+	}
+
+	void Analyser::markLine(const Token& token) {
+		int32_t instruction = crtInstructions.size();
+		int32_t line = token.GetStartPos().first + 1;
+		// 上一项还没有指令，被这一项取代
+		if (!crtLines.empty() && crtLines.back().first == instruction)
+			crtLines.pop_back();
+		if (crtLines.empty() || crtLines.back().second != line)
+			crtLines.emplace_back(instruction, line);
+	}
+
+	// 待清零的变量是当前作用域最后声明的，所以从作用域的总单元数往前数就是它们的偏移。
+	// 全 0 的两个单元也是 double 的 0.0。
+	void Analyser::flushZeroVariables() {
+		int32_t slots = 0;
+		for (auto type : _zeroVariables)
+			slots += slotsOf(type);
+		if (slots < ZERO_FILL_MIN_SLOTS)
+		{
+			for (auto type : _zeroVariables)
+			{
+				crtInstructions.emplace_back("ipush 0");
+				if (type == DOUBLE)
+					crtInstructions.emplace_back("i2d");
+			}
+		}
+		else
+		{
+			int32_t end = 0;
+			for (auto& sb : symbols)
+			{
+				if (sb.func == crtFuntion)
+					end += slotsOf(sb.type);
+			}
+			crtInstructions.push_back("snew " + std::to_string(slots));
+			crtInstructions.push_back("loada 0," + std::to_string(end - slots));
+			crtInstructions.push_back("ipush 0");
+			crtInstructions.push_back("ipush " + std::to_string(slots));
+			crtInstructions.push_back("memset");
+		}
+		_zeroVariables.clear();
+	}
+
+	// 右操作数已经在栈顶，没有能转换次栈顶的指令，所以直接插在左操作数之后。
+	// 表达式中没有跳转指令，而之前记录的跳转位置都在 leftEnd 之前，插入不会破坏回填。
+	void Analyser::convertLeftOperand(std::size_t leftEnd) {
+		crtInstructions.insert(crtInstructions.begin() + leftEnd, "i2d");
+	}
+
 	// 获得函数index
 	int Analyser::getFunctionIndex(std::string s) {
 		for (int i  = 0;i < functions.size(); i++)
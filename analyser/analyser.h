@@ -7,6 +7,7 @@
 #include <stack>
 #include <vector>
 #include <optional>
+#include <ostream>
 #include <utility>
 #include <map>
 #include <cstdint>
@@ -29,7 +30,14 @@ namespace miniplc0 {
 			int paraSize;
 			int level;
 			std::vector<std::string> instructions;
+			// 行号表：(指令下标, 源码行号)，该指令及其后直到下一项的指令都来自这一行
+			std::vector<std::pair<int32_t, int32_t>> lines;
 		}function;
+		// 常量表的一项，type 是 .s0 中的 S/I/D
+		typedef struct {
+			char type;
+			std::string value;
+		}constant;
 	public:
 
 		Analyser(std::vector<Token> v)
@@ -40,6 +48,8 @@ namespace miniplc0 {
 		Analyser& operator=(Analyser) = delete;
 		// 唯一接口
 		std::pair<std::vector<Instruction>, std::optional<CompilationError>> Analyse();
+		// 输出文本汇编 (.s0)，lines 为真时在最后附上行号表 (.lines:)
+		void OutputText(std::ostream&, bool lines = false);
 	private:
 		// 所有的递归子程序
 
@@ -79,6 +89,10 @@ namespace miniplc0 {
 		std::optional<CompilationError> analyseCondition();
 		// <循环语句>
 		std::optional<CompilationError> analyseLoopStatement();
+		// <开关语句>
+		std::optional<CompilationError> analyseSwitchStatement();
+		// <跳出语句>
+		std::optional<CompilationError> analyseBreakStatement();
 		// <跳转语句>
 		std::optional<CompilationError> analyseJumpStatement();
 		// <项>
@@ -90,6 +104,21 @@ namespace miniplc0 {
 		Analyser::function getFunction(std::string);		
 		// 获得函数index
 		int getFunctionIndex(std::string);
+
+		// 类型相关操作
+
+		// 一个该类型的值占的栈单元数
+		static int32_t slotsOf(TokenType);
+		// 二元算术运算的结果类型：有 double 则为 double，否则为 int
+		static TokenType arithmeticType(TokenType, TokenType);
+		// 生成把栈顶的值从一个类型转换到另一个类型的指令
+		void convert(TokenType from, TokenType to);
+		// 把次栈顶的 int 转换为 double：在左操作数的指令之后（位置 leftEnd）插入 i2d
+		void convertLeftOperand(std::size_t leftEnd);
+		// 为 _zeroVariables 中的变量分配并清零栈单元
+		void flushZeroVariables();
+		// 记录从下一条指令开始的代码来自 token 所在的行
+		void markLine(const Token&);
 		// Token 缓冲区相关操作
 
 		// 返回下一个 token
@@ -101,19 +130,23 @@ namespace miniplc0 {
 		bool funcExist(std::string);
 		// 添加变量
 		void addVariable(const Token&,bool,TokenType);
-		void addConstant(std::string);
+		void addConstant(std::string, char type = 'S');
 		// 是否是局部变量
 		bool isDeclaredLocal(const std::string&);
 		// 是否被声明过
 		bool isDeclared(const std::string&);
 		// 是否是常量
 		bool isConstant(const std::string&);
+		// 获得 {变量，常量} 的类型
+		TokenType getType(const std::string&);
 		// 获得 {变量，常量} 在栈上的偏移
 		int32_t getIndex(const std::string&);
 	public:
 		std::vector<std::string> start, crtInstructions = start;
+		// start 和正在生成的代码的行号表，见 function::lines
+		std::vector<std::pair<int32_t, int32_t>> startLines, crtLines;
 		std::vector<function> functions;
-		std::vector<std::string> _constants;
+		std::vector<constant> _constants;
 	private:
 		std::vector<Token> _tokens;
 		std::size_t _offset;
@@ -136,6 +169,12 @@ namespace miniplc0 {
 		}symbol;
 		std::vector<symbol> symbols;
 		std::string crtFuntion = "";
+		// 已经加入符号表、还没有生成清零指令的未初始化变量的类型，按声明顺序
+		std::vector<TokenType> _zeroVariables;
+		// 至少这么多单元时用 snew + memset 清零，更少时逐个 ipush 0 的指令更少
+		static const int32_t ZERO_FILL_MIN_SLOTS = 6;
+		// 每层 while/switch 中等待回填的 break 跳转指令
+		std::vector<std::vector<int>> _breakJumps;
 		// 下一个 token 在栈的偏移
 		int32_t _nextTokenIndex;
 		int32_t level = 0;
@@ -0,0 +1,425 @@
+#include "src/file.h"
+#include "src/vm.h"
+#include "src/util/print.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Benchmark {
+    const char* name;
+    // .s0 text, hand-written where c0 itself cannot express the access pattern
+    const char* text;
+};
+
+// a, b and c are nested at levels 1, 2 and 3; the loop in c reads a variable of every enclosing level
+const char* const nestedLevels = R"(.constants:
+0 S "a"
+1 S "b"
+2 S "c"
+3 S "main"
+.start:
+0 ipush 0
+.functions:
+0 0 0 1
+1 1 0 2
+2 2 0 3
+3 3 0 1
+.F0:
+0 ipush 1
+1 call 1
+2 ret
+.F1:
+0 ipush 2
+1 call 2
+2 ret
+.F2:
+0 ipush 0
+1 loada 0,0
+2 iload
+3 ipush 3000000
+4 if_icmpge 22
+5 loada 3,0
+6 loada 3,0
+7 iload
+8 loada 2,0
+9 iload
+10 iadd
+11 loada 1,0
+12 iload
+13 iadd
+14 istore
+15 loada 0,0
+16 loada 0,0
+17 iload
+18 ipush 1
+19 iadd
+20 istore
+21 jmp 1
+22 ret
+.F3:
+0 call 0
+1 loada 1,0
+2 iload
+3 iprint
+4 printl
+5 ret
+)";
+
+// fib(25) through globals-free recursion, dominated by call and return
+const char* const calls = R"(.constants:
+0 S "fib"
+1 S "main"
+.start:
+.functions:
+0 0 1 1
+1 1 0 1
+.F0:
+0 loada 0,0
+1 iload
+2 ipush 1
+3 if_icmpgt 7
+4 loada 0,0
+5 iload
+6 iret
+7 loada 0,0
+8 iload
+9 ipush 1
+10 isub
+11 call 0
+12 loada 0,0
+13 iload
+14 ipush 2
+15 isub
+16 call 0
+17 iadd
+18 iret
+.F1:
+0 ipush 25
+1 call 0
+2 iprint
+3 printl
+4 ret
+)";
+
+// acc = acc * 0.999 + 1.0 on a double local
+const char* const doubleArithmetic = R"(.constants:
+0 S "main"
+1 D 0.999
+2 D 1.0
+.start:
+.functions:
+0 0 0 1
+.F0:
+0 snew 2
+1 ipush 0
+2 loada 0,2
+3 iload
+4 ipush 3000000
+5 if_icmpge 21
+6 loada 0,0
+7 loada 0,0
+8 dload
+9 loadc 1
+10 dmul
+11 loadc 2
+12 dadd
+13 dstore
+14 loada 0,2
+15 loada 0,2
+16 iload
+17 ipush 1
+18 iadd
+19 istore
+20 jmp 2
+21 loada 0,0
+22 dload
+23 dprint
+24 printl
+25 ret
+)";
+
+// fills a heap array of 10000 doubles, then sums it 100 times
+const char* const doubleArray = R"(.constants:
+0 S "main"
+1 D 0.5
+.start:
+.functions:
+0 0 0 1
+.F0:
+0 ipush 0
+1 ipush 0
+2 ipush 0
+3 snew 2
+4 loada 0,0
+5 ipush 20000
+6 new
+7 istore
+8 loada 0,1
+9 iload
+10 ipush 10000
+11 if_icmpge 29
+12 loada 0,0
+13 iload
+14 loada 0,1
+15 iload
+16 loada 0,1
+17 iload
+18 i2d
+19 loadc 1
+20 dmul
+21 dastore
+22 loada 0,1
+23 loada 0,1
+24 iload
+25 ipush 1
+26 iadd
+27 istore
+28 jmp 8
+29 loada 0,2
+30 iload
+31 ipush 100
+32 if_icmpge 64
+33 loada 0,1
+34 ipush 0
+35 istore
+36 loada 0,1
+37 iload
+38 ipush 10000
+39 if_icmpge 57
+40 loada 0,3
+41 loada 0,3
+42 dload
+43 loada 0,0
+44 iload
+45 loada 0,1
+46 iload
+47 daload
+48 dadd
+49 dstore
+50 loada 0,1
+51 loada 0,1
+52 iload
+53 ipush 1
+54 iadd
+55 istore
+56 jmp 36
+57 loada 0,2
+58 loada 0,2
+59 iload
+60 ipush 1
+61 iadd
+62 istore
+63 jmp 29
+64 loada 0,3
+65 dload
+66 dprint
+67 printl
+68 ret
+)";
+
+// fills a heap array of 100000 ints, then copies it to a second one and back 200 times
+const char* const blockCopy = R"(.constants:
+0 S "main"
+.start:
+.functions:
+0 0 0 1
+.F0:
+0 ipush 100000
+1 new
+2 ipush 100000
+3 new
+4 ipush 0
+5 loada 0,0
+6 iload
+7 ipush 3
+8 ipush 100000
+9 memset
+10 loada 0,2
+11 iload
+12 ipush 200
+13 if_icmpge 33
+14 loada 0,1
+15 iload
+16 loada 0,0
+17 iload
+18 ipush 100000
+19 memcpy
+20 loada 0,0
+21 iload
+22 loada 0,1
+23 iload
+24 ipush 100000
+25 memcpy
+26 loada 0,2
+27 loada 0,2
+28 iload
+29 ipush 1
+30 iadd
+31 istore
+32 jmp 10
+33 loada 0,0
+34 iload
+35 ipush 99999
+36 iaload
+37 iprint
+38 printl
+39 ret
+)";
+
+const Benchmark benchmarks[] = {
+    {"nested-levels", nestedLevels},
+    {"calls", calls},
+    {"double-arithmetic", doubleArithmetic},
+    {"double-array", doubleArray},
+    {"block-copy", blockCopy},
+};
+
+// the best of a few runs on a vm::VM or vm::UncheckedVM, in milliseconds
+template <typename VM>
+double measure(const File& file, int runs, std::string& output) {
+    double best = 0;
+    for (int i = 0; i < runs; ++i) {
+        std::stringstream out;
+        auto cout = std::cout.rdbuf(out.rdbuf());
+        auto begin = std::chrono::steady_clock::now();
+        VM::make_vm(file)->start();
+        auto end = std::chrono::steady_clock::now();
+        std::cout.rdbuf(cout);
+        double ms = std::chrono::duration<double, std::milli>(end - begin).count();
+        best = i == 0 ? ms : std::min(best, ms);
+        output = out.str();
+    }
+    return best;
+}
+
+// main calls a function of 100000 ipush/pop pairs 200 times, about 1.6 MB of instructions
+// walked straight through, so the interpreter streams its code from memory
+File largeCode() {
+    std::vector<vm::Constant> constants{{vm::Constant::Type::STRING, vm::str_t("f")}, {vm::Constant::Type::STRING, vm::str_t("main")}};
+    vm::Function f{0, 0, 1, {}};
+    for (vm::u4 i = 0; i < 100000; ++i) {
+        f.instructions.push_back({vm::OpCode::ipush, i, 0});
+        f.instructions.push_back({vm::OpCode::pop, 0, 0});
+    }
+    f.instructions.push_back({vm::OpCode::ret, 0, 0});
+    vm::Function main{1, 0, 1, {
+        {vm::OpCode::ipush, 0, 0},
+        {vm::OpCode::loada, 0, 0},
+        {vm::OpCode::iload, 0, 0},
+        {vm::OpCode::ipush, 200, 0},
+        {vm::OpCode::if_icmpge, 13, 0},
+        {vm::OpCode::call, 0, 0},
+        {vm::OpCode::loada, 0, 0},
+        {vm::OpCode::loada, 0, 0},
+        {vm::OpCode::iload, 0, 0},
+        {vm::OpCode::ipush, 1, 0},
+        {vm::OpCode::iadd, 0, 0},
+        {vm::OpCode::istore, 0, 0},
+        {vm::OpCode::jmp, 1, 0},
+        {vm::OpCode::ret, 0, 0},
+    }};
+    return File{1, std::move(constants), {}, {std::move(f), std::move(main)}};
+}
+
+// 200 functions of 30000 instructions covering every operand size
+File largeFunctions() {
+    std::vector<vm::Constant> constants{{vm::Constant::Type::STRING, vm::str_t("main")}};
+    std::vector<vm::Function> functions;
+    for (vm::u2 i = 0; i < 200; ++i) {
+        vm::Function fun{0, 0, 1, {}};
+        for (vm::u4 j = 0; j < 5000; ++j) {
+            fun.instructions.push_back({vm::OpCode::ipush, j, 0});
+            fun.instructions.push_back({vm::OpCode::loada, 1, j});
+            fun.instructions.push_back({vm::OpCode::iload, 0, 0});
+            fun.instructions.push_back({vm::OpCode::bipush, j & 0xff, 0});
+            fun.instructions.push_back({vm::OpCode::iadd, 0, 0});
+            fun.instructions.push_back({vm::OpCode::jmp, j, 0});
+        }
+        functions.push_back(std::move(fun));
+    }
+    return File{1, std::move(constants), {}, std::move(functions)};
+}
+
+// the best of a few output_binary runs, in milliseconds
+double measureEmit(File& file, int runs, std::size_t& bytes) {
+    double best = 0;
+    for (int i = 0; i < runs; ++i) {
+        std::stringstream out;
+        auto begin = std::chrono::steady_clock::now();
+        file.output_binary(out);
+        auto end = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - begin).count();
+        best = i == 0 ? ms : std::min(best, ms);
+        bytes = out.str().size();
+    }
+    return best;
+}
+
+// the best of a few parse_file_binary runs on `file` written as `version`, in milliseconds
+double measureLoad(File& file, vm::u4 version, int runs, std::size_t& bytes) {
+    std::stringstream out;
+    file.output_binary(out, version);
+    auto image = out.str();
+    bytes = image.size();
+    double best = 0;
+    for (int i = 0; i < runs; ++i) {
+        std::stringstream in(image);
+        auto begin = std::chrono::steady_clock::now();
+        File::parse_file_binary(in).decode_all();
+        auto end = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - begin).count();
+        best = i == 0 ? ms : std::min(best, ms);
+    }
+    return best;
+}
+
+}
+
+// cc0_bench [name...]: runs the named benchmarks, all of them by default, in both VM policies,
+// large-code, emit-binary, which times File::output_binary, and load-binary, which times
+// File::parse_file_binary on the version 1 and the compact version 3 format
+int main(int argc, char** argv) {
+    std::vector<std::string> selected(argv + 1, argv + argc);
+    for (auto& benchmark : benchmarks) {
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), benchmark.name) == selected.end()) {
+            continue;
+        }
+        std::stringstream text(benchmark.text);
+        auto file = File::parse_file_text(text);
+        std::string output, uncheckedOutput;
+        double checked = measure<vm::VM>(file, 3, output);
+        double unchecked = measure<vm::UncheckedVM>(file, 3, uncheckedOutput);
+        printfmt(std::cout, "{} {} ms, unchecked {} ms, printed {}", benchmark.name, checked, unchecked, output);
+        if (uncheckedOutput != output) {
+            printfmt(std::cout, "{} unchecked printed {}", benchmark.name, uncheckedOutput);
+        }
+    }
+    if (selected.empty() || std::find(selected.begin(), selected.end(), "large-code") != selected.end()) {
+        auto file = largeCode();
+        std::string output;
+        double checked = measure<vm::VM>(file, 3, output);
+        double unchecked = measure<vm::UncheckedVM>(file, 3, output);
+        printfmt(std::cout, "large-code {} ms, unchecked {} ms\n", checked, unchecked);
+    }
+    if (selected.empty() || std::find(selected.begin(), selected.end(), "emit-binary") != selected.end()) {
+        auto file = largeFunctions();
+        std::size_t bytes = 0;
+        double ms = measureEmit(file, 3, bytes);
+        printfmt(std::cout, "emit-binary {} ms, {} bytes, {} MB/s\n", ms, bytes, bytes / ms / 1000);
+    }
+    if (selected.empty() || std::find(selected.begin(), selected.end(), "load-binary") != selected.end()) {
+        auto file = largeFunctions();
+        for (vm::u4 version : {1, 3}) {
+            std::size_t bytes = 0;
+            double ms = measureLoad(file, version, 3, bytes);
+            printfmt(std::cout, "load-binary version {} {} ms, {} bytes, {} MB/s\n", version, ms, bytes, bytes / ms / 1000);
+        }
+    }
+    return 0;
+}
@@ -36,7 +36,11 @@ namespace miniplc0 {
 		ErrDuplicateDeclaration,
 		ErrNotInitialized,
 		ErrInvalidAssignment,
-		ErrInvalidPrint
+		ErrInvalidPrint,
+		ErrDuplicateCase,
+		ErrInvalidBreak,
+		ErrDoubleOverflow, // the literal is out of the range of double.
+		ErrInvalidType
 	};
 
 	class CompilationError final{
@@ -69,6 +69,18 @@ namespace fmt {
 			case miniplc0::ErrInvalidPrint:
 				name = "The output statement is invalid.";
 				break;
+			case miniplc0::ErrDuplicateCase:
+				name = "The case label has been used in this switch.";
+				break;
+			case miniplc0::ErrInvalidBreak:
+				name = "The break statement is not within a loop or switch.";
+				break;
+			case miniplc0::ErrDoubleOverflow:
+				name = "The floating literal is too big(double).";
+				break;
+			case miniplc0::ErrInvalidType:
+				name = "The expression has a type that is not allowed here.";
+				break;
 			}
 			return format_to(ctx.out(), name);
 		}
@@ -175,6 +187,9 @@ namespace fmt {
 			case miniplc0::UNSIGNED_INTEGER:
 				name = "UnsignedInteger";
 				break;
+			case miniplc0::DOUBLE_VALUE:
+				name = "DoubleValue";
+				break;
 			case miniplc0::LEFTBRACE:
 				name = "Left brace";
 				break;
@@ -232,6 +247,9 @@ namespace fmt {
 			case miniplc0::COMMA:
 				name = "Comma";
 				break;
+			case miniplc0::COLON:
+				name = "Colon";
+				break;
 			}
 			return format_to(ctx.out(), name);
 		}
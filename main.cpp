@@ -3,6 +3,7 @@
 
 #include "src/vm.h"
 #include "src/file.h"
+#include "src/compile_cache.h"
 #include "src/exception.h"
 #include "src/util/print.hpp"
 
@@ -10,12 +11,17 @@
 #include "analyser/analyser.h"
 #include "fmts.hpp"
 #include <stdlib.h>
+#include <cstdio>
 #include <iostream>
 #include <fstream>
 
 
 #include <memory>
+#include <optional>
+#include <sstream>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <exception>
 
 std::vector<miniplc0::Token> _tokenize(std::istream& input) {
@@ -35,7 +41,8 @@ void Tokenize(std::istream& input, std::ostream& output) {
 	return;
 }
 
-void Analyse(std::istream& input, std::ostream& output){
+// `lines` appends the line table of the program, see Analyser::OutputText
+void Analyse(std::istream& input, std::ostream& output, bool lines = false){
 	auto tks = _tokenize(input);
 	miniplc0::Analyser analyser(tks);
 	auto p = analyser.Analyse();
@@ -44,36 +51,7 @@ void Analyse(std::istream& input, std::ostream& output){
 		exit(2);
 	}
 
-	/*auto v = p.first;
-	for (auto& it : v)
-		output << fmt::format("{}\n", it);*/
-	output << ".constants:\n";
-	int i = 0;
-	for (auto cons : analyser._constants) {
-		output << i << " S " << '"' << cons << '"' << '\n';
-		i++;
-	}
-	output << ".start:\n";
-	auto f = analyser.start;
-	for (int i = 0; i < f.size(); i++)
-	{
-		output << i << " " << f.at(i) << std::endl;
-	}
-	output << ".functions:\n";
-	i = 0;
-	for (auto fun : analyser.functions) {
-		output << i << " " << fun.nameIndex << " " << fun.paraSize << " " << 1 << '\n';
-		i++;
-	}
-	for (int i = 0; i < analyser.functions.size(); i++)
-	{
-		output << ".F" << i << ":\n";
-		auto ins = analyser.functions.at(i).instructions;
-		for (int j = 0; j < ins.size(); j++)
-		{
-			output << j << " " << ins.at(j) << std::endl;
-		}
-	}
+	analyser.OutputText(output, lines);
 	return;
 }
 
@@ -87,36 +65,125 @@ void disassemble_binary(std::ifstream* in, std::ostream* out) {
 	}
 }
 
-void assemble_text(std::ifstream* in, std::ofstream* out, bool run = false) {
+// `version` is the .o0 format written, see File::output_binary; false if the text is invalid
+bool assemble_text(std::ifstream* in, std::ostream* out, bool run = false, vm::u4 version = 1) {
 	try {
 		File f = File::parse_file_text(*in);
 		// f.output_text(std::cout);
-		f.output_binary(*out);
+		// prototypes are resolved against the definitions in the same source
+		if (f.hasDeclarations()) {
+			std::vector<File> objects;
+			objects.push_back(std::move(f));
+			f = File::link(std::move(objects));
+		}
+		f.output_binary(*out, version);
 		if (run) {
-			auto avm = std::move(vm::VM::make_vm(f));
+			auto avm = vm::VM::make_vm(std::move(f));
 			avm->start();
 		}
 	}
 	catch (const std::exception & e) {
 		println(std::cerr, e.what());
+		return false;
 	}
+	return true;
 }
 
-void execute(std::ifstream* in, std::ostream* out) {
+// compiles every c0 source on its own and links them into one .o0 at `path`, see File::link
+void compile_and_link(const std::vector<std::string>& sources, const std::string& path, bool lines, vm::u4 version) {
+	std::vector<File> objects;
+	for (auto& source : sources) {
+		std::stringstream in(source), text;
+		Analyse(in, text, lines);
+		objects.push_back(File::parse_file_text(text, true));
+	}
+	std::stringstream linked;
 	try {
-		File f = File::parse_file_binary(*in);
-		auto avm = std::move(vm::VM::make_vm(f));
+		File::link(std::move(objects)).output_binary(linked, version);
+	}
+	catch (const std::exception& e) {
+		fmt::print(stderr, "Link error: {}\n", e.what());
+		std::remove(path.c_str());
+		exit(2);
+	}
+	std::ofstream out(path, std::ios::out | std::ios::trunc | std::ios::binary);
+	if (!out) {
+		fmt::print(stderr, "Fail to open {} for writing.\n", path);
+		exit(2);
+	}
+	out << linked.rdbuf();
+}
+
+void print_cache_stats(const CompileCache& cache, bool hit) {
+	auto stats = cache.stats();
+	fmt::print(stderr, "compile cache {}: {} hits, {} misses, {} entries, {} bytes\n",
+		hit ? "hit" : "miss", stats.hits, stats.misses, stats.entries, stats.bytes);
+}
+
+// `input` is what the program scans, std::cin when null
+// VM is vm::VM, or vm::UncheckedVM for verified files
+template <typename VM>
+void execute(const std::string& path, bool jit, bool stats, std::istream* input, bool gc) {
+	try {
+		auto avm = VM::make_vm(File::load_file_binary(path));
+		if (gc) {
+			avm->enableGC();
+		}
+		if (input) {
+			avm->setInput(*input);
+		}
+		if (jit && !avm->enableJit()) {
+			println(std::cerr, "JIT is not supported on this platform, interpreting instead");
+		}
 		avm->start();
+		if (stats) {
+			avm->printStats(std::cerr);
+		}
+	}
+	catch (const std::exception & e) {
+		println(std::cerr, e.what());
+	}
+}
+
+void emit_c(const std::string& path, std::ostream* out) {
+	try {
+		File f = File::load_file_binary(path);
+		f.output_c(*out);
 	}
 	catch (const std::exception & e) {
 		println(std::cerr, e.what());
 	}
 }
 
+// the input files on the command line: what is neither an option nor the value of one.
+// argparse takes a fixed number of values for a positional, so they are counted up front.
+std::size_t count_inputs(int argc, char** argv) {
+	// the options that take a value, single letters may also come in a group like -co
+	static const std::vector<std::string> valued = { "--format", "--input", "--cache", "--cache-size", "-o", "--output" };
+	const auto takes_value = [](const std::string& arg) {
+		if (std::find(valued.begin(), valued.end(), arg) != valued.end()) {
+			return true;
+		}
+		return arg.size() > 2 && arg[1] != '-' && arg.find('o') != std::string::npos;
+	};
+	std::size_t count = 0;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg.empty() || arg[0] != '-') {
+			++count;
+		}
+		else if (takes_value(arg)) {
+			++i;
+		}
+	}
+	return count;
+}
+
 int main(int argc, char** argv) {
 	argparse::ArgumentParser program("cc0");
 	program.add_argument("input")
-		.help("speicify the file to be compiled.");
+		.nargs(std::max<std::size_t>(count_inputs(argc, argv), 1))
+		.help("speicify the file to be compiled, with -c several c0 files are compiled and linked into one .o0.");
 	program.add_argument("-s")
 		.default_value(false)
 		.implicit_value(true)
@@ -125,6 +192,46 @@ int main(int argc, char** argv) {
 		.default_value(false)
 		.implicit_value(true)
 		.help("perform syntactic analysis for the input file.");
+	program.add_argument("-g")
+		.default_value(false)
+		.implicit_value(true)
+		.help("with -s or -c, record the source line of every statement, which stack traces and --stats show.");
+	program.add_argument("--format")
+		.default_value(std::string("1"))
+		.help("the .o0 format written with -c: 1, 2 for the sectioned format whose functions are decoded on their first call, or 3 for the compact format with variable-length operands.");
+	program.add_argument("-r")
+		.default_value(false)
+		.implicit_value(true)
+		.help("interpret the input .o0 file.");
+	program.add_argument("--jit")
+		.default_value(false)
+		.implicit_value(true)
+		.help("compile functions to native code when running with -r.");
+	program.add_argument("--stats")
+		.default_value(false)
+		.implicit_value(true)
+		.help("print execution statistics after running with -r, or the compile cache counters with -c.");
+	program.add_argument("--gc")
+		.default_value(false)
+		.implicit_value(true)
+		.help("collect unreachable heap blocks when running with -r, --stats lists the collections.");
+	program.add_argument("--unchecked")
+		.default_value(false)
+		.implicit_value(true)
+		.help("run with -r without the memory and division checks, the file has to pass the verifier.");
+	program.add_argument("--input")
+		.default_value(std::string(""))
+		.help("read the input of the program run with -r from this file instead of stdin.");
+	program.add_argument("--emit-c")
+		.default_value(false)
+		.implicit_value(true)
+		.help("translate the input .o0 file into a standalone C program.");
+	program.add_argument("--cache")
+		.default_value(std::string(""))
+		.help("with -c, reuse the .o0 files kept in this directory for sources compiled before with the same options.");
+	program.add_argument("--cache-size")
+		.default_value(std::string("64"))
+		.help("the megabytes the --cache directory may take, the least recently used files are removed beyond that.");
 	program.add_argument("-o", "--output")
 		.required()
 		.default_value(std::string("out"))
@@ -139,8 +246,102 @@ int main(int argc, char** argv) {
 		exit(2);
 	}
 
-	auto input_file = program.get<std::string>("input");
+	auto format = program.get<std::string>("--format");
+	if (format != "1" && format != "2" && format != "3") {
+		fmt::print(stderr, "Unknown .o0 format {}.\n", format);
+		exit(2);
+	}
+	auto input_files = program.get<std::vector<std::string>>("input");
+	auto input_file = input_files.front();
 	auto output_file = program.get<std::string>("--output");
+	std::optional<CompileCache> cache;
+	vm::u8 cache_key = 0;
+	auto cache_options = fmt::format("format={} lines={}", format, program["-g"] == true);
+	auto cache_dir = program.get<std::string>("--cache");
+	if (!cache_dir.empty()) {
+		try {
+			cache.emplace(cache_dir, static_cast<vm::u8>(std::stoull(program.get<std::string>("--cache-size"))) << 20);
+		}
+		catch (const std::logic_error&) {
+			fmt::print(stderr, "Invalid cache size {}.\n", program.get<std::string>("--cache-size"));
+			exit(2);
+		}
+	}
+	if (input_files.size() > 1 && (program["-c"] == false || program["-s"] == true || program["-r"] == true
+		|| program["--emit-c"] == true || output_file == "-")) {
+		fmt::print(stderr, "Several input files can only be compiled with -c into an output file.\n");
+		exit(2);
+	}
+	if (program["-r"] == true) {
+		if (!std::ifstream(input_file, std::ios::in | std::ios::binary)) {
+			fmt::print(stderr, "Fail to open {} for reading.\n", input_file);
+			exit(2);
+		}
+		// the VM reads and writes through iostreams only, and cin and cerr stay tied to cout
+		std::ios::sync_with_stdio(false);
+		auto scan_file = program.get<std::string>("--input");
+		std::ifstream scan_in;
+		if (!scan_file.empty()) {
+			scan_in.open(scan_file, std::ios::in | std::ios::binary);
+			if (!scan_in) {
+				fmt::print(stderr, "Fail to open {} for reading.\n", scan_file);
+				exit(2);
+			}
+		}
+		auto run = program["--unchecked"] == true ? execute<vm::UncheckedVM> : execute<vm::VM>;
+		run(input_file, program["--jit"] == true, program["--stats"] == true, scan_file.empty() ? nullptr : &scan_in, program["--gc"] == true);
+		return 0;
+	}
+	if (program["--emit-c"] == true) {
+		if (!std::ifstream(input_file, std::ios::in | std::ios::binary)) {
+			fmt::print(stderr, "Fail to open {} for reading.\n", input_file);
+			exit(2);
+		}
+		if (output_file == "-") {
+			emit_c(input_file, &std::cout);
+			return 0;
+		}
+		std::ofstream out(output_file, std::ios::out | std::ios::trunc);
+		if (!out) {
+			fmt::print(stderr, "Fail to open {} for writing.\n", output_file);
+			exit(2);
+		}
+		emit_c(input_file, &out);
+		return 0;
+	}
+	if (input_files.size() > 1) {
+		std::vector<std::string> sources;
+		// each source after its length, so moving text from one file to the next changes the key
+		std::string joined;
+		for (auto& name : input_files) {
+			std::ifstream in(name, std::ios::in | std::ios::binary);
+			if (!in) {
+				fmt::print(stderr, "Fail to open {} for reading.\n", name);
+				exit(2);
+			}
+			std::stringstream ss;
+			ss << in.rdbuf();
+			sources.push_back(ss.str());
+			joined += std::to_string(sources.back().size()) + ":" + sources.back();
+		}
+		if (cache) {
+			cache_key = CompileCache::key(joined, cache_options);
+			if (cache->fetch(cache_key, output_file)) {
+				if (program["--stats"] == true) {
+					print_cache_stats(*cache, true);
+				}
+				return 0;
+			}
+		}
+		compile_and_link(sources, output_file, program["-g"] == true, static_cast<vm::u4>(std::stoul(format)));
+		if (cache) {
+			cache->store(cache_key, output_file);
+			if (program["--stats"] == true) {
+				print_cache_stats(*cache, false);
+			}
+		}
+		return 0;
+	}
 	std::istream* input;
 	std::ostream* output;
 	std::ifstream inf;
@@ -155,6 +356,19 @@ int main(int argc, char** argv) {
 	}
 	else
 		input = &std::cin;
+	// a hit skips tokenizing and analysis, the .s0 next to the output is not written then
+	std::stringstream source;
+	if (cache && program["-c"] == true && program["-s"] == false && output_file != "-") {
+		source << input->rdbuf();
+		cache_key = CompileCache::key(source.str(), cache_options);
+		if (cache->fetch(cache_key, output_file)) {
+			if (program["--stats"] == true) {
+				print_cache_stats(*cache, true);
+			}
+			return 0;
+		}
+		input = &source;
+	}
 	if (output_file != "-") {
 		std::stringstream ss;
 		std::string tmp = output_file;
@@ -179,16 +393,15 @@ int main(int argc, char** argv) {
 		exit(2);
 	}
 	else if (program["-s"] == true) {
-		Analyse(*input, *output);
+		Analyse(*input, *output, program["-g"] == true);
 	}
 	else if (program["-c"] == true)
 	{
-		Analyse(*input, *output);
+		Analyse(*input, *output, program["-g"] == true);
 			inf.close();
 			outf.close();
 		{
 			std::ifstream* input;
-			std::ostream* output;
 			std::ifstream inf;
 			std::ofstream outf;
 
@@ -197,15 +410,28 @@ int main(int argc, char** argv) {
 				exit(2);
 			}
 			input = &inf;
+			// the output file is only written once the source assembled and linked
+			std::stringstream binary;
+			bool assembled = assemble_text(input, &binary, false, static_cast<vm::u4>(std::stoul(format)));
+			inf.close();
+			if (!assembled) {
+				// an .o0 left from an earlier compile would look like the result of this one
+				std::remove(output_file.c_str());
+				exit(2);
+			}
 			outf.open(output_file, std::ios::out | std::ios::trunc|std::ios::binary);
 			if (!outf) {
-				inf.close();
+				fmt::print(stderr, "Fail to open {} for writing.\n", output_file);
 				exit(2);
 			}
-			output = &outf;
-			assemble_text(input, dynamic_cast<std::ofstream*>(output), false);
-			inf.close();
+			outf << binary.rdbuf();
 			outf.close();
+			if (cache && output_file != "-") {
+				cache->store(cache_key, output_file);
+				if (program["--stats"] == true) {
+					print_cache_stats(*cache, false);
+				}
+			}
 		}
 		return 0;
 	}
@@ -0,0 +1,168 @@
+#include "./compile_cache.h"
+
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+const char* const CompileCache::COMPILER_VERSION = "cc0 1";
+const vm::u8 CompileCache::DEFAULT_MAX_BYTES = 64 << 20;
+
+namespace {
+
+// entries are "<16 hex digits>.o0", the counters live next to them
+const char* const ENTRY_EXTENSION = ".o0";
+const char* const STATS_FILE = "stats";
+
+// 64-bit FNV-1a, continued from `hash`
+vm::u8 fnv1a(std::string_view bytes, vm::u8 hash) {
+    for (unsigned char ch : bytes) {
+        hash = (hash ^ ch) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// a name no other process writes to, for files that are renamed into place
+fs::path temporary(const fs::path& directory) {
+    static std::mt19937_64 random{std::random_device{}()};
+    return directory / ("tmp" + std::to_string(random()));
+}
+
+// {hits, misses}, zero when the file is missing or unreadable
+std::pair<vm::u8, vm::u8> readCounters(const fs::path& path) {
+    vm::u8 hits = 0, misses = 0;
+    std::ifstream in(path);
+    if (!(in >> hits >> misses)) {
+        return {0, 0};
+    }
+    return {hits, misses};
+}
+
+}
+
+CompileCache::CompileCache(fs::path directory, vm::u8 maxBytes)
+    : _directory(std::move(directory)), _maxBytes(maxBytes) {
+    std::error_code ec;
+    fs::create_directories(_directory, ec);
+}
+
+vm::u8 CompileCache::key(std::string_view source, std::string_view options) {
+    // the parts are separated by a byte that cannot end the version or the options
+    vm::u8 hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a(COMPILER_VERSION, hash);
+    hash = fnv1a(std::string_view("\0", 1), hash);
+    hash = fnv1a(options, hash);
+    hash = fnv1a(std::string_view("\0", 1), hash);
+    return fnv1a(source, hash);
+}
+
+bool CompileCache::fetch(vm::u8 key, const fs::path& output) {
+    std::error_code ec;
+    auto path = entry(key);
+    bool hit = fs::copy_file(path, output, fs::copy_options::overwrite_existing, ec) && !ec;
+    if (hit) {
+        // eviction goes by the modification time, a hit makes the entry the most recent
+        fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    }
+    count(hit);
+    return hit;
+}
+
+void CompileCache::store(vm::u8 key, const fs::path& compiled) {
+    // copied aside and renamed, so a concurrent fetch never sees half an entry
+    std::error_code ec;
+    auto tmp = temporary(_directory);
+    if (!fs::copy_file(compiled, tmp, fs::copy_options::overwrite_existing, ec) || ec) {
+        fs::remove(tmp, ec);
+        return;
+    }
+    fs::rename(tmp, entry(key), ec);
+    if (ec) {
+        fs::remove(tmp, ec);
+        return;
+    }
+    evict();
+}
+
+CompileCache::Stats CompileCache::stats() const {
+    auto counters = readCounters(_directory / STATS_FILE);
+    Stats stats{counters.first, counters.second, 0, 0};
+    std::error_code ec;
+    for (fs::directory_iterator it(_directory, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->path().extension() == ENTRY_EXTENSION) {
+            auto size = it->file_size(ec);
+            if (!ec) {
+                ++stats.entries;
+                stats.bytes += size;
+            }
+        }
+    }
+    return stats;
+}
+
+fs::path CompileCache::entry(vm::u8 key) const {
+    static const char digits[] = "0123456789abcdef";
+    std::string name(16, '0');
+    for (int i = 15; i >= 0; --i, key >>= 4) {
+        name[i] = digits[key & 0xf];
+    }
+    return _directory / (name + ENTRY_EXTENSION);
+}
+
+void CompileCache::count(bool hit) {
+    auto path = _directory / STATS_FILE;
+    auto counters = readCounters(path);
+    (hit ? counters.first : counters.second) += 1;
+    std::error_code ec;
+    auto tmp = temporary(_directory);
+    {
+        std::ofstream out(tmp, std::ios::out | std::ios::trunc);
+        if (!(out << counters.first << ' ' << counters.second << '\n')) {
+            fs::remove(tmp, ec);
+            return;
+        }
+    }
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        fs::remove(tmp, ec);
+    }
+}
+
+void CompileCache::evict() {
+    struct Entry {
+        fs::path path;
+        fs::file_time_type used;
+        vm::u8 size;
+    };
+    std::vector<Entry> entries;
+    vm::u8 total = 0;
+    std::error_code ec;
+    for (fs::directory_iterator it(_directory, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->path().extension() != ENTRY_EXTENSION) {
+            continue;
+        }
+        std::error_code entryError;
+        auto size = it->file_size(entryError);
+        auto used = it->last_write_time(entryError);
+        if (!entryError) {
+            entries.push_back({it->path(), used, size});
+            total += size;
+        }
+    }
+    if (total <= _maxBytes) {
+        return;
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    for (auto& e : entries) {
+        if (total <= _maxBytes) {
+            break;
+        }
+        if (fs::remove(e.path, ec)) {
+            total -= e.size;
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef COMPILE_CACHE_H_INCLUDED
+#define COMPILE_CACHE_H_INCLUDED
+
+#include "./type.h"
+
+#include <filesystem>
+#include <string_view>
+
+// A directory of .o0 files compiled before, named by a hash of the source, the compiler
+// version and the options that change the output, so compiling the same source again is a
+// file copy. The least recently used entries are removed once the directory holds more than
+// its size limit. A cache that cannot be read or written only misses: nothing here throws
+// on I/O errors, and the counters are best effort when several compilers share a directory.
+class CompileCache {
+public:
+    // part of every key, to be changed whenever the compiler writes different code for the same source
+    static const char* const COMPILER_VERSION;
+    static const vm::u8 DEFAULT_MAX_BYTES;
+
+    struct Stats {
+        // lookups over the lifetime of the directory
+        vm::u8 hits;
+        vm::u8 misses;
+        vm::u8 entries;
+        vm::u8 bytes;
+    };
+
+    explicit CompileCache(std::filesystem::path directory, vm::u8 maxBytes = DEFAULT_MAX_BYTES);
+
+    // `options` names every flag that changes the .o0 written for `source`
+    static vm::u8 key(std::string_view source, std::string_view options);
+    // copies the entry of `key` to `output` and counts a hit, or counts a miss and returns false
+    bool fetch(vm::u8 key, const std::filesystem::path& output);
+    // adds `compiled` as the entry of `key`, then evicts the least recently used entries
+    // until the directory fits
+    void store(vm::u8 key, const std::filesystem::path& compiled);
+    Stats stats() const;
+
+private:
+    std::filesystem::path entry(vm::u8 key) const;
+    void count(bool hit);
+    void evict();
+
+    std::filesystem::path _directory;
+    vm::u8 _maxBytes;
+};
+
+#endif
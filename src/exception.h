@@ -23,6 +23,18 @@ public:
     virtual ~InCompleteFile() {}
 };
 
+// the objects given to File::link do not make up one program
+class LinkError : public std::exception {
+public:
+    LinkError(std::string msg) : msg(std::move(msg)) {}
+    virtual ~LinkError() {}
+    virtual const char* what() const noexcept {
+        return msg.c_str();
+    }
+private:
+    std::string msg;
+};
+
 namespace vm {
     
 class InvalidMemoryAccess : public std::exception {
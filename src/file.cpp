@@ -4,26 +4,644 @@
 #include "./constant.h"
 #include "./function.h"
 #include "./exception.h"
+#include "./verifier.h"
 #include "./util/print.hpp"
 
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define C0_HAS_MMAP 1
+#endif
 
 File::File(
     vm::u4 version, 
     std::vector<vm::Constant> constants, 
     std::vector<vm::Instruction> instructions, 
     std::vector<vm::Function> functions
-) : version(version), constants(constants), start(instructions), functions(functions) {
+) : version(version), constants(std::move(constants)), start(std::move(instructions)), functions(std::move(functions)) {
     //
 }
 
+namespace {
+
+// Builds a version 1 image, big-endian, in one buffer that is written out at once.
+class ByteWriter {
+public:
+    explicit ByteWriter(std::size_t capacity) : _bytes(capacity), _size(0) {}
+
+    template <typename T>
+    void put(T value) {
+        auto p = grow(sizeof(T));
+        for (std::size_t i = 0; i < sizeof(T); ++i) {
+            p[i] = static_cast<char>((static_cast<vm::u8>(value) >> (8 * (sizeof(T) - 1 - i))) & 0xff);
+        }
+    }
+
+    void putBytes(const std::string& bytes) {
+        std::memcpy(grow(bytes.size()), bytes.data(), bytes.size());
+    }
+
+    void putInstruction(const vm::Instruction& ins) {
+        auto& info = vm::infoOf(ins.op);
+        put<vm::u1>(static_cast<vm::u1>(ins.op));
+        putOperand(info.operandSizes[0], ins.x);
+        putOperand(info.operandSizes[1], ins.y);
+    }
+
+    void writeTo(std::ostream& out) const {
+        out.write(_bytes.data(), _size);
+    }
+
+private:
+    char* grow(std::size_t count) {
+        if (_size + count > _bytes.size()) {
+            _bytes.resize(std::max(2 * _bytes.size(), _size + count));
+        }
+        auto p = _bytes.data() + _size;
+        _size += count;
+        return p;
+    }
+
+    void putOperand(vm::u1 size, vm::u4 value) {
+        switch (size) {
+        case 0: break;
+        case 1: put<vm::u1>(static_cast<vm::u1>(value)); break;
+        case 2: put<vm::u2>(static_cast<vm::u2>(value)); break;
+        case 4: put<vm::u4>(value); break;
+        default: assert(("unexpected error", false));
+        }
+    }
+
+    std::vector<char> _bytes;
+    // bytes written so far, _bytes is allocated ahead
+    std::size_t _size;
+};
+
+}
+
+// Little-endian fields and LEB128 varints, for the formats after version 1 and the line tables
+namespace {
+
+template <typename T>
+void putLittleEndian(std::string& out, T value) {
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        out += static_cast<char>((static_cast<vm::u8>(value) >> (8 * i)) & 0xff);
+    }
+}
+
+template <typename T>
+T getLittleEndian(const unsigned char* p) {
+    vm::u8 value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        value |= static_cast<vm::u8>(p[i]) << (8 * i);
+    }
+    return static_cast<T>(value);
+}
+
+void putVarint(std::string& out, vm::u4 value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+vm::u4 zigzag(vm::u4 value) {
+    return (value << 1) ^ static_cast<vm::u4>(static_cast<vm::i4>(value) >> 31);
+}
+
+vm::u4 unzigzag(vm::u4 value) {
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+// Reads the varints of an image from `pos` on. Away from the end of the image a varint is
+// decoded from one 8-byte load without a loop: the first byte with its top bit clear ends it.
+class VarintReader {
+public:
+    VarintReader(const unsigned char* buffer, std::size_t size, std::size_t pos) : _buffer(buffer), _size(size), _pos(pos) {}
+
+    vm::u4 read() {
+        if (_size - _pos < 8) {
+            return readSlowly();
+        }
+        auto word = getLittleEndian<vm::u8>(_buffer + _pos);
+        // the top bits of the bytes up to and including the last one
+        auto stops = ~word & 0x8080808080808080ull;
+        auto last = stops & (0 - stops);
+        auto mask = (last << 1) - 1;
+        auto length = ((mask & 0x0101010101010101ull) * 0x0101010101010101ull) >> 56;
+        if (length > 5) {
+            throw InvalidFile("invalid binary file: invalid varint");
+        }
+        word &= mask;
+        auto value = (word & 0x7f) | ((word >> 1) & 0x3f80) | ((word >> 2) & 0x1fc000)
+            | ((word >> 3) & 0xfe00000) | ((word >> 4) & 0x7f0000000ull);
+        if (value > U4_MAX) {
+            throw InvalidFile("invalid binary file: invalid varint");
+        }
+        _pos += length;
+        return static_cast<vm::u4>(value);
+    }
+
+    // `n` raw bytes
+    const unsigned char* take(std::size_t n, const char* msg) {
+        if (n > _size - _pos) {
+            throw InvalidFile(msg);
+        }
+        auto p = _buffer + _pos;
+        _pos += n;
+        return p;
+    }
+
+    bool atEnd() const { return _pos == _size; }
+
+private:
+    vm::u4 readSlowly() {
+        vm::u8 value = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            if (_pos == _size) {
+                throw InvalidFile("incomplete binary file");
+            }
+            auto byte = _buffer[_pos++];
+            value |= static_cast<vm::u8>(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                if (value > U4_MAX) {
+                    break;
+                }
+                return static_cast<vm::u4>(value);
+            }
+        }
+        throw InvalidFile("invalid binary file: invalid varint");
+    }
+
+    const unsigned char* _buffer;
+    std::size_t _size;
+    std::size_t _pos;
+};
+
+// The line tables, when a file has them, follow the functions in versions 1 and 3 and are
+// the LINES section of version 2. The table of start comes first, then one per function:
+// a varint count, then per entry the varint instruction delta and the zigzag varint line
+// delta from the entry before it.
+void putLineTables(std::string& out, const File& file) {
+    const auto putTable = [&](const std::vector<vm::LineEntry>& lines) {
+        putVarint(out, lines.size());
+        vm::LineEntry last{0, 0};
+        for (auto& entry : lines) {
+            putVarint(out, entry.instruction - last.instruction);
+            putVarint(out, zigzag(entry.line - last.line));
+            last = entry;
+        }
+    };
+    putTable(file.startLines);
+    for (auto& fun : file.functions) {
+        putTable(fun.lines);
+    }
+}
+
+// the tables have to fill the rest of the image
+void readLineTables(VarintReader& reader, File& file) {
+    const auto readTable = [&](std::size_t codeSize) {
+        auto count = reader.read();
+        if (count > codeSize) {
+            throw InvalidFile("invalid binary file: invalid line table");
+        }
+        std::vector<vm::LineEntry> lines;
+        lines.reserve(count);
+        vm::LineEntry entry{0, 0};
+        for (vm::u4 i = 0; i < count; ++i) {
+            auto delta = reader.read();
+            entry.line += unzigzag(reader.read());
+            // entries after the first have to move forward
+            if ((i > 0 && delta == 0) || delta >= codeSize - entry.instruction) {
+                throw InvalidFile("invalid binary file: invalid line table");
+            }
+            entry.instruction += delta;
+            lines.push_back(entry);
+        }
+        return lines;
+    };
+    file.startLines = readTable(file.start.size());
+    for (std::size_t i = 0; i < file.functions.size(); ++i) {
+        file.functions[i].lines = readTable(file.decoded(i) ? file.functions[i].instructions.size() : file.lazy[i].count);
+    }
+    if (!reader.atEnd()) {
+        throw InvalidFile("invalid binary file: unused content");
+    }
+}
+
+}
+
+// Version 2 keeps the magic and the version big-endian like version 1, everything after
+// them is little-endian and every section starts at a multiple of 8 bytes:
+//
+//   header:    u4 sectionCount, {u4 id, u4 offset, u4 size}[sectionCount]
+//   CONSTANTS: u4 count, {u1 type, then u2 length and the bytes, an i4 or an f8}[count]
+//   START:     u4 count, u4 0, instruction[count]
+//   FUNCTIONS: u4 count, u4 0, {u2 nameIndex, u2 paramSize, u2 level, i2 returnSlots,
+//              u4 first, u4 count}[count], the code being CODE[first, first + count)
+//   CODE:      instruction[]
+//   LINES:     the line tables, only there if the file has them
+//
+// An instruction takes 8 bytes, {u1 op, u1 0, u2 short operand, u4 long operand}: a 4-byte
+// operand is the long one, a 1- or 2-byte operand the short one. So a function is found
+// through the index and decoded without touching the code of the others. Sections with
+// unknown ids are skipped.
+namespace {
+
+enum SectionId : vm::u4 {
+    CONSTANTS = 1,
+    START = 2,
+    FUNCTIONS = 3,
+    CODE = 4,
+    LINES = 5,
+};
+
+const std::size_t INSTRUCTION_SIZE = 8;
+const std::size_t SECTION_ALIGNMENT = 8;
+
+void alignTo(std::string& out, std::size_t alignment) {
+    out.resize((out.size() + alignment - 1) / alignment * alignment, '\0');
+}
+
+void putInstruction(std::string& out, const vm::Instruction& ins) {
+    vm::u2 shortOperand = 0;
+    vm::u4 longOperand = 0;
+    auto& info = vm::infoOf(ins.op);
+    const vm::u4 operands[] = {ins.x, ins.y};
+    for (std::size_t i = 0; i < 2; ++i) {
+        switch (info.operandSizes[i]) {
+        case 0: break;
+        case 1: shortOperand = static_cast<vm::u1>(operands[i]); break;
+        case 2: shortOperand = static_cast<vm::u2>(operands[i]); break;
+        case 4: longOperand = operands[i]; break;
+        default: assert(("unexpected error", false));
+        }
+    }
+    putLittleEndian<vm::u1>(out, static_cast<vm::u1>(ins.op));
+    putLittleEndian<vm::u1>(out, 0);
+    putLittleEndian<vm::u2>(out, shortOperand);
+    putLittleEndian<vm::u4>(out, longOperand);
+}
+
+vm::Instruction getInstruction(const unsigned char* p) {
+    vm::Instruction ins{static_cast<vm::OpCode>(p[0]), 0, 0};
+    auto& info = vm::infoOf(ins.op);
+    if (!info.valid()) {
+        throw InvalidFile("invalid binary file: invalid opcode");
+    }
+    auto shortOperand = getLittleEndian<vm::u2>(p + 2);
+    auto longOperand = getLittleEndian<vm::u4>(p + 4);
+    vm::u4* operands[] = {&ins.x, &ins.y};
+    for (std::size_t i = 0; i < 2; ++i) {
+        switch (info.operandSizes[i]) {
+        case 0: break;
+        case 1:
+            if (shortOperand > 0xff) {
+                throw InvalidFile("invalid binary file: invalid operand");
+            }
+            *operands[i] = shortOperand;
+            break;
+        case 2: *operands[i] = shortOperand; break;
+        case 4: *operands[i] = longOperand; break;
+        default: assert(("unexpected error", false));
+        }
+    }
+    return ins;
+}
+
+void outputVersion2(const File& file, std::ostream& out) {
+    std::string constants;
+    putLittleEndian<vm::u4>(constants, file.constants.size());
+    for (auto& constant : file.constants) {
+        putLittleEndian<vm::u1>(constants, static_cast<vm::u1>(constant.type));
+        switch (constant.type) {
+        case vm::Constant::Type::STRING: {
+            auto& v = std::get<vm::str_t>(constant.value);
+            putLittleEndian<vm::u2>(constants, v.length());
+            constants += v;
+        } break;
+        case vm::Constant::Type::INT:
+            putLittleEndian<vm::u4>(constants, std::get<vm::int_t>(constant.value));
+            break;
+        case vm::Constant::Type::DOUBLE: {
+            vm::u8 bits;
+            auto v = std::get<vm::double_t>(constant.value);
+            std::memcpy(&bits, &v, sizeof bits);
+            putLittleEndian<vm::u8>(constants, bits);
+        } break;
+        default: assert(("unexpected error", false)); break;
+        }
+    }
+
+    std::string start;
+    putLittleEndian<vm::u4>(start, file.start.size());
+    putLittleEndian<vm::u4>(start, 0);
+    for (auto& ins : file.start) {
+        putInstruction(start, ins);
+    }
+
+    std::string index, code;
+    putLittleEndian<vm::u4>(index, file.functions.size());
+    putLittleEndian<vm::u4>(index, 0);
+    for (auto& fun : file.functions) {
+        putLittleEndian<vm::u2>(index, fun.nameIndex);
+        putLittleEndian<vm::u2>(index, fun.paramSize);
+        putLittleEndian<vm::u2>(index, fun.level);
+        putLittleEndian<vm::i2>(index, vm::returnSlotsOf(fun.instructions));
+        putLittleEndian<vm::u4>(index, code.size() / INSTRUCTION_SIZE);
+        putLittleEndian<vm::u4>(index, fun.instructions.size());
+        for (auto& ins : fun.instructions) {
+            putInstruction(code, ins);
+        }
+    }
+
+    std::vector<std::pair<SectionId, const std::string*>> sections{
+        {CONSTANTS, &constants}, {START, &start}, {FUNCTIONS, &index}, {CODE, &code},
+    };
+    std::string lines;
+    if (file.hasLines()) {
+        putLineTables(lines, file);
+        sections.emplace_back(LINES, &lines);
+    }
+    const vm::u4 sectionCount = sections.size();
+    std::string header;
+    putLittleEndian<vm::u4>(header, sectionCount);
+    std::size_t offset = 8 + 4 + 12 * sectionCount;
+    for (auto& [id, content] : sections) {
+        offset = (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+        putLittleEndian<vm::u4>(header, id);
+        putLittleEndian<vm::u4>(header, offset);
+        putLittleEndian<vm::u4>(header, content->size());
+        offset += content->size();
+    }
+
+    std::string image("\x43\x30\x3A\x29\x00\x00\x00\x02", 8);
+    image += header;
+    for (auto& section : sections) {
+        alignTo(image, SECTION_ALIGNMENT);
+        image += *section.second;
+    }
+    out.write(image.data(), image.size());
+}
+
+File parseVersion2(std::shared_ptr<const unsigned char> image, std::size_t size) {
+    const unsigned char* buffer = image.get();
+    const auto ensure = [&](bool cond, const char* msg) {
+        if (!cond) {
+            throw InvalidFile(msg);
+        }
+    };
+
+    // the sections, by id
+    struct Section {
+        std::size_t offset = 0;
+        std::size_t size = 0;
+        bool found = false;
+    };
+    Section sections[LINES + 1];
+    ensure(size >= 12, "incomplete binary file");
+    auto sectionCount = getLittleEndian<vm::u4>(buffer + 8);
+    ensure(sectionCount <= (size - 12) / 12, "incomplete binary file");
+    for (vm::u4 i = 0; i < sectionCount; ++i) {
+        auto entry = buffer + 12 + 12 * i;
+        auto id = getLittleEndian<vm::u4>(entry);
+        std::size_t offset = getLittleEndian<vm::u4>(entry + 4);
+        std::size_t length = getLittleEndian<vm::u4>(entry + 8);
+        ensure(offset <= size && length <= size - offset, "invalid binary file: section out of range");
+        ensure(offset % SECTION_ALIGNMENT == 0, "invalid binary file: misaligned section");
+        if (id >= CONSTANTS && id <= LINES) {
+            ensure(!sections[id].found, "invalid binary file: duplicate section");
+            sections[id] = {offset, length, true};
+        }
+    }
+    for (auto id : {CONSTANTS, START, FUNCTIONS, CODE}) {
+        ensure(sections[id].found, "invalid binary file: missing section");
+    }
+
+    // constants
+    std::size_t pos = sections[CONSTANTS].offset;
+    std::size_t end = pos + sections[CONSTANTS].size;
+    const auto take = [&](std::size_t n, const char* msg) {
+        ensure(n <= end - pos, msg);
+        auto p = buffer + pos;
+        pos += n;
+        return p;
+    };
+    auto constantsCount = getLittleEndian<vm::u4>(take(4, "incomplete binary file"));
+    ensure(constantsCount <= U2_MAX, "invalid binary file: too many constants");
+    std::vector<vm::Constant> constants;
+    constants.reserve(constantsCount);
+    for (vm::u4 j = 0; j < constantsCount; ++j) {
+        vm::Constant constant;
+        constant.type = static_cast<vm::Constant::Type>(*take(1, "incomplete binary file"));
+        switch (constant.type) {
+        case vm::Constant::Type::STRING: {
+            auto length = getLittleEndian<vm::u2>(take(2, "incomplete binary file"));
+            auto p = take(length, "invalid binary file: incomplete string constant");
+            constant.value = vm::str_t(reinterpret_cast<const char*>(p), length);
+        } break;
+        case vm::Constant::Type::INT:
+            constant.value = static_cast<vm::int_t>(getLittleEndian<vm::u4>(take(4, "incomplete binary file")));
+            break;
+        case vm::Constant::Type::DOUBLE: {
+            auto bits = getLittleEndian<vm::u8>(take(8, "invalid binary file: incomplete double constant"));
+            vm::double_t v;
+            std::memcpy(&v, &bits, sizeof v);
+            constant.value = v;
+        } break;
+        default:
+            throw InvalidFile("invalid binary file: invalid constant type");
+        }
+        constants.push_back(std::move(constant));
+    }
+
+    // start
+    pos = sections[START].offset;
+    end = pos + sections[START].size;
+    auto startCount = getLittleEndian<vm::u4>(take(8, "incomplete binary file"));
+    ensure(startCount <= U2_MAX, "invalid binary file: too many instructions");
+    auto startCode = take(startCount * INSTRUCTION_SIZE, "incomplete binary file");
+    std::vector<vm::Instruction> start;
+    start.reserve(startCount);
+    for (vm::u4 j = 0; j < startCount; ++j) {
+        start.push_back(getInstruction(startCode + j * INSTRUCTION_SIZE));
+    }
+
+    // the function index, the code stays in the image
+    pos = sections[FUNCTIONS].offset;
+    end = pos + sections[FUNCTIONS].size;
+    auto functionsCount = getLittleEndian<vm::u4>(take(8, "incomplete binary file"));
+    ensure(functionsCount <= U2_MAX, "invalid binary file: too many functions");
+    const std::size_t codeCount = sections[CODE].size / INSTRUCTION_SIZE;
+    std::vector<vm::Function> functions;
+    std::vector<File::LazyCode> lazy;
+    functions.reserve(functionsCount);
+    lazy.reserve(functionsCount);
+    bool mainFound = false;
+    for (vm::u4 j = 0; j < functionsCount; ++j) {
+        auto entry = take(16, "incomplete binary file");
+        vm::Function fun;
+        fun.nameIndex = getLittleEndian<vm::u2>(entry);
+        ensure(fun.nameIndex < constants.size() && constants[fun.nameIndex].type == vm::Constant::Type::STRING,
+            "invalid binary file: function name not found");
+        if (std::get<vm::str_t>(constants[fun.nameIndex].value) == "main") {
+            mainFound = true;
+        }
+        fun.paramSize = getLittleEndian<vm::u2>(entry + 2);
+        fun.level = getLittleEndian<vm::u2>(entry + 4);
+        auto returnSlots = getLittleEndian<vm::i2>(entry + 6);
+        ensure(returnSlots >= -1 && returnSlots <= 2, "invalid binary file: invalid return size");
+        std::size_t first = getLittleEndian<vm::u4>(entry + 8);
+        std::size_t count = getLittleEndian<vm::u4>(entry + 12);
+        ensure(first <= codeCount && count <= codeCount - first, "invalid binary file: code out of range");
+        functions.push_back(std::move(fun));
+        lazy.push_back(File::LazyCode{
+            static_cast<vm::u4>(sections[CODE].offset + first * INSTRUCTION_SIZE),
+            static_cast<vm::u4>(count), returnSlots, true
+        });
+    }
+    ensure(mainFound, "invalid binary file: main() not found");
+
+    File file{2, std::move(constants), std::move(start), std::move(functions)};
+    file.lazy = std::move(lazy);
+    if (sections[LINES].found) {
+        VarintReader reader(buffer, sections[LINES].offset + sections[LINES].size, sections[LINES].offset);
+        readLineTables(reader, file);
+    }
+    file.image = std::move(image);
+    file.imageSize = size;
+    return file;
+}
+
+}
+
+// Version 3 is version 1 with the fixed-width fields replaced by LEB128 varints, for files
+// that are shipped and cached rather than run straight away. Identical constants are merged.
+//
+//   header:    u4 magic, u4 3, big-endian like version 1
+//   constants: varint count, {u1 type, then varint length and the bytes, a zigzag varint,
+//              or f8 little-endian}[count]
+//   start:     varint count, instruction[count]
+//   functions: varint count, {varint nameIndex, varint paramSize, varint level,
+//              varint count, instruction[count]}[count]
+//   lines:     the line tables, only there if the file has them
+//
+// An instruction is its opcode byte and one varint per operand. 4-byte operands are zigzag
+// encoded first, so small negative ipush values and switch keys stay short too.
+namespace {
+
+void outputVersion3(const File& file, std::ostream& out) {
+    // the constants by their encoding, and where each old index went
+    std::string constants;
+    std::unordered_map<std::string, vm::u4> merged;
+    std::vector<vm::u4> indexOf;
+    indexOf.reserve(file.constants.size());
+    for (auto& constant : file.constants) {
+        std::string encoded(1, static_cast<char>(constant.type));
+        switch (constant.type) {
+        case vm::Constant::Type::STRING: {
+            auto& v = std::get<vm::str_t>(constant.value);
+            putVarint(encoded, v.length());
+            encoded += v;
+        } break;
+        case vm::Constant::Type::INT:
+            putVarint(encoded, zigzag(std::get<vm::int_t>(constant.value)));
+            break;
+        case vm::Constant::Type::DOUBLE: {
+            vm::u8 bits;
+            auto v = std::get<vm::double_t>(constant.value);
+            std::memcpy(&bits, &v, sizeof bits);
+            putLittleEndian<vm::u8>(encoded, bits);
+        } break;
+        default: assert(("unexpected error", false)); break;
+        }
+        auto [it, inserted] = merged.emplace(encoded, merged.size());
+        if (inserted) {
+            constants += encoded;
+        }
+        indexOf.push_back(it->second);
+    }
+
+    std::string image("\x43\x30\x3A\x29\x00\x00\x00\x03", 8);
+    putVarint(image, merged.size());
+    image += constants;
+    const auto putCode = [&](const std::vector<vm::Instruction>& code) {
+        putVarint(image, code.size());
+        for (auto& ins : code) {
+            auto& info = vm::infoOf(ins.op);
+            image += static_cast<char>(ins.op);
+            const vm::u4 operands[] = {ins.op == vm::OpCode::loadc ? indexOf.at(ins.x) : ins.x, ins.y};
+            for (std::size_t i = 0; i < 2; ++i) {
+                switch (info.operandSizes[i]) {
+                case 0: break;
+                case 1: putVarint(image, static_cast<vm::u1>(operands[i])); break;
+                case 2: putVarint(image, static_cast<vm::u2>(operands[i])); break;
+                case 4: putVarint(image, zigzag(operands[i])); break;
+                default: assert(("unexpected error", false));
+                }
+            }
+        }
+    };
+    putCode(file.start);
+    putVarint(image, file.functions.size());
+    for (auto& fun : file.functions) {
+        putVarint(image, indexOf.at(fun.nameIndex));
+        putVarint(image, fun.paramSize);
+        putVarint(image, fun.level);
+        putCode(fun.instructions);
+    }
+    if (file.hasLines()) {
+        putLineTables(image, file);
+    }
+    out.write(image.data(), image.size());
+}
+
+}
+
+
+void File::decode(vm::u2 index) {
+    if (decoded(index)) {
+        return;
+    }
+    auto& code = lazy[index];
+    std::vector<vm::Instruction> instructions;
+    instructions.reserve(code.count);
+    const unsigned char* p = image.get() + code.offset;
+    for (vm::u4 i = 0; i < code.count; ++i) {
+        instructions.push_back(getInstruction(p + i * INSTRUCTION_SIZE));
+    }
+    functions[index].instructions = std::move(instructions);
+    code.pending = false;
+}
+
+bool File::hasLines() const {
+    return !startLines.empty()
+        || std::any_of(functions.begin(), functions.end(), [](const vm::Function& fun) { return !fun.lines.empty(); });
+}
+
+void File::decode_all() {
+    for (std::size_t i = 0; i < lazy.size(); ++i) {
+        decode(static_cast<vm::u2>(i));
+    }
+}
 
 void File::output_text(std::ostream& out) {
+    decode_all();
     int i;
     
     i = 0;
@@ -56,102 +674,107 @@ void File::output_text(std::ostream& out) {
         }
         ++i;
     }
+
+    // {.start or .Fn} {instruction} {line}
+    if (hasLines()) {
+        println(out, ".lines:");
+        for (auto& entry : startLines) {
+            println(out, ".start", entry.instruction, entry.line);
+        }
+        for (std::size_t i = 0; i < functions.size(); ++i) {
+            for (auto& entry : functions[i].lines) {
+                printfmt(out, ".F{} {} {}\n", i, entry.instruction, entry.line);
+            }
+        }
+    }
 }
 
-void File::output_binary(std::ofstream& out) {
+void File::output_binary(std::ostream& out, vm::u4 version) {
+    decode_all();
+    if (version == 2) {
+        outputVersion2(*this, out);
+        return;
+    }
+    if (version == 3) {
+        outputVersion3(*this, out);
+        return;
+    }
 
-    char bytes[8];
-    const auto writeNBytes = [&](void* addr, int count) {
-        assert(0 < count && count <= 8);
-        char* p = reinterpret_cast<char*>(addr) + (count-1);
-        for (int i = 0; i < count; ++i) {
-            bytes[i] = *p--;
-        }
-        out.write(bytes, count);
-    };
+    // an instruction takes at most 7 bytes
+    std::size_t size = 14;
+    for (auto& constant : constants) {
+        size += 11 + (constant.type == vm::Constant::Type::STRING ? std::get<vm::str_t>(constant.value).length() : 0);
+    }
+    size += 7 * start.size();
+    for (auto& fun : functions) {
+        size += 8 + 7 * fun.instructions.size();
+    }
+    ByteWriter writer(size);
 
     // magic
-    out.write("\x43\x30\x3A\x29", 4);
+    writer.put<vm::u4>(magic_v);
     // version
-    out.write("\x00\x00\x00\x01", 4);
+    writer.put<vm::u4>(1);
     // constants_count
-    vm::u2 constants_count = constants.size();
-    writeNBytes(&constants_count, sizeof constants_count);
+    writer.put<vm::u2>(constants.size());
     // constants
     for (auto& constant : constants) {
         switch (constant.type)
         {
         case vm::Constant::Type::STRING: {
-            out.write("\x00", 1);
-            std::string v = std::get<vm::str_t>(constant.value);
-            vm::u2 len = v.length();
-            writeNBytes(&len, sizeof len);
-            out.write(v.c_str(), len);
+            writer.put<vm::u1>(0);
+            auto& v = std::get<vm::str_t>(constant.value);
+            writer.put<vm::u2>(v.length());
+            writer.putBytes(v);
         } break;
         case vm::Constant::Type::INT: {
-            out.write("\x01", 1);
-            vm::int_t v = std::get<vm::int_t>(constant.value);
-            writeNBytes(&v, sizeof v);
+            writer.put<vm::u1>(1);
+            writer.put<vm::u4>(std::get<vm::int_t>(constant.value));
         } break;
         case vm::Constant::Type::DOUBLE: {
-            out.write("\x02", 1);
-            vm::double_t v = std::get<vm::double_t>(constant.value);
-            writeNBytes(&v, sizeof v);
+            writer.put<vm::u1>(2);
+            vm::u8 bits;
+            auto v = std::get<vm::double_t>(constant.value);
+            std::memcpy(&bits, &v, sizeof bits);
+            writer.put<vm::u8>(bits);
         } break;
         default: assert(("unexpected error", false)); break;
         }
     }
 
     auto to_binary = [&](const std::vector<vm::Instruction>& v) {
-        vm::u2 instructions_count = v.size();
-        writeNBytes(&instructions_count, sizeof instructions_count);
+        writer.put<vm::u2>(v.size());
         for (auto& ins : v) {
-            vm::u1 op = static_cast<vm::u1>(ins.op); 
-            writeNBytes(&op, sizeof op);
-            if (auto it = vm::paramSizeOfOpCode.find(ins.op); it != vm::paramSizeOfOpCode.end()) {
-                auto paramSizes = it->second;
-                switch (paramSizes[0]) {
-                #define CASE(n) case n: { vm::u##n x = ins.x; writeNBytes(&x, n); }
-                CASE(1); break; 
-                CASE(2); break;
-                CASE(4); break;
-                #undef CASE
-                default: assert(("unexpected error", false));
-                }
-                if (paramSizes.size() == 2) {
-                    switch (paramSizes[1]) {
-                    #define CASE(n) case n: { vm::u##n y = ins.y; writeNBytes(&y, n); }
-                    CASE(1); break; 
-                    CASE(2); break;
-                    CASE(4); break;
-                    #undef CASE
-                    default: assert(("unexpected error", false));
-                    }
-                }
-            }
+            writer.putInstruction(ins);
         }
     };
 
     // start
     to_binary(start);
     // functions_count
-    vm::u2 functions_count = functions.size();
-    writeNBytes(&functions_count, sizeof functions_count);
+    writer.put<vm::u2>(functions.size());
     // functions
     for (auto& fun : functions) {
-        vm::u2 v;
-        v = fun.nameIndex; writeNBytes(&v, sizeof v);
-        v = fun.paramSize; writeNBytes(&v, sizeof v);
-        v = fun.level;     writeNBytes(&v, sizeof v);
+        writer.put<vm::u2>(fun.nameIndex);
+        writer.put<vm::u2>(fun.paramSize);
+        writer.put<vm::u2>(fun.level);
         to_binary(fun.instructions);
     }
+    // the line tables, see putLineTables
+    if (hasLines()) {
+        std::string lines;
+        putLineTables(lines, *this);
+        writer.putBytes(lines);
+    }
+    writer.writeTo(out);
 }
 
-File File::parse_file_binary(std::ifstream& in) {
-    // read raw
-    const std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(in), {});
+namespace {
+
+// Decodes and validates a whole version 1 image in one pass. The vectors are sized from the
+// counts up front and the strings are the only other copies of the image.
+File parseVersion1(const unsigned char* buffer, std::size_t bufferSize) {
     size_t pos = 0;
-    const auto bufferSize = buffer.size();
     const auto readByte = [&]() {
         if (pos + 1 > bufferSize) {
             throw InvalidFile("incomplete binary file");
@@ -197,36 +820,32 @@ File File::parse_file_binary(std::ifstream& in) {
         if (pos + length > bufferSize) {
             throw InvalidFile("invalid binary file: incomplete string constant");
         }
-        vm::str_t rtv;
-        while (length-- ) {
-            rtv += buffer[pos++];
-        }
+        vm::str_t rtv(reinterpret_cast<const char*>(buffer + pos), length);
+        pos += length;
         return rtv;
     };
     const auto readInstruction = [&]() {
-        vm::Instruction ins;
-        ins.op = static_cast<vm::OpCode>(readByte());
-        if (vm::nameOfOpCode.count(ins.op) == 0) {
+        vm::Instruction ins{static_cast<vm::OpCode>(readByte()), 0, 0};
+        auto& info = vm::infoOf(ins.op);
+        if (!info.valid()) {
             throw InvalidFile("invalid binary file: invalid opcode");
         }
-        if (auto it = vm::paramSizeOfOpCode.find(ins.op); it != vm::paramSizeOfOpCode.end()) {
-            auto paramSizes = it->second;
-            switch (paramSizes[0]) {
-            case 1: ins.x = readByte(); break;
-            case 2: ins.x = read2bytes(); break;
-            case 4: ins.x = read4bytes(); break;
+        vm::u4* operands[] = {&ins.x, &ins.y};
+        for (std::size_t i = 0; i < 2; ++i) {
+            switch (info.operandSizes[i]) {
+            case 0: break;
+            case 1: *operands[i] = readByte(); break;
+            case 2: *operands[i] = read2bytes(); break;
+            case 4: *operands[i] = read4bytes(); break;
             default: assert(("unexpected error", false));
             }
-            if (paramSizes.size() == 2) {
-                ins.y = read4bytes();
-            }
         }
         return ins;
     };
 
     // parse magic
     auto magic = read4bytes(); 
-    if (magic != magic_v) {
+    if (magic != File::magic_v) {
         throw InvalidFile("invalid binary file: invalid magic");
     }
 
@@ -236,6 +855,7 @@ File File::parse_file_binary(std::ifstream& in) {
     // parse constants
     auto constantsCount = read2bytes();
     std::vector<vm::Constant> constants;
+    constants.reserve(constantsCount);
     for (int j = 0; j < constantsCount; ++j) {
         vm::Constant constant;
         constant.type = static_cast<vm::Constant::Type>(readByte());
@@ -260,6 +880,7 @@ File File::parse_file_binary(std::ifstream& in) {
     // parse start
     auto instructionsCount = read2bytes();
     std::vector<vm::Instruction> start;
+    start.reserve(instructionsCount);
     for (int j = 0; j < instructionsCount; ++j) {
         start.push_back(std::move(readInstruction()));
     }
@@ -267,6 +888,7 @@ File File::parse_file_binary(std::ifstream& in) {
     // parse functions
     auto functionsCount = read2bytes();
     std::vector<vm::Function> functions;
+    functions.reserve(functionsCount);
     bool mainFound = false;
     for (int j = 0; j < functionsCount; ++j) {
         vm::Function fun;
@@ -283,6 +905,7 @@ File File::parse_file_binary(std::ifstream& in) {
         fun.paramSize = read2bytes();
         fun.level = read2bytes();
         auto instructionsCount = read2bytes();
+        fun.instructions.reserve(instructionsCount);
         for (int k = 0; k < instructionsCount; ++k) {
             fun.instructions.push_back(std::move(readInstruction()));
         }
@@ -293,299 +916,680 @@ File File::parse_file_binary(std::ifstream& in) {
         throw InvalidFile("invalid binary file: main() not found");
     }
 
-    if (pos != buffer.size()) {
-        throw InvalidFile("invalid binary file: unused content");
+    File file{version, std::move(constants), std::move(start), std::move(functions)};
+    // whatever follows the functions has to be the line tables
+    if (pos != bufferSize) {
+        VarintReader reader(buffer, bufferSize, pos);
+        readLineTables(reader, file);
     }
-
-    return File{version, std::move(constants), std::move(start), std::move(functions)};
+    return file;
 }
 
-File File::parse_file_text(std::ifstream& in) {
-    int line_count = 0;
-    std::string line = "";
-    std::string str = "";
-    std::stringstream ss;
-    const auto readLine = [&]() {
-        while(std::getline(in, line)) {
-            ++line_count;
-            int bg = 0;
-            int ed = line.length();
-            // remove comment
-            for (auto i = bg; i < ed; ++i) {
-                if (line[i] == '#') {
-                    ed = i;
-                    break;
-                }
-            }
-            // remove leading and trailing whitespaces
-            line = trim(std::move(line));
-            // not a blank line     
-            if (line.size() != 0) {
-                ss.str(line);
-                ss.clear();
-                return;
-            }
+File parseVersion3(const unsigned char* buffer, std::size_t size) {
+    VarintReader reader(buffer, size, 8);
+    const auto readCount = [&](const char* msg) {
+        auto count = reader.read();
+        if (count > U2_MAX) {
+            throw InvalidFile(msg);
         }
-        // eof
-        line = "";
-        ss.str("");
+        return count;
     };
-    const auto reuseLine = [&]() {
-        ss.str(line);
-        ss.clear();
+    const auto readShort = [&](vm::u4 max) {
+        auto value = reader.read();
+        if (value > max) {
+            throw InvalidFile("invalid binary file: invalid operand");
+        }
+        return value;
     };
-    const auto errorLineInfo = [&]() {
-        println(std::cerr, "line", line_count, ":\n   ", line);
+
+    auto constantsCount = readCount("invalid binary file: too many constants");
+    std::vector<vm::Constant> constants;
+    constants.reserve(constantsCount);
+    for (vm::u4 j = 0; j < constantsCount; ++j) {
+        vm::Constant constant;
+        constant.type = static_cast<vm::Constant::Type>(*reader.take(1, "incomplete binary file"));
+        switch (constant.type) {
+        case vm::Constant::Type::STRING: {
+            auto length = readShort(U2_MAX);
+            auto p = reader.take(length, "invalid binary file: incomplete string constant");
+            constant.value = vm::str_t(reinterpret_cast<const char*>(p), length);
+        } break;
+        case vm::Constant::Type::INT:
+            constant.value = static_cast<vm::int_t>(unzigzag(reader.read()));
+            break;
+        case vm::Constant::Type::DOUBLE: {
+            auto bits = getLittleEndian<vm::u8>(reader.take(8, "invalid binary file: incomplete double constant"));
+            vm::double_t v;
+            std::memcpy(&v, &bits, sizeof v);
+            constant.value = v;
+        } break;
+        default:
+            throw InvalidFile("invalid binary file: invalid constant type");
+        }
+        constants.push_back(std::move(constant));
+    }
+
+    const auto readCode = [&]() {
+        auto count = readCount("invalid binary file: too many instructions");
+        std::vector<vm::Instruction> code;
+        code.reserve(count);
+        for (vm::u4 j = 0; j < count; ++j) {
+            vm::Instruction ins{static_cast<vm::OpCode>(*reader.take(1, "incomplete binary file")), 0, 0};
+            auto& info = vm::infoOf(ins.op);
+            if (!info.valid()) {
+                throw InvalidFile("invalid binary file: invalid opcode");
+            }
+            vm::u4* operands[] = {&ins.x, &ins.y};
+            for (std::size_t i = 0; i < 2; ++i) {
+                switch (info.operandSizes[i]) {
+                case 0: break;
+                case 1: *operands[i] = readShort(0xff); break;
+                case 2: *operands[i] = readShort(U2_MAX); break;
+                case 4: *operands[i] = unzigzag(reader.read()); break;
+                default: assert(("unexpected error", false));
+                }
+            }
+            code.push_back(ins);
+        }
+        return code;
     };
-    const auto errorInvalidFile = [&](std::string msg) {
-        errorLineInfo();
+    auto start = readCode();
+
+    auto functionsCount = readCount("invalid binary file: too many functions");
+    std::vector<vm::Function> functions;
+    functions.reserve(functionsCount);
+    bool mainFound = false;
+    for (vm::u4 j = 0; j < functionsCount; ++j) {
+        vm::Function fun;
+        fun.nameIndex = readShort(U2_MAX);
+        if (fun.nameIndex >= constants.size() || constants[fun.nameIndex].type != vm::Constant::Type::STRING) {
+            throw InvalidFile("invalid binary file: function name not found");
+        }
+        if (std::get<vm::str_t>(constants[fun.nameIndex].value) == "main") {
+            mainFound = true;
+        }
+        fun.paramSize = readShort(U2_MAX);
+        fun.level = readShort(U2_MAX);
+        fun.instructions = readCode();
+        functions.push_back(std::move(fun));
+    }
+
+    if (!mainFound) {
+        throw InvalidFile("invalid binary file: main() not found");
+    }
+    File file{3, std::move(constants), std::move(start), std::move(functions)};
+    if (!reader.atEnd()) {
+        readLineTables(reader, file);
+    }
+    return file;
+}
+
+// a version 2 file keeps `image` alive for the functions it has not decoded yet
+File parseBinary(std::shared_ptr<const unsigned char> image, std::size_t size) {
+    if (size >= 8 && std::memcmp(image.get(), "\x43\x30\x3A\x29\x00\x00\x00", 7) == 0) {
+        switch (image.get()[7]) {
+        case 2: return parseVersion2(std::move(image), size);
+        case 3: return parseVersion3(image.get(), size);
+        default: break;
+        }
+    }
+    return parseVersion1(image.get(), size);
+}
+
+}
+
+File File::parse_file_binary(std::istream& in) {
+    // read raw, in blocks
+    auto buffer = std::make_shared<std::vector<unsigned char>>();
+    std::size_t size = 0;
+    auto source = in.rdbuf();
+    do {
+        buffer->resize(std::max<std::size_t>(2 * buffer->size(), 1 << 16));
+        size += source->sgetn(reinterpret_cast<char*>(buffer->data() + size), buffer->size() - size);
+    } while (size == buffer->size());
+    auto data = buffer->data();
+    return parseBinary(std::shared_ptr<const unsigned char>(std::move(buffer), data), size);
+}
+
+File File::load_file_binary(const std::string& path) {
+#ifdef C0_HAS_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw InvalidFile("cannot open " + path);
+    }
+    struct stat info;
+    void* image = MAP_FAILED;
+    std::size_t size = 0;
+    // pipes and other special files are read as a stream
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        size = static_cast<std::size_t>(info.st_size);
+        image = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (image != MAP_FAILED) {
+        std::shared_ptr<const unsigned char> mapping(static_cast<const unsigned char*>(image),
+            [size](const unsigned char* p) { munmap(const_cast<unsigned char*>(p), size); });
+        // version 1 is read front to back, version 2 jumps to the functions that get called
+        if (size < 8 || mapping.get()[7] != 2) {
+            madvise(image, size, MADV_SEQUENTIAL);
+        }
+        return parseBinary(std::move(mapping), size);
+    }
+#endif
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in) {
+        throw InvalidFile("cannot open " + path);
+    }
+    return parse_file_binary(in);
+}
+
+namespace {
+
+// isspace in the C locale: ' ' and '\t' ... '\r'
+bool isSpace(char ch) {
+    return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+bool isDigit(char ch) {
+    return ch >= '0' && ch <= '9';
+}
+
+// what try_to_int returns for `text`, false where it throws
+bool toInt(std::string_view text, vm::int_t& value) {
+    // plain decimal numbers are converted in place, after the leading spaces trim() drops
+    auto digits = text;
+    while (!digits.empty() && isSpace(digits.front())) {
+        digits.remove_prefix(1);
+    }
+    bool negative = !digits.empty() && digits.front() == '-';
+    if (negative || (!digits.empty() && digits.front() == '+')) {
+        digits.remove_prefix(1);
+    }
+    if (!digits.empty() && digits.size() <= 9 && std::all_of(digits.begin(), digits.end(), isDigit)) {
+        vm::int_t v = 0;
+        for (char ch : digits) {
+            v = v * 10 + (ch - '0');
+        }
+        value = negative ? -v : v;
+        return true;
+    }
+    try {
+        value = try_to_int(std::string(text));
+        return true;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+}
+
+bool toDouble(std::string_view text, vm::double_t& value) {
+    try {
+        value = try_to_double(std::string(text));
+        return true;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Parses .s0 text in one pass over the whole input, without copying the lines. It accepts
+// what the former line-by-line stream parser did, with the same messages and line numbers:
+// numbers are read by try_to_int rules, which take the longest valid prefix, and the rest of
+// a ".Fn:" line is not looked at.
+class TextParser {
+public:
+    TextParser(const char* begin, const char* end)
+        : _next(begin), _end(end), _line(begin), _lineEnd(begin), _cursor(begin), _limit(begin), _lineCount(0) {}
+
+    // `object` accepts a file without main, see File::parse_file_text
+    File parse(bool object);
+
+private:
+    // moves to the next line that is not blank, an empty line at the end of the input
+    void readLine();
+    void reuseLine() {
+        _cursor = _line;
+        _limit = _lineEnd;
+    }
+    // false at the end of the line
+    bool skipSpaces() {
+        while (_cursor != _limit && isSpace(*_cursor)) {
+            ++_cursor;
+        }
+        return _cursor != _limit;
+    }
+    // the next whitespace-separated word, `word` is left alone at the end of the line
+    bool readWord(std::string_view& word);
+    void ensureNoMoreInput() {
+        if (skipSpaces()) {
+            fail("invalid line");
+        }
+    }
+    vm::str_t readString();
+    std::vector<vm::Instruction> parseInstructions();
+    // the entries after ".lines:", up to the end of the input
+    void parseLines(File& file);
+    [[noreturn]] void fail(const std::string& msg) {
+        println(std::cerr, "line", _lineCount, ":\n   ", std::string(_line, _lineEnd));
         throw InvalidFile(msg);
-    };
-    #define errorIf(cond, msg)    do { if ((cond)) { errorInvalidFile((msg)); } } while(false)
-    #define errorIfNot(cond, msg) errorIf(!(cond), (msg))
-    #define errorIfAssignFailed(lhs, rhs, msg) do { try { lhs = (rhs); } catch (const std::exception&) { errorIf(true, (msg)); } } while(false)
-    auto ensureNoMoreInput = [&]() {
-        if (char ch; ss >> std::skipws >> ch) {
-            errorIf(true, "invalid line");
+    }
+
+private:
+    // the input after the current line
+    const char* _next;
+    const char* _end;
+    // the current line without its leading whitespace
+    const char* _line;
+    const char* _lineEnd;
+    // what is left to read of it
+    const char* _cursor;
+    const char* _limit;
+    int _lineCount;
+};
+
+void TextParser::readLine() {
+    while (_next != _end) {
+        auto newline = static_cast<const char*>(std::memchr(_next, '\n', _end - _next));
+        _line = _next;
+        _lineEnd = newline ? newline : _end;
+        _next = newline ? newline + 1 : _end;
+        ++_lineCount;
+        while (_line != _lineEnd && isSpace(*_line)) {
+            ++_line;
         }
-    };
+        // not a blank line
+        if (_line != _lineEnd) {
+            reuseLine();
+            return;
+        }
+    }
+    // eof
+    _line = _lineEnd = _end;
+    reuseLine();
+}
 
+bool TextParser::readWord(std::string_view& word) {
+    if (!skipSpaces()) {
+        return false;
+    }
+    auto begin = _cursor;
+    while (_cursor != _limit && !isSpace(*_cursor)) {
+        ++_cursor;
+    }
+    word = std::string_view(begin, _cursor - begin);
+    return true;
+}
+
+vm::str_t TextParser::readString() {
+    if (!skipSpaces()) {
+        fail("string constant expected");
+    }
+    if (*_cursor++ != '\"') {
+        fail("no leading qoute for string constant");
+    }
+    vm::str_t value;
+    // parse the content of string
+    while (true) {
+        if (_cursor == _limit) {
+            fail("no trailing quote for string constant");
+        }
+        char ch = *_cursor++;
+        if (ch == '\"') {
+            break;
+        }
+        if (ch != '\\') {
+            value += ch;
+            continue;
+        }
+        if (_cursor == _limit) {
+            fail("incomplete escape seq");
+        }
+        switch (ch = *_cursor++) {
+        case '\\': value += '\\'; break;
+        case '\'': value += '\''; break;
+        case '\"': value += '\"'; break;
+        case 'n':  value += '\n'; break;
+        case 'r':  value += '\r'; break;
+        case 't':  value += '\t'; break;
+        case 'x': {
+            char v = 0;
+            for (int i = 0; i < 2; ++i) {
+                if (_cursor == _limit) {
+                    fail("incomplete hex escape seq");
+                }
+                ch = *_cursor++;
+                if (!is_hex_digit(ch)) {
+                    fail("invalid hex escape seq");
+                }
+                v = static_cast<char>((v << 4) | (0xff & hex_digit_to_int(ch)));
+            }
+            value += v;
+        } break;
+        default: fail(strfmt("unknown escape seq \"\\{}\"", ch));
+        }
+    }
+    if (value.length() > UINT16_MAX) {
+        fail("too long the string constant");
+    }
+    return value;
+}
+
+std::vector<vm::Instruction> TextParser::parseInstructions() {
+    std::vector<vm::Instruction> rtv;
+    while (true) {
+        // {index} {opcode} {param1} {param2}
+        readLine();
+        std::string_view word;
+        vm::int_t index;
+        // eof, or not an instruction
+        if (!readWord(word) || !toInt(word, index)) {
+            reuseLine();
+            break;
+        }
+        if (static_cast<std::size_t>(index) != rtv.size()) {
+            fail("unordered index");
+        }
+        if (!readWord(word)) {
+            fail("opcode expected");
+        }
+        auto op = vm::mnemonics.find(word);
+        if (!op) {
+            fail("no such opcode");
+        }
+        vm::Instruction ins{*op, 0, 0};
+        if (std::size_t paramCount = vm::infoOf(ins.op).operandCount(); paramCount != 0) {
+            // the rest of the line, split at the commas
+            if (_cursor == _limit) {
+                fail("parameters expected");
+            }
+            std::size_t got = 1 + std::count(_cursor, _limit, ',');
+            if (got != paramCount) {
+                fail(strfmt("{} parameters expected, {} got", paramCount, got));
+            }
+            auto comma = std::find(_cursor, _limit, ',');
+            std::string_view first(_cursor, comma - _cursor);
+            vm::int_t value;
+            if (!toInt(first, value)) {
+                fail(strfmt("invalid first parameter: {}", first));
+            }
+            ins.x = value;
+            if (paramCount == 2) {
+                std::string_view second(comma + 1, _limit - comma - 1);
+                if (!toInt(second, value)) {
+                    fail(strfmt("invalid second parameter: {}", second));
+                }
+                ins.y = value;
+            }
+            _cursor = _limit;
+        }
+        ensureNoMoreInput();
+        rtv.push_back(ins);
+    }
+    if (rtv.size() > U2_MAX) {
+        fail("too many instructions");
+    }
+    return rtv;
+}
+
+File TextParser::parse(bool object) {
+    std::string_view str;
     readLine();
 
     // parse constants
     std::vector<vm::Constant> constants;
-    ss >> str;
+    readWord(str);
     if (str == ".constants:") {
         ensureNoMoreInput();
         while (true) {
             // {index} {type} {value}
             readLine();
+            std::string_view word;
+            vm::int_t index;
+            // eof, or not a constant
+            if (!readWord(word) || !toInt(word, index)) {
+                reuseLine();
+                break;
+            }
+            if (static_cast<std::size_t>(index) != constants.size()) {
+                fail("unordered index");
+            }
+            if (!readWord(word)) {
+                fail("constant type expected");
+            }
             vm::Constant constant;
-            std::string temp;
-            int index;
-            std::string type;
-            std::string value;
-            // eof
-            if (!(ss >> temp)) { 
-                reuseLine(); break; 
-            }
-            // parse index
-            try {
-                index = try_to_int(temp);
-            }
-            catch (const std::exception&) {
-                reuseLine(); break;
-            }
-            errorIf(index != constants.size(), "unordered index");
-            errorIfNot(ss >> type, "constant type expected");
-            if (type == "S") {
+            if (word == "S") {
                 constant.type = vm::Constant::Type::STRING;
-                char ch;
-                errorIfNot(ss >> std::skipws >> ch, "string constant expected");
-                errorIf(ch != '\"', "no leading qoute for string constant");
-                // parse the content of string
-                while (true) {
-                    errorIfNot(ss.get(ch), "no trailing quote for string constant");
-                    if (ch == '\"') { 
-                        break; 
-                    }
-                    if (ch == '\\') {
-                        errorIfNot(ss.get(ch), "incomplete escape seq");
-                        switch (ch) {
-                        case '\\': value += '\\'; break;
-                        case '\'': value += '\''; break;
-                        case '\"': value += '\"'; break;
-                        case 'n':  value += '\n'; break;
-                        case 'r':  value += '\r'; break;
-                        case 't':  value += '\t'; break;
-                        case 'x': {
-                            errorIfNot(ss.get(ch), "incomplete hex escape seq");
-                            errorIfNot(is_hex_digit(ch), "invalid hex escape seq");
-                            char v = (0xff & hex_digit_to_int(ch)) << 4;
-                            errorIfNot(ss.get(ch), "incomplete hex escape seq");
-                            errorIfNot(is_hex_digit(ch), "invalid hex escape seq");
-                            v |= (0xff & hex_digit_to_int(ch));
-                            value += v;
-                        }; break;
-                        default: errorIf(true, strfmt("unknown escape seq \"\\{}\"", ch));
-                        }
-                    }
-                    else {
-                        value += ch;
-                    }
-                }
-                errorIf(value.length() > UINT16_MAX, "too long the string constant");
-                constant.value = std::move(value);
+                constant.value = readString();
             }
-            else if (type == "I") {
+            else if (word == "I") {
                 constant.type = vm::Constant::Type::INT;
-                errorIfNot(ss >> std::skipws >> value, "invalid format");
-                errorIfAssignFailed(constant.value, try_to_int(value), "out of range or invalid format");
+                vm::int_t value;
+                if (!readWord(word)) {
+                    fail("invalid format");
+                }
+                if (!toInt(word, value)) {
+                    fail("out of range or invalid format");
+                }
+                constant.value = value;
             }
-            else if (type == "D") {
+            else if (word == "D") {
                 constant.type = vm::Constant::Type::DOUBLE;
-                errorIfNot(ss >> std::skipws >> value, "invalid format");
-                errorIfAssignFailed(constant.value, try_to_double(value), "out of range or invalid format");
+                vm::double_t value;
+                if (!readWord(word)) {
+                    fail("invalid format");
+                }
+                if (!toDouble(word, value)) {
+                    fail("out of range or invalid format");
+                }
+                constant.value = value;
             }
             else {
-                errorIf(true, "invalid constant type");
+                fail("invalid constant type");
             }
             constants.push_back(std::move(constant));
             ensureNoMoreInput();
         }
     }
     else {
-        errorIf(true, ".constants expected");
+        fail(".constants expected");
+    }
+    if (constants.size() > U2_MAX) {
+        fail("too many constants");
     }
-    errorIf(constants.size() > U2_MAX, "too many constants");
-
-    // parse instructions
-    auto parseInstructions = [&]() {
-        std::vector<vm::Instruction> rtv;
-        while(true) {
-            // {index} {opcode} {param1} {param2}
-            readLine();
-            std::string temp;
-            int index;
-            std::string opName;
-            // eof
-            if (!(ss >> temp)) { 
-                reuseLine(); break; 
-            }
-            // parse index
-            try {
-                index = try_to_int(temp);
-            }
-            catch (const std::exception&) {
-                reuseLine(); break;
-            }
-            errorIf(index != rtv.size(), "unordered index");
-            errorIfNot(ss >> opName, "opcode expected");
-            opName = to_lower(opName);
-            vm::Instruction ins;
-            if (auto it = vm::opCodeOfName.find(opName); true) {
-                errorIf(it == vm::opCodeOfName.end(), "no such opcode");
-                ins.op = it->second;
-            }
-            if (auto it = vm::paramSizeOfOpCode.find(ins.op); it != vm::paramSizeOfOpCode.end()) {
-                int paramCount = it->second.size();
-                std::string restLine;
-                errorIfNot(std::getline(ss, restLine), "parameters expected");
-                auto params = split(restLine, ',');
-                errorIf(params.size() != paramCount, 
-                    strfmt("{} parameters expected, {} got", paramCount, params.size())
-                );
-                errorIfAssignFailed(ins.x, try_to_int(params[0]), 
-                    strfmt("invalid first parameter: {}", params[0])
-                );
-                if (paramCount == 2) {
-                    errorIfAssignFailed(ins.y, try_to_int(params[1]), 
-                        strfmt("invalid second parameter: {}", params[1])
-                    );
-                }
-            }
-            ensureNoMoreInput();
-            rtv.push_back(ins);
-        }
-        errorIf(rtv.size() > U2_MAX, "too many instructions");
-        return rtv;
-    };
 
-    // parse start
+    // parse start, a failed read leaves `str` as it was
     std::vector<vm::Instruction> start;
-    ss >> str;
+    readWord(str);
     if (str == ".start:") {
         ensureNoMoreInput();
-        start = std::move(parseInstructions());
+        start = parseInstructions();
     }
     else {
-        errorIf(true, ".start expected");
+        fail(".start expected");
     }
 
     // parse functions
     std::vector<vm::Function> functions;
     bool mainFound = false;
-    ss >> str;
+    readWord(str);
     if (str == ".functions:") {
         ensureNoMoreInput();
         while (true) {
             // {index} {nameIndex} {paramSize} {level}
             readLine();
-            vm::Function function;
-            std::string temp;
-            int index;
+            std::string_view word;
+            vm::int_t index;
             // no more function
-            if (!(ss >> temp)) { 
-                reuseLine(); break; 
+            if (!readWord(word) || !toInt(word, index)) {
+                reuseLine();
+                break;
+            }
+            if (static_cast<std::size_t>(index) != functions.size()) {
+                fail("unordered index");
+            }
+            vm::Function function{0, 0, 0, {}, {}};
+            vm::int_t value;
+            if (!readWord(word)) {
+                fail("name_index expected");
             }
-            // parse index
-            try {
-                index = try_to_int(temp);
+            if (!toInt(word, value)) {
+                fail("invalid name_index");
             }
-            catch (const std::exception&) {
-                reuseLine(); break;
+            function.nameIndex = static_cast<vm::u2>(value);
+            if (function.nameIndex >= constants.size() || constants[function.nameIndex].type != vm::Constant::Type::STRING) {
+                fail("name not found");
             }
-            errorIf(index != functions.size(), "unordered index");
-            errorIfNot(ss >> temp, "name_index expected");
-            errorIfAssignFailed(function.nameIndex, try_to_int(temp), "invalid name_index");
-            errorIf(function.nameIndex >= constants.size(), "name not found");
-            errorIf(constants[function.nameIndex].type != vm::Constant::Type::STRING, "name not found");
             if (std::get<vm::str_t>(constants[function.nameIndex].value) == "main") {
                 mainFound = true;
             }
-            errorIfNot(ss >> temp, "param_size expected");
-            errorIfAssignFailed(function.paramSize, try_to_int(temp), "invalid param_size");
-            errorIf(function.paramSize > U2_MAX, "too many parameters");
-            errorIfNot(ss >> temp, "level expected");
-            errorIfAssignFailed(function.level, try_to_int(temp), "invalid level");
-            errorIf(function.level > U2_MAX, "too high the level");
+            if (!readWord(word)) {
+                fail("param_size expected");
+            }
+            if (!toInt(word, value)) {
+                fail("invalid param_size");
+            }
+            function.paramSize = static_cast<vm::u2>(value);
+            if (!readWord(word)) {
+                fail("level expected");
+            }
+            if (!toInt(word, value)) {
+                fail("invalid level");
+            }
+            function.level = static_cast<vm::u2>(value);
             functions.push_back(std::move(function));
             ensureNoMoreInput();
         }
     }
     else {
-        errorIf(true, ".functions expected");
+        fail(".functions expected");
+    }
+    if (!mainFound && !object) {
+        fail("main() not found");
+    }
+    if (functions.size() > U2_MAX) {
+        fail("too many functions");
     }
-    errorIfNot(mainFound, "main() not found");
 
-    int functions_count = functions.size();
-    errorIf(functions_count > U2_MAX, "too many functions");
-    for (int i = 0; i < functions_count; ++i) {
-        errorIfNot(ss >> str, strfmt("\".F{}:\" expected", i));
-        errorIf((str.length() < 2 || str.back() != ':'), strfmt("\".F{}:\" expected", i));
-        str.pop_back();
+    // the bodies, as ".Fn:" or "name:"
+    for (std::size_t i = 0; i < functions.size(); ++i) {
+        const auto expected = [i]() { return strfmt("\".F{}:\" expected", i); };
+        if (!readWord(str) || str.length() < 2 || str.back() != ':') {
+            fail(expected());
+        }
+        str.remove_suffix(1);
 
         int index = -1;
         if (str.front() == '.') {
-            str.erase(str.begin());
-            ss.str(str);
-            ss.clear();
-            char ch;
-            ss >> std::skipws >> ch;
-            if ((ch == 'F' || ch == 'f')) {
-                // .Fx
-                std::string temp;
-                errorIfNot(ss >> temp, strfmt("\".F{}:\" expected", i));
-                errorIfAssignFailed(index, try_to_int(temp), "invalid function index");
-                errorIf(index != i, strfmt("\".F{}:\" expected", i));
+            // only ".Fn" is read from here on
+            _cursor = str.data() + 1;
+            _limit = str.data() + str.size();
+            if (skipSpaces()) {
+                char ch = *_cursor++;
+                if (ch == 'F' || ch == 'f') {
+                    std::string_view word;
+                    vm::int_t value;
+                    if (!readWord(word)) {
+                        fail(expected());
+                    }
+                    if (!toInt(word, value)) {
+                        fail("invalid function index");
+                    }
+                    index = value;
+                    if (static_cast<std::size_t>(index) != i) {
+                        fail(expected());
+                    }
+                }
             }
         }
         else {
             // str is name
-            index = -1;
-            for (auto j = 0; j < functions_count; ++j) {
-                if (std::get<std::string>(constants.at(functions.at(j).nameIndex).value) == str) {
-                    index = j;
+            for (std::size_t j = 0; j < functions.size(); ++j) {
+                if (std::get<vm::str_t>(constants[functions[j].nameIndex].value) == str) {
+                    index = static_cast<int>(j);
                     break;
                 }
-            } 
+            }
         }
         ensureNoMoreInput();
-        errorIf(index < 0, "no such function");
-        functions.at(index).instructions = std::move(parseInstructions());
+        if (index < 0) {
+            fail("no such function");
+        }
+        functions[index].instructions = parseInstructions();
     }
 
-    errorIf(in >> str, "unused content");
+    File file{0x00000001, std::move(constants), std::move(start), std::move(functions)};
+    if (readWord(str) && str == ".lines:") {
+        ensureNoMoreInput();
+        parseLines(file);
+    }
 
-    return File{0x00000001, std::move(constants), std::move(start), std::move(functions)};
+    // the line that ended the last function has been read already
+    if (std::any_of(_next, _end, [](char ch) { return !isSpace(ch); })) {
+        fail("unused content");
+    }
+
+    return file;
+}
+
+void TextParser::parseLines(File& file) {
+    while (true) {
+        // {.start or .Fn} {instruction} {line}
+        readLine();
+        std::string_view word;
+        // eof
+        if (!readWord(word)) {
+            break;
+        }
+        std::vector<vm::LineEntry>* lines = nullptr;
+        std::size_t codeSize = 0;
+        vm::int_t index;
+        if (word == ".start") {
+            lines = &file.startLines;
+            codeSize = file.start.size();
+        }
+        else if (word.substr(0, 2) == ".F" && toInt(word.substr(2), index)) {
+            if (index < 0 || static_cast<std::size_t>(index) >= file.functions.size()) {
+                fail("no such function");
+            }
+            lines = &file.functions[index].lines;
+            codeSize = file.functions[index].instructions.size();
+        }
+        else {
+            fail("\".start\" or \".Fn\" expected");
+        }
+        vm::int_t instruction, line;
+        if (!readWord(word) || !toInt(word, instruction)) {
+            fail("instruction index expected");
+        }
+        if (instruction < 0 || static_cast<std::size_t>(instruction) >= codeSize) {
+            fail("instruction index out of range");
+        }
+        if (!lines->empty() && static_cast<vm::u4>(instruction) <= lines->back().instruction) {
+            fail("unordered instruction index");
+        }
+        if (!readWord(word) || !toInt(word, line) || line < 0) {
+            fail("invalid line");
+        }
+        lines->push_back(vm::LineEntry{static_cast<vm::u4>(instruction), static_cast<vm::u4>(line)});
+        ensureNoMoreInput();
+    }
+}
+
+}
+
+File File::parse_file_text(std::istream& in, bool object) {
+    // read raw, at once when the stream can tell its size, in blocks otherwise
+    std::string text;
+    std::size_t size = 0;
+    auto source = in.rdbuf();
+    auto here = source->pubseekoff(0, std::ios::cur, std::ios::in);
+    auto end = here == std::streampos(-1) ? here : source->pubseekoff(0, std::ios::end, std::ios::in);
+    if (end != std::streampos(-1) && source->pubseekpos(here, std::ios::in) == here) {
+        text.resize(static_cast<std::size_t>(end - here) + 1);
+    }
+    // one more byte than expected, so a short read ends the loop
+    while ((size += source->sgetn(&text[size], text.size() - size)) == text.size()) {
+        text.resize(std::max<std::size_t>(2 * text.size(), 1 << 16));
+    }
+    return TextParser(text.data(), text.data() + size).parse(object);
 }
@@ -6,8 +6,11 @@
 #include "./constant.h"
 #include "./function.h"
 
+#include <cstddef>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <string>
 #include <vector>
 
 struct File
@@ -17,13 +20,50 @@ struct File
     std::vector<vm::Constant> constants;
     std::vector<vm::Instruction> start;
     std::vector<vm::Function> functions;
+    // the line table of start, see vm::Function::lines
+    std::vector<vm::LineEntry> startLines;
+
+    // A version 2 file (see file.cpp) leaves the instructions of its functions in the image
+    // until they are needed: lazy[i] tells where those of functions[i] are, and decode(i)
+    // fills functions[i].instructions. Files of other versions decode everything up front.
+    struct LazyCode {
+        vm::u4 offset;
+        vm::u4 count;
+        // what the ret instructions push according to the function index, see verify()
+        vm::addr_t returnSlots;
+        bool pending;
+    };
+    std::shared_ptr<const unsigned char> image;
+    std::size_t imageSize = 0;
+    std::vector<LazyCode> lazy;
 
     File(vm::u4, std::vector<vm::Constant>, std::vector<vm::Instruction>, std::vector<vm::Function>);
 
-    static File parse_file_text(std::ifstream& in);
-    static File parse_file_binary(std::ifstream& in);
+    // `object` accepts a file without main, which is only a program once link() adds one
+    static File parse_file_text(std::istream& in, bool object = false);
+    static File parse_file_binary(std::istream& in);
+    // maps the file into memory where the platform allows it, instead of reading it through a stream
+    static File load_file_binary(const std::string& path);
+    bool decoded(vm::u2 index) const { return lazy.empty() || !lazy[index].pending; }
+    // whether start or any function has a line table
+    bool hasLines() const;
+    // throws InvalidFile if the instructions in the image are malformed
+    void decode(vm::u2 index);
+    void decode_all();
+
     void output_text(std::ostream& out);
-    void output_binary(std::ofstream& out);
+    // version 1 is the stream-decoded format, version 2 the sectioned one,
+    // version 3 the compact one with varint operands and merged constants
+    void output_binary(std::ostream& out, vm::u4 version = 1);
+    // a self-contained C program that behaves like running the file in VM
+    void output_c(std::ostream& out);
+
+    // Whether a function has no instructions. Such a function is a declaration, made by a
+    // c0 prototype, and only runs once link() has resolved it.
+    bool hasDeclarations() const;
+    // Links the files compiled from several c0 sources into one program, see link.cpp.
+    // Throws LinkError if they do not make up one.
+    static File link(std::vector<File> objects);
 };
 
 #endif
\ No newline at end of file
@@ -5,18 +5,36 @@
 #include "./util/print.hpp"
 #include "./instruction.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <iterator>
 #include <vector>
 
 namespace vm {
 
+// Instruction `instruction` and the ones up to the next entry come from source line `line`,
+// 0 where no line is known. Entries are sorted by instruction.
+struct LineEntry {
+    u4 instruction;
+    u4 line;
+};
+
 struct Function {
     u2 nameIndex;
     u2 paramSize;
     u2 level;
     std::vector<vm::Instruction> instructions;
+    // empty unless the compiler was asked for it
+    std::vector<LineEntry> lines;
 };
 
+// the source line of instruction `ip`, 0 if `lines` does not know it
+inline u4 lineOf(const std::vector<LineEntry>& lines, u4 ip) {
+    auto it = std::upper_bound(lines.begin(), lines.end(), ip,
+        [](u4 ip, const LineEntry& entry) { return ip < entry.instruction; });
+    return it == lines.begin() ? 0 : std::prev(it)->line;
+}
+
 }
 
 
@@ -0,0 +1,129 @@
+#include "./input.h"
+#include "./type.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+namespace vm {
+
+const std::size_t InputReader::BLOCK_SIZE = 1 << 16;
+
+namespace {
+
+bool isSpace(int ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\v' || ch == '\f' || ch == '\r';
+}
+
+bool isDigit(int ch) {
+    return ch >= '0' && ch <= '9';
+}
+
+}
+
+InputReader::InputReader(std::streambuf* source, std::ostream* tie) :
+    _source(source), _tie(tie), _pos(0), _size(0) {}
+
+bool InputReader::refill() {
+    if (!_buffer) {
+        _buffer.reset(new char[BLOCK_SIZE]);
+    }
+    if (_tie) {
+        _tie->flush();
+    }
+    // never ask for more than the source has ready, so interactive input is not held back
+    auto ready = _source->in_avail();
+    auto wanted = ready > 0 ? std::min<std::streamsize>(ready, BLOCK_SIZE) : 1;
+    _pos = 0;
+    _size = static_cast<std::size_t>(std::max<std::streamsize>(_source->sgetn(_buffer.get(), wanted), 0));
+    return _size > 0;
+}
+
+int InputReader::peek() {
+    if (_pos == _size && !refill()) {
+        return -1;
+    }
+    return static_cast<unsigned char>(_buffer[_pos]);
+}
+
+void InputReader::skipSpaces() {
+    while (isSpace(peek())) {
+        ++_pos;
+    }
+}
+
+bool InputReader::read(int_t& value) {
+    skipSpaces();
+    bool negative = peek() == '-';
+    if (negative || peek() == '+') {
+        ++_pos;
+    }
+    if (!isDigit(peek())) {
+        return false;
+    }
+    // the magnitude of INT_MIN still fits, anything beyond fails like the stream does
+    const i8 limit = negative ? -static_cast<i8>(INT32_MIN) : INT32_MAX;
+    i8 magnitude = 0;
+    for (int ch = peek(); isDigit(ch); ch = peek()) {
+        magnitude = magnitude * 10 + (ch - '0');
+        if (magnitude > limit) {
+            return false;
+        }
+        ++_pos;
+    }
+    value = static_cast<int_t>(negative ? -magnitude : magnitude);
+    return true;
+}
+
+bool InputReader::read(double_t& value) {
+    skipSpaces();
+    // [sign] digits ['.' digits] [('e'|'E') [sign] digits], handed to strtod
+    std::string text;
+    auto take = [&]() {
+        text += static_cast<char>(peek());
+        ++_pos;
+    };
+    auto takeDigits = [&]() {
+        std::size_t count = 0;
+        for (; isDigit(peek()); ++count) {
+            take();
+        }
+        return count;
+    };
+    if (peek() == '-' || peek() == '+') {
+        take();
+    }
+    auto digits = takeDigits();
+    if (peek() == '.') {
+        take();
+        digits += takeDigits();
+    }
+    if (digits == 0) {
+        return false;
+    }
+    if (peek() == 'e' || peek() == 'E') {
+        take();
+        if (peek() == '-' || peek() == '+') {
+            take();
+        }
+        if (takeDigits() == 0) {
+            return false;
+        }
+    }
+    value = std::strtod(text.c_str(), nullptr);
+    return !std::isinf(value);
+}
+
+bool InputReader::read(char_t& value) {
+    skipSpaces();
+    int ch = peek();
+    if (ch == -1) {
+        return false;
+    }
+    ++_pos;
+    value = static_cast<char_t>(ch);
+    return true;
+}
+
+}
@@ -0,0 +1,45 @@
+#ifndef INPUT_H_INCLUDED
+#define INPUT_H_INCLUDED
+
+#include "./type.h"
+
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+
+namespace vm {
+
+// Reads the input of the scan instructions in blocks and parses the values by hand,
+// accepting what `std::istream >> value` accepts. Input read ahead is not given back
+// to the source when the program ends.
+class InputReader {
+public:
+    // `tie` is flushed before reading more of the source, like the tie of an istream
+    InputReader(std::streambuf* source, std::ostream* tie);
+
+    // false if the input ends or does not hold a value of the type
+    bool read(int_t& value);
+    bool read(double_t& value);
+    bool read(char_t& value);
+
+private:
+    static const std::size_t BLOCK_SIZE;
+
+    // the next byte without consuming it, -1 at the end of the input
+    int peek();
+    void skipSpaces();
+    bool refill();
+
+private:
+    std::streambuf* _source;
+    std::ostream* _tie;
+    // allocated by the first read
+    std::unique_ptr<char[]> _buffer;
+    std::size_t _pos;
+    std::size_t _size;
+};
+
+}
+
+#endif
@@ -14,21 +14,43 @@ struct Instruction {
     u4 y;
 };
 
+// An instruction as the interpreter runs it, 8 bytes where Instruction takes 12.
+// No opcode has two operands wider than 2 bytes: `wide` holds the only operand or the
+// 4-byte one, `narrow` the 2-byte operand of loada, tableswitch and case.
+struct CompactInstruction {
+    OpCode op;
+    u2 narrow;
+    u4 wide;
+};
+static_assert(sizeof(CompactInstruction) == 8);
+
+constexpr CompactInstruction compact(const Instruction& ins) {
+    auto& info = infoOf(ins.op);
+    if (info.operandCount() < 2) {
+        return {ins.op, 0, ins.x};
+    }
+    return info.operandSizes[0] == 4
+        ? CompactInstruction{ins.op, static_cast<u2>(ins.y), ins.x}
+        : CompactInstruction{ins.op, static_cast<u2>(ins.x), ins.y};
+}
+
 }
 
 template <>
 inline void print(std::ostream& out, const vm::Instruction& t) {
-    const char* name = vm::nameOfOpCode.at(t.op); 
-    if (auto it = vm::paramSizeOfOpCode.find(t.op); it != vm::paramSizeOfOpCode.end()) {
-        switch (it->second.size()) {
-        case 0: print(out, name); break;
-        case 1: print(out, name, t.x); break;
-        case 2: printfmt(out, "{} {},{}", name, t.x, t.y); break;
-        default: print(out, "????"); break;
-        }
+    auto& info = vm::infoOf(t.op);
+    if (!info.valid()) {
+        print(out, "????");
+        return;
     }
-    else {
-        print(out, name);
+    // 4-byte operands are signed (ipush value, tableswitch low, case key)
+    const auto param = [&](int i, vm::u4 v) -> vm::i8 {
+        return info.operandSizes[i] == 4 ? static_cast<vm::i8>(static_cast<vm::i4>(v)) : static_cast<vm::i8>(v);
+    };
+    switch (info.operandCount()) {
+    case 0: print(out, info.mnemonic); break;
+    case 1: print(out, info.mnemonic, param(0, t.x)); break;
+    default: printfmt(out, "{} {},{}", info.mnemonic, param(0, t.x), param(1, t.y)); break;
     }
 }
 
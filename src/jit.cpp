@@ -0,0 +1,1198 @@
+#include "./jit.h"
+#include "./vm.h"
+#include "./verifier.h"
+#include "./exception.h"
+
+#include <array>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+
+#ifdef C0_JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+namespace vm {
+
+namespace {
+
+// deeper native recursion is left to the interpreter, which does not grow the C++ stack
+constexpr int MAX_NESTING = 4096;
+constexpr std::size_t MAX_OUTER_LEVELS = 8;
+
+}
+
+#ifdef C0_JIT_SUPPORTED
+
+namespace {
+
+enum Reg : int {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// condition codes of jcc/setcc
+enum Cond : u1 {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_NP = 0xb, CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf
+};
+
+// /digit of the 0x81 group
+enum Alu : int { ALU_ADD = 0, ALU_AND = 4, ALU_SUB = 5, ALU_CMP = 7 };
+
+// [base + index << scale + disp]
+struct Mem {
+    int base;
+    int index;
+    int scale;
+    i4 disp;
+};
+
+Mem at(int base, i4 disp) {
+    return Mem{base, -1, 0, disp};
+}
+
+class Assembler {
+public:
+    std::vector<u1> code;
+
+    std::size_t size() const { return code.size(); }
+
+    void byte(u1 b) { code.push_back(b); }
+    void dword(u4 v) {
+        for (int i = 0; i < 4; ++i) {
+            byte(static_cast<u1>(v >> (8 * i)));
+        }
+    }
+    void qword(u8 v) {
+        for (int i = 0; i < 8; ++i) {
+            byte(static_cast<u1>(v >> (8 * i)));
+        }
+    }
+    void patch32(std::size_t pos, u4 v) {
+        for (int i = 0; i < 4; ++i) {
+            code[pos + i] = static_cast<u1>(v >> (8 * i));
+        }
+    }
+    // points the rel32 at `pos` to `target`
+    void link(std::size_t pos, std::size_t target) {
+        patch32(pos, static_cast<u4>(static_cast<i8>(target) - static_cast<i8>(pos + 4)));
+    }
+
+    // reg, r/m with a memory operand
+    void op(std::initializer_list<u1> opcode, int reg, const Mem& m, bool wide = false, int prefix = -1) {
+        if (prefix >= 0) {
+            byte(static_cast<u1>(prefix));
+        }
+        rex(wide, reg, m.index < 0 ? 0 : m.index, m.base);
+        for (auto b : opcode) {
+            byte(b);
+        }
+        // always mod = 10 with a 32 bits displacement, a SIB byte when rsp/r12 is the base or there is an index
+        if (m.index < 0 && (m.base & 7) != RSP) {
+            byte(static_cast<u1>(0x80 | (reg & 7) << 3 | (m.base & 7)));
+        }
+        else {
+            int index = m.index < 0 ? RSP : m.index;
+            byte(static_cast<u1>(0x80 | (reg & 7) << 3 | 4));
+            byte(static_cast<u1>(m.scale << 6 | (index & 7) << 3 | (m.base & 7)));
+        }
+        dword(static_cast<u4>(m.disp));
+    }
+    // reg, r/m with a register operand
+    void op(std::initializer_list<u1> opcode, int reg, int rm, bool wide = false, int prefix = -1) {
+        if (prefix >= 0) {
+            byte(static_cast<u1>(prefix));
+        }
+        rex(wide, reg, 0, rm);
+        for (auto b : opcode) {
+            byte(b);
+        }
+        byte(static_cast<u1>(0xc0 | (reg & 7) << 3 | (rm & 7)));
+    }
+
+    void mov(int dst, int src, bool wide = false) { op({0x89}, src, dst, wide); }
+    void movImm(int dst, i4 imm) {
+        rex(false, 0, 0, dst);
+        byte(static_cast<u1>(0xb8 | (dst & 7)));
+        dword(static_cast<u4>(imm));
+    }
+    void mov64(int dst, u8 imm) {
+        rex(true, 0, 0, dst);
+        byte(static_cast<u1>(0xb8 | (dst & 7)));
+        qword(imm);
+    }
+    void load(int dst, const Mem& m, bool wide = false) { op({0x8b}, dst, m, wide); }
+    void store(const Mem& m, int src, bool wide = false) { op({0x89}, src, m, wide); }
+    void storeImm(const Mem& m, i4 imm) {
+        op({0xc7}, 0, m);
+        dword(static_cast<u4>(imm));
+    }
+    void lea(int dst, const Mem& m, bool wide = false) { op({0x8d}, dst, m, wide); }
+
+    void aluImm(Alu alu, int dst, i4 imm, bool wide = false) {
+        op({0x81}, alu, dst, wide);
+        dword(static_cast<u4>(imm));
+    }
+    void aluImm(Alu alu, const Mem& m, i4 imm) {
+        op({0x81}, alu, m);
+        dword(static_cast<u4>(imm));
+    }
+    // the "reg, r/m" opcode of an Alu
+    static u1 aluOpcode(Alu alu) {
+        switch (alu) {
+        case ALU_ADD: return 0x03;
+        case ALU_AND: return 0x23;
+        case ALU_SUB: return 0x2b;
+        case ALU_CMP: return 0x3b;
+        }
+        return 0x03;
+    }
+    void alu(Alu alu, int dst, int src, bool wide = false) { op({aluOpcode(alu)}, dst, src, wide); }
+    void alu(Alu alu, int dst, const Mem& m) { op({aluOpcode(alu)}, dst, m); }
+    void imul(int dst, int src) { op({0x0f, 0xaf}, dst, src); }
+    void imul(int dst, const Mem& m) { op({0x0f, 0xaf}, dst, m); }
+    void imul(int dst, int src, i4 imm) {
+        op({0x69}, dst, src);
+        dword(static_cast<u4>(imm));
+    }
+    void neg(int r) { op({0xf7}, 3, r); }
+    void idiv(int r) { op({0xf7}, 7, r); }
+    void cdq() { byte(0x99); }
+    void setcc(Cond cc, int r8) { op({0x0f, static_cast<u1>(0x90 | cc)}, 0, r8); }
+    void movzx8(int dst, int src8) { op({0x0f, 0xb6}, dst, src8); }
+    void movsxd(int dst, int src) { op({0x63}, dst, src, true); }
+    void btc64(int r, u1 bit) {
+        op({0x0f, 0xba}, 7, r, true);
+        byte(bit);
+    }
+
+    // returns the position of the rel32 to link
+    std::size_t jcc(Cond cc) {
+        byte(0x0f);
+        byte(static_cast<u1>(0x80 | cc));
+        dword(0);
+        return size() - 4;
+    }
+    std::size_t jmp() {
+        byte(0xe9);
+        dword(0);
+        return size() - 4;
+    }
+    void jmp(int r) { op({0xff}, 4, r); }
+    void call(const void* fn) {
+        mov64(RAX, reinterpret_cast<u8>(fn));
+        op({0xff}, 2, RAX);
+    }
+    // lea dst, [rip + rel32], returns the position of the rel32
+    std::size_t leaRip(int dst) {
+        rex(true, dst, 0, 0);
+        byte(0x8d);
+        byte(static_cast<u1>((dst & 7) << 3 | 5));
+        dword(0);
+        return size() - 4;
+    }
+    void push(int r) {
+        rex(false, 0, 0, r);
+        byte(static_cast<u1>(0x50 | (r & 7)));
+    }
+    void pop(int r) {
+        rex(false, 0, 0, r);
+        byte(static_cast<u1>(0x58 | (r & 7)));
+    }
+    void ret() { byte(0xc3); }
+
+    void movsd(int xmm, const Mem& m) { op({0x0f, 0x10}, xmm, m, false, 0xf2); }
+    void movsd(const Mem& m, int xmm) { op({0x0f, 0x11}, xmm, m, false, 0xf2); }
+    void sse(u1 opcode, int xmm, const Mem& m) { op({0x0f, opcode}, xmm, m, false, 0xf2); }
+    void ucomisd(int xmm, const Mem& m) { op({0x0f, 0x2e}, xmm, m, false, 0x66); }
+    void cvtsi2sd(int xmm, int r) { op({0x0f, 0x2a}, xmm, r, false, 0xf2); }
+    void cvttsd2si(int r, const Mem& m) { op({0x0f, 0x2c}, r, m, false, 0xf2); }
+
+private:
+    void rex(bool wide, int reg, int index, int base) {
+        u1 r = static_cast<u1>(0x40 | wide << 3 | (reg >> 3 & 1) << 2 | (index >> 3 & 1) << 1 | (base >> 3 & 1));
+        if (r != 0x40) {
+            byte(r);
+        }
+    }
+};
+
+// Registers of the native code:
+//   rbx  the VM stack,       r12  the frame (stack + bp),   r13d bp
+//   r14  the VM,             r15  the bases of the enclosing frames
+//   r8d ~ r11d cache operand stack slots, rax, rcx, rdx and xmm0, xmm1 are scratch
+constexpr std::array<int, 4> POOL = {R8, R9, R10, R11};
+
+// What the compiler knows about one slot of the operand stack.
+struct Entry {
+    enum Kind : u1 {
+        // in the VM stack
+        MEM,
+        // a constant not stored yet
+        IMM,
+        // cached in a pool register
+        REG,
+        // the address bp + value
+        FRAME_ADDR,
+        // the address outerBases[outer] + value
+        OUTER_ADDR,
+    } kind;
+    i4 value;
+    u2 outer;
+};
+
+// the Jit<Policy> helpers the native code calls
+struct Helpers {
+    const void* interpret;
+    const void* call;
+    // null if division by zero is left unchecked
+    const void* divideByZero;
+};
+
+class FunctionCompiler {
+public:
+    FunctionCompiler(const File& file, const CodeInfo& info, const std::vector<Instruction>& code,
+                     const std::vector<ResolvedConstant>& constants, std::vector<u2>& outerLevels, const Helpers& helpers)
+        : _file(file), _info(info), _code(code), _constants(constants), _outerLevels(outerLevels), _helpers(helpers) {}
+
+    // false if the function has to stay interpreted
+    bool compile() {
+        auto n = static_cast<addr_t>(_code.size());
+        if (!_info.verified || n == 0) {
+            return false;
+        }
+        // control must not fall off the end, the interpreter reports that
+        if (_info.depth[n - 1] != -1 && !isTerminator(_code[n - 1].op)) {
+            return false;
+        }
+        _isTarget.assign(n, false);
+        for (addr_t ip = 0; ip < n; ++ip) {
+            if (_info.depth[ip] == -1) {
+                continue;
+            }
+            for (auto target : targetsOf(ip)) {
+                _isTarget[target] = true;
+            }
+        }
+        _labels.assign(n, 0);
+
+        prologue();
+        bool live = false;
+        for (addr_t ip = 0; ip < n; ++ip) {
+            if (_info.depth[ip] == -1) {
+                continue;
+            }
+            if (_isTarget[ip] || !live) {
+                if (live) {
+                    flushAll();
+                }
+                reset(_info.depth[ip]);
+                _labels[ip] = _asm.size();
+            }
+            if (static_cast<addr_t>(_stack.size()) != _info.depth[ip]) {
+                return false;
+            }
+            if (!instruction(ip)) {
+                return false;
+            }
+            live = !isTerminator(_code[ip].op);
+        }
+
+        epilogue();
+        for (auto& [pos, ip] : _divideByZero) {
+            _asm.link(pos, _asm.size());
+            _asm.mov(RDI, R14, true);
+            _asm.movImm(RSI, ip);
+            _asm.call(_helpers.divideByZero);
+            _asm.link(_asm.jmp(), _epilogue);
+        }
+        for (auto& [pos, target] : _jumps) {
+            _asm.link(pos, _labels[target]);
+        }
+        for (auto pos : _exits) {
+            _asm.link(pos, _epilogue);
+        }
+        for (auto& table : _tables) {
+            while (_asm.size() % 4 != 0) {
+                _asm.byte(0xcc);
+            }
+            _asm.link(table.lea, _asm.size());
+            auto start = _asm.size();
+            for (auto target : table.targets) {
+                _asm.dword(static_cast<u4>(static_cast<i8>(_labels[target]) - static_cast<i8>(start)));
+            }
+        }
+        return true;
+    }
+
+    const std::vector<u1>& code() const { return _asm.code; }
+
+private:
+    static bool isTerminator(OpCode op) {
+        switch (op) {
+        case OpCode::jmp:
+        case OpCode::tableswitch: case OpCode::lookupswitch:
+        case OpCode::ret: case OpCode::iret: case OpCode::dret: case OpCode::aret:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    std::vector<addr_t> targetsOf(addr_t ip) const {
+        auto& ins = _code[ip];
+        switch (ins.op) {
+        case OpCode::jmp:
+        case OpCode::je: case OpCode::jne: case OpCode::jl:
+        case OpCode::jge: case OpCode::jg: case OpCode::jle:
+        case OpCode::if_icmpeq: case OpCode::if_icmpne: case OpCode::if_icmplt:
+        case OpCode::if_icmpge: case OpCode::if_icmpgt: case OpCode::if_icmple:
+            return {static_cast<addr_t>(ins.x)};
+        case OpCode::tableswitch: {
+            std::vector<addr_t> targets;
+            for (addr_t i = 0; i <= static_cast<addr_t>(ins.y); ++i) {
+                targets.push_back(_code[ip + 1 + i].x);
+            }
+            return targets;
+        }
+        case OpCode::lookupswitch: {
+            std::vector<addr_t> targets{static_cast<addr_t>(_code[ip + 1].x)};
+            for (addr_t i = 0; i < static_cast<addr_t>(ins.x); ++i) {
+                targets.push_back(_code[ip + 2 + i].y);
+            }
+            return targets;
+        }
+        default:
+            return {};
+        }
+    }
+
+    static Mem slot(addr_t pos) {
+        return at(R12, 4 * pos);
+    }
+
+    void prologue() {
+        _asm.push(RBP);
+        _asm.mov(RBP, RSP, true);
+        for (auto r : {RBX, R12, R13, R14, R15}) {
+            _asm.push(r);
+        }
+        // keeps rsp 16 bytes aligned for the helper calls
+        _asm.aluImm(ALU_SUB, RSP, 8, true);
+        _asm.mov(R14, RDI, true);
+        _asm.mov(RBX, RSI, true);
+        _asm.mov(R13, RDX);
+        _asm.lea(R12, Mem{RBX, R13, 2, 0}, true);
+        _asm.mov(R15, RCX, true);
+    }
+
+    void epilogue() {
+        _epilogue = _asm.size();
+        _asm.lea(RSP, at(RBP, -40), true);
+        for (auto r : {R15, R14, R13, R12, RBX, RBP}) {
+            _asm.pop(r);
+        }
+        _asm.ret();
+    }
+
+    void reset(addr_t depth) {
+        _stack.assign(depth, Entry{Entry::MEM, 0, 0});
+        _busy.fill(false);
+    }
+
+    Entry mem() { return Entry{Entry::MEM, 0, 0}; }
+    Entry imm(i4 v) { return Entry{Entry::IMM, v, 0}; }
+    Entry reg(int r) { return Entry{Entry::REG, r, 0}; }
+
+    void release(const Entry& e) {
+        if (e.kind == Entry::REG) {
+            for (std::size_t i = 0; i < POOL.size(); ++i) {
+                if (POOL[i] == e.value) {
+                    _busy[i] = false;
+                }
+            }
+        }
+    }
+
+    Entry pop() {
+        auto e = _stack.back();
+        _stack.pop_back();
+        return e;
+    }
+
+    // writes the slot at `pos` back to the VM stack
+    void flush(addr_t pos) {
+        auto& e = _stack[pos];
+        switch (e.kind) {
+        case Entry::MEM:
+            return;
+        case Entry::IMM:
+            _asm.storeImm(slot(pos), e.value);
+            break;
+        case Entry::REG:
+            _asm.store(slot(pos), static_cast<int>(e.value));
+            release(e);
+            break;
+        case Entry::FRAME_ADDR:
+        case Entry::OUTER_ADDR:
+            materialize(RAX, e, pos);
+            _asm.store(slot(pos), RAX);
+            break;
+        }
+        e = mem();
+    }
+
+    void flushAll() {
+        for (addr_t pos = 0; pos < static_cast<addr_t>(_stack.size()); ++pos) {
+            flush(pos);
+        }
+    }
+
+    void flushTop(addr_t count) {
+        for (addr_t pos = _stack.size() - count; pos < static_cast<addr_t>(_stack.size()); ++pos) {
+            flush(pos);
+        }
+    }
+
+    // a free pool register, spilling the deepest cached slot if there is none
+    int alloc() {
+        for (std::size_t i = 0; i < POOL.size(); ++i) {
+            if (!_busy[i]) {
+                _busy[i] = true;
+                return POOL[i];
+            }
+        }
+        for (addr_t pos = 0; pos < static_cast<addr_t>(_stack.size()); ++pos) {
+            if (_stack[pos].kind == Entry::REG) {
+                int r = _stack[pos].value;
+                _asm.store(slot(pos), r);
+                _stack[pos] = mem();
+                return r;
+            }
+        }
+        // at most three popped operands are live at once
+        throw std::logic_error("jit: out of registers");
+    }
+
+    // loads the value of `e`, which lives at `pos`, into `dst`
+    void materialize(int dst, const Entry& e, addr_t pos) {
+        switch (e.kind) {
+        case Entry::MEM:        _asm.load(dst, slot(pos)); break;
+        case Entry::IMM:        _asm.movImm(dst, e.value); break;
+        case Entry::REG:
+            if (e.value != dst) {
+                _asm.mov(dst, static_cast<int>(e.value));
+            }
+            break;
+        case Entry::FRAME_ADDR: _asm.lea(dst, at(R13, e.value)); break;
+        case Entry::OUTER_ADDR:
+            _asm.load(dst, at(R15, 4 * e.outer));
+            if (e.value != 0) {
+                _asm.aluImm(ALU_ADD, dst, e.value);
+            }
+            break;
+        }
+    }
+
+    // a pool register holding `e`, the register of `e` itself if it is cached already
+    int toReg(const Entry& e, addr_t pos) {
+        if (e.kind == Entry::REG) {
+            return e.value;
+        }
+        int r = alloc();
+        materialize(r, e, pos);
+        return r;
+    }
+
+    // dst op= e, where `e` lived at `pos`
+    void aluWith(Alu alu, int dst, const Entry& e, addr_t pos) {
+        switch (e.kind) {
+        case Entry::IMM: _asm.aluImm(alu, dst, e.value); break;
+        case Entry::REG: _asm.alu(alu, dst, static_cast<int>(e.value)); break;
+        case Entry::MEM: _asm.alu(alu, dst, slot(pos)); break;
+        default:
+            materialize(RAX, e, pos);
+            _asm.alu(alu, dst, RAX);
+            break;
+        }
+        release(e);
+    }
+
+    void jumpTo(addr_t target) {
+        _jumps.emplace_back(_asm.jmp(), target);
+    }
+    void jumpTo(Cond cc, addr_t target) {
+        _jumps.emplace_back(_asm.jcc(cc), target);
+    }
+
+    // calls a helper with (vm, ip, sp, extra) and leaves the function if it failed
+    void callHelper(const void* fn, addr_t ip, addr_t depth, i4 extra = 0) {
+        _asm.mov(RDI, R14, true);
+        _asm.movImm(RSI, ip);
+        _asm.lea(RDX, at(R13, depth));
+        _asm.movImm(RCX, extra);
+        _asm.call(fn);
+        _asm.op({0x85}, RAX, RAX);
+        _exits.push_back(_asm.jcc(CC_NE));
+    }
+
+    // runs the instruction in the interpreter, the operand stack is all in memory before and after
+    void interpret(addr_t ip) {
+        flushAll();
+        callHelper(_helpers.interpret, ip, _info.depth[ip]);
+        reset(_info.depth[ip + 1]);
+    }
+
+    u2 outerIndex(u2 levelDiff) {
+        for (std::size_t i = 0; i < _outerLevels.size(); ++i) {
+            if (_outerLevels[i] == levelDiff) {
+                return static_cast<u2>(i);
+            }
+        }
+        _outerLevels.push_back(levelDiff);
+        return static_cast<u2>(_outerLevels.size() - 1);
+    }
+
+    // [outerBases[e.outer] + e.value] in an enclosing frame, which lies below bp:
+    // computes the address into eax and jumps to the returned rel32 unless it is a valid slot
+    std::vector<std::size_t> outerAddress(const Entry& e, addr_t slots) {
+        materialize(RAX, e, 0);
+        std::vector<std::size_t> slow;
+        _asm.alu(ALU_CMP, RAX, R13);
+        slow.push_back(_asm.jcc(CC_AE));
+        _asm.lea(RCX, at(RAX, slots));
+        _asm.alu(ALU_CMP, RCX, R13);
+        slow.push_back(_asm.jcc(CC_A));
+        return slow;
+    }
+
+    bool load(addr_t ip, addr_t slots) {
+        auto p = static_cast<addr_t>(_stack.size()) - 1;
+        auto a = _stack.back();
+        if (a.kind == Entry::FRAME_ADDR && 0 <= a.value && a.value + slots <= p) {
+            pop();
+            addr_t k = a.value;
+            if (slots == 1) {
+                int r = alloc();
+                // alloc may have spilled slot k
+                materialize(r, _stack[k], k);
+                _stack.push_back(reg(r));
+            }
+            else {
+                flush(k);
+                flush(k + 1);
+                _asm.load(RAX, slot(k), true);
+                _asm.store(slot(p), RAX, true);
+                _stack.push_back(mem());
+                _stack.push_back(mem());
+            }
+            return true;
+        }
+        if (a.kind == Entry::OUTER_ADDR) {
+            flushAll();
+            auto slow = outerAddress(a, slots);
+            _asm.load(RCX, Mem{RBX, RAX, 2, 0}, slots == 2);
+            _asm.store(slot(p), RCX, slots == 2);
+            auto done = _asm.jmp();
+            for (auto pos : slow) {
+                _asm.link(pos, _asm.size());
+            }
+            callHelper(_helpers.interpret, ip, _info.depth[ip]);
+            _asm.link(done, _asm.size());
+            reset(_info.depth[ip + 1]);
+            return true;
+        }
+        interpret(ip);
+        return true;
+    }
+
+    bool store(addr_t ip, addr_t slots) {
+        auto p = static_cast<addr_t>(_stack.size()) - 1 - slots;
+        auto a = _stack[p];
+        if (a.kind == Entry::FRAME_ADDR && 0 <= a.value && a.value + slots <= p) {
+            addr_t k = a.value;
+            if (slots == 1) {
+                auto v = pop();
+                pop();
+                if (v.kind == Entry::MEM) {
+                    int r = alloc();
+                    _asm.load(r, slot(p + 1));
+                    v = reg(r);
+                }
+                // the local is now cached wherever the value was
+                release(_stack[k]);
+                _stack[k] = v;
+            }
+            else {
+                flushTop(2);
+                pop();
+                pop();
+                pop();
+                release(_stack[k]);
+                _stack[k] = mem();
+                release(_stack[k + 1]);
+                _stack[k + 1] = mem();
+                _asm.load(RAX, slot(p + 1), true);
+                _asm.store(slot(k), RAX, true);
+            }
+            return true;
+        }
+        if (a.kind == Entry::OUTER_ADDR) {
+            flushAll();
+            auto slow = outerAddress(a, slots);
+            _asm.load(RCX, slot(p + 1), slots == 2);
+            _asm.store(Mem{RBX, RAX, 2, 0}, RCX, slots == 2);
+            auto done = _asm.jmp();
+            for (auto pos : slow) {
+                _asm.link(pos, _asm.size());
+            }
+            callHelper(_helpers.interpret, ip, _info.depth[ip]);
+            _asm.link(done, _asm.size());
+            reset(_info.depth[ip + 1]);
+            return true;
+        }
+        interpret(ip);
+        return true;
+    }
+
+    void binary(Alu alu) {
+        auto p = static_cast<addr_t>(_stack.size()) - 2;
+        auto rhs = pop();
+        auto lhs = pop();
+        if (lhs.kind == Entry::IMM && rhs.kind == Entry::IMM) {
+            auto l = static_cast<u4>(lhs.value), r = static_cast<u4>(rhs.value);
+            _stack.push_back(imm(static_cast<i4>(alu == ALU_ADD ? l + r : l - r)));
+            return;
+        }
+        int r = toReg(lhs, p);
+        aluWith(alu, r, rhs, p + 1);
+        _stack.push_back(reg(r));
+    }
+
+    void multiply() {
+        auto p = static_cast<addr_t>(_stack.size()) - 2;
+        auto rhs = pop();
+        auto lhs = pop();
+        if (lhs.kind == Entry::IMM && rhs.kind == Entry::IMM) {
+            _stack.push_back(imm(static_cast<i4>(static_cast<u4>(lhs.value) * static_cast<u4>(rhs.value))));
+            return;
+        }
+        if (rhs.kind == Entry::IMM) {
+            int r = toReg(lhs, p);
+            _asm.imul(r, r, rhs.value);
+            _stack.push_back(reg(r));
+            return;
+        }
+        int r = toReg(lhs, p);
+        if (rhs.kind == Entry::MEM) {
+            _asm.imul(r, slot(p + 1));
+        }
+        else {
+            int s = toReg(rhs, p + 1);
+            _asm.imul(r, s);
+            release(reg(s));
+        }
+        _stack.push_back(reg(r));
+    }
+
+    void divide(addr_t ip) {
+        auto p = static_cast<addr_t>(_stack.size()) - 2;
+        auto rhs = pop();
+        auto lhs = pop();
+        int r = alloc();
+        materialize(RAX, lhs, p);
+        materialize(RCX, rhs, p + 1);
+        release(lhs);
+        release(rhs);
+        if (_helpers.divideByZero) {
+            _asm.op({0x85}, RCX, RCX);
+            _divideByZero.emplace_back(_asm.jcc(CC_E), ip);
+        }
+        // INT_MIN / -1 overflows idiv
+        _asm.aluImm(ALU_CMP, RCX, -1);
+        auto divide = _asm.jcc(CC_NE);
+        _asm.neg(RAX);
+        auto done = _asm.jmp();
+        _asm.link(divide, _asm.size());
+        _asm.cdq();
+        _asm.idiv(RCX);
+        _asm.link(done, _asm.size());
+        _asm.mov(r, RAX);
+        _stack.push_back(reg(r));
+    }
+
+    // pushes (flags say greater) - (flags say less)
+    void compareResult(int r, Cond greater, Cond less) {
+        _asm.setcc(greater, RAX);
+        _asm.setcc(less, RCX);
+        _asm.movzx8(r, RAX);
+        _asm.movzx8(RCX, RCX);
+        _asm.alu(ALU_SUB, r, RCX);
+        _stack.push_back(reg(r));
+    }
+
+    void compare() {
+        auto p = static_cast<addr_t>(_stack.size()) - 2;
+        auto rhs = pop();
+        auto lhs = pop();
+        int r = toReg(lhs, p);
+        aluWith(ALU_CMP, r, rhs, p + 1);
+        compareResult(r, CC_G, CC_L);
+    }
+
+    void doubleBinary(u1 opcode) {
+        flushTop(4);
+        auto p = static_cast<addr_t>(_stack.size()) - 4;
+        _stack.resize(p);
+        _asm.movsd(0, slot(p));
+        _asm.sse(opcode, 0, slot(p + 2));
+        _asm.movsd(slot(p), 0);
+        _stack.push_back(mem());
+        _stack.push_back(mem());
+    }
+
+    void doubleCompare() {
+        flushTop(4);
+        auto p = static_cast<addr_t>(_stack.size()) - 4;
+        _stack.resize(p);
+        int r = alloc();
+        _asm.movsd(0, slot(p));
+        _asm.ucomisd(0, slot(p + 2));
+        // unordered sets CF, so "less" also needs PF clear
+        _asm.setcc(CC_A, RAX);
+        _asm.setcc(CC_B, RCX);
+        _asm.setcc(CC_NP, RDX);
+        _asm.op({0x23}, RCX, RDX);
+        _asm.movzx8(r, RAX);
+        _asm.movzx8(RCX, RCX);
+        _asm.alu(ALU_SUB, r, RCX);
+        _stack.push_back(reg(r));
+    }
+
+    static bool holds(Cond cc, i8 lhs, i8 rhs) {
+        switch (cc) {
+        case CC_E:  return lhs == rhs;
+        case CC_NE: return lhs != rhs;
+        case CC_L:  return lhs < rhs;
+        case CC_GE: return lhs >= rhs;
+        case CC_G:  return lhs > rhs;
+        case CC_LE: return lhs <= rhs;
+        default:    return false;
+        }
+    }
+
+    void jcond(addr_t target, Cond cc) {
+        auto p = static_cast<addr_t>(_stack.size()) - 1;
+        auto e = pop();
+        if (e.kind == Entry::IMM) {
+            if (holds(cc, e.value, 0)) {
+                flushAll();
+                jumpTo(target);
+            }
+            return;
+        }
+        if (e.kind == Entry::MEM) {
+            flushAll();
+            _asm.aluImm(ALU_CMP, slot(p), 0);
+        }
+        else {
+            int r = toReg(e, p);
+            flushAll();
+            _asm.aluImm(ALU_CMP, r, 0);
+            release(reg(r));
+        }
+        jumpTo(cc, target);
+    }
+
+    void ifCompare(addr_t target, Cond cc) {
+        auto p = static_cast<addr_t>(_stack.size()) - 2;
+        auto rhs = pop();
+        auto lhs = pop();
+        if (lhs.kind == Entry::IMM && rhs.kind == Entry::IMM) {
+            if (holds(cc, lhs.value, rhs.value)) {
+                flushAll();
+                jumpTo(target);
+            }
+            return;
+        }
+        int l = toReg(lhs, p);
+        if (rhs.kind == Entry::FRAME_ADDR || rhs.kind == Entry::OUTER_ADDR) {
+            rhs = reg(toReg(rhs, p + 1));
+        }
+        flushAll();
+        aluWith(ALU_CMP, l, rhs, p + 1);
+        release(reg(l));
+        jumpTo(cc, target);
+    }
+
+    bool instruction(addr_t ip) {
+        auto& ins = _code[ip];
+        auto p = static_cast<addr_t>(_stack.size());
+        switch (ins.op) {
+        case OpCode::nop: break;
+        case OpCode::bipush:
+        case OpCode::ipush: _stack.push_back(imm(static_cast<i4>(ins.x))); break;
+        case OpCode::pop:
+        case OpCode::pop2:
+        case OpCode::popn: {
+            addr_t count = ins.op == OpCode::pop ? 1 : ins.op == OpCode::pop2 ? 2 : static_cast<addr_t>(ins.x);
+            for (addr_t i = 0; i < count; ++i) {
+                release(pop());
+            }
+        } break;
+        case OpCode::dup: {
+            int r = alloc();
+            auto& e = _stack.back();
+            if (e.kind == Entry::REG || e.kind == Entry::MEM) {
+                materialize(r, e, p - 1);
+                _stack.push_back(reg(r));
+            }
+            else {
+                release(reg(r));
+                _stack.push_back(e);
+            }
+        } break;
+        case OpCode::dup2:
+            flushTop(2);
+            _asm.load(RAX, slot(p - 2), true);
+            _asm.store(slot(p), RAX, true);
+            _stack.push_back(mem());
+            _stack.push_back(mem());
+            break;
+        case OpCode::loadc: {
+            auto& constant = _constants.at(ins.x);
+            if (constant.size == 1) {
+                _stack.push_back(imm(constant.slots[0]));
+            }
+            else {
+                _asm.storeImm(slot(p), constant.slots[0]);
+                _asm.storeImm(slot(p + 1), constant.slots[1]);
+                _stack.push_back(mem());
+                _stack.push_back(mem());
+            }
+        } break;
+        case OpCode::loada:
+            if (ins.x == 0) {
+                _stack.push_back(Entry{Entry::FRAME_ADDR, static_cast<i4>(ins.y), 0});
+            }
+            else {
+                u2 outer = outerIndex(static_cast<u2>(ins.x));
+                if (outer >= MAX_OUTER_LEVELS) {
+                    return false;
+                }
+                _stack.push_back(Entry{Entry::OUTER_ADDR, static_cast<i4>(ins.y), outer});
+            }
+            break;
+        case OpCode::snew:
+            for (u4 i = 0; i < ins.x; ++i) {
+                _stack.push_back(mem());
+            }
+            break;
+
+        case OpCode::iload:
+        case OpCode::aload:  return load(ip, 1);
+        case OpCode::dload:  return load(ip, 2);
+        case OpCode::istore:
+        case OpCode::astore: return store(ip, 1);
+        case OpCode::dstore: return store(ip, 2);
+
+        case OpCode::iadd: binary(ALU_ADD); break;
+        case OpCode::isub: binary(ALU_SUB); break;
+        case OpCode::imul: multiply(); break;
+        case OpCode::idiv: divide(ip); break;
+        case OpCode::ineg: {
+            auto e = pop();
+            if (e.kind == Entry::IMM) {
+                _stack.push_back(imm(static_cast<i4>(0u - static_cast<u4>(e.value))));
+                break;
+            }
+            int r = toReg(e, p - 1);
+            _asm.neg(r);
+            _stack.push_back(reg(r));
+        } break;
+        case OpCode::icmp: compare(); break;
+
+        case OpCode::dadd: doubleBinary(0x58); break;
+        case OpCode::dsub: doubleBinary(0x5c); break;
+        case OpCode::dmul: doubleBinary(0x59); break;
+        case OpCode::ddiv: doubleBinary(0x5e); break;
+        case OpCode::dneg:
+            flushTop(2);
+            _asm.load(RAX, slot(p - 2), true);
+            _asm.btc64(RAX, 63);
+            _asm.store(slot(p - 2), RAX, true);
+            break;
+        case OpCode::dcmp: doubleCompare(); break;
+
+        case OpCode::i2d: {
+            auto e = pop();
+            materialize(RAX, e, p - 1);
+            release(e);
+            _asm.cvtsi2sd(0, RAX);
+            _asm.movsd(slot(p - 1), 0);
+            _stack.push_back(mem());
+            _stack.push_back(mem());
+        } break;
+        case OpCode::d2i: {
+            flushTop(2);
+            _stack.resize(p - 2);
+            int r = alloc();
+            _asm.cvttsd2si(r, slot(p - 2));
+            _stack.push_back(reg(r));
+        } break;
+        case OpCode::i2c: {
+            auto e = pop();
+            if (e.kind == Entry::IMM) {
+                _stack.push_back(imm(e.value & 0xff));
+                break;
+            }
+            int r = toReg(e, p - 1);
+            _asm.aluImm(ALU_AND, r, 0xff);
+            _stack.push_back(reg(r));
+        } break;
+
+        case OpCode::jmp:
+            flushAll();
+            jumpTo(ins.x);
+            break;
+        case OpCode::je:  jcond(ins.x, CC_E);  break;
+        case OpCode::jne: jcond(ins.x, CC_NE); break;
+        case OpCode::jl:  jcond(ins.x, CC_L);  break;
+        case OpCode::jge: jcond(ins.x, CC_GE); break;
+        case OpCode::jg:  jcond(ins.x, CC_G);  break;
+        case OpCode::jle: jcond(ins.x, CC_LE); break;
+        case OpCode::if_icmpeq: ifCompare(ins.x, CC_E);  break;
+        case OpCode::if_icmpne: ifCompare(ins.x, CC_NE); break;
+        case OpCode::if_icmplt: ifCompare(ins.x, CC_L);  break;
+        case OpCode::if_icmpge: ifCompare(ins.x, CC_GE); break;
+        case OpCode::if_icmpgt: ifCompare(ins.x, CC_G);  break;
+        case OpCode::if_icmple: ifCompare(ins.x, CC_LE); break;
+        case OpCode::tableswitch: {
+            auto e = pop();
+            flushAll();
+            materialize(RAX, e, p - 1);
+            release(e);
+            // the key is computed in 64 bits, as the interpreter does
+            _asm.movsxd(RAX, RAX);
+            _asm.aluImm(ALU_SUB, RAX, static_cast<i4>(ins.x), true);
+            _asm.aluImm(ALU_CMP, RAX, static_cast<i4>(ins.y), true);
+            jumpTo(CC_AE, _code[ip + 1].x);
+            Table table;
+            table.lea = _asm.leaRip(RCX);
+            for (addr_t i = 0; i < static_cast<addr_t>(ins.y); ++i) {
+                table.targets.push_back(_code[ip + 2 + i].x);
+            }
+            _tables.push_back(std::move(table));
+            _asm.op({0x63}, RAX, Mem{RCX, RAX, 2, 0}, true);
+            _asm.alu(ALU_ADD, RAX, RCX, true);
+            _asm.jmp(RAX);
+        } break;
+        case OpCode::lookupswitch: {
+            auto e = pop();
+            flushAll();
+            materialize(RAX, e, p - 1);
+            release(e);
+            for (addr_t i = 0; i < static_cast<addr_t>(ins.x); ++i) {
+                auto& entry = _code[ip + 2 + i];
+                _asm.aluImm(ALU_CMP, RAX, static_cast<i4>(entry.x));
+                jumpTo(CC_E, entry.y);
+            }
+            jumpTo(_code[ip + 1].x);
+        } break;
+
+        case OpCode::call:
+            flushAll();
+            callHelper(_helpers.call, ip, _info.depth[ip], ins.x);
+            reset(_info.depth[ip + 1]);
+            break;
+        case OpCode::ret:
+        case OpCode::iret:
+        case OpCode::dret:
+        case OpCode::aret:
+            // the interpreter executes the ret itself
+            flushAll();
+            _asm.movImm(RAX, ip << 1);
+            _exits.push_back(_asm.jmp());
+            break;
+
+        default:
+            // I/O, new, arrays and the block instructions go through the VM
+            interpret(ip);
+            break;
+        }
+        return true;
+    }
+
+private:
+    struct Table {
+        std::size_t lea;
+        std::vector<addr_t> targets;
+    };
+
+    const File& _file;
+    const CodeInfo& _info;
+    const std::vector<Instruction>& _code;
+    const std::vector<ResolvedConstant>& _constants;
+    std::vector<u2>& _outerLevels;
+    const Helpers& _helpers;
+
+    Assembler _asm;
+    std::vector<Entry> _stack;
+    std::array<bool, POOL.size()> _busy{};
+    std::vector<bool> _isTarget;
+    std::vector<std::size_t> _labels;
+    std::size_t _epilogue = 0;
+    std::vector<std::pair<std::size_t, addr_t>> _jumps;
+    std::vector<std::size_t> _exits;
+    std::vector<std::pair<std::size_t, addr_t>> _divideByZero;
+    std::vector<Table> _tables;
+};
+
+}
+
+template <typename Policy>
+bool Jit<Policy>::supported() {
+    return true;
+}
+
+#else
+
+template <typename Policy>
+bool Jit<Policy>::supported() {
+    return false;
+}
+
+#endif
+
+template <typename Policy>
+Jit<Policy>::Jit(VM& vm) : _vm(vm), _functions(vm._file.functions.size()), _nesting(0) {}
+
+template <typename Policy>
+Jit<Policy>::~Jit() {
+#ifdef C0_JIT_SUPPORTED
+    for (auto& [p, size] : _mappings) {
+        munmap(p, size);
+    }
+#endif
+}
+
+template <typename Policy>
+std::size_t Jit<Policy>::compiledCount() const {
+    std::size_t count = 0;
+    for (auto& fn : _functions) {
+        count += fn.code != nullptr;
+    }
+    return count;
+}
+
+template <typename Policy>
+typename Jit<Policy>::Compiled& Jit<Policy>::compiled(u2 index) {
+    auto& fn = _functions.at(index);
+    if (fn.tried) {
+        return fn;
+    }
+    fn.tried = true;
+#ifdef C0_JIT_SUPPORTED
+    const Helpers helpers{
+        reinterpret_cast<const void*>(&Jit::interpret),
+        reinterpret_cast<const void*>(&Jit::call),
+        Policy::checkDivision ? reinterpret_cast<const void*>(&Jit::divideByZero) : nullptr,
+    };
+    FunctionCompiler compiler(_vm._file, _vm.codeInfo(index), _vm._file.functions.at(index).instructions,
+                              _vm._constants, fn.outerLevels, helpers);
+    try {
+        if (!compiler.compile()) {
+            return fn;
+        }
+    }
+    catch (const std::logic_error&) {
+        return fn;
+    }
+    auto& code = compiler.code();
+    auto size = code.size();
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return fn;
+    }
+    std::memcpy(p, code.data(), size);
+    if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(p, size);
+        return fn;
+    }
+    _mappings.emplace_back(p, size);
+    fn.code = reinterpret_cast<NativeCode>(p);
+#endif
+    return fn;
+}
+
+template <typename Policy>
+bool Jit<Policy>::enter(u2 index) {
+    if (_nesting >= MAX_NESTING) {
+        return false;
+    }
+    auto& fn = compiled(index);
+    if (fn.code == nullptr) {
+        return false;
+    }
+    // the enclosing frames do not change while this one is alive
+    std::array<addr_t, MAX_OUTER_LEVELS> bases{};
+    for (std::size_t i = 0; i < fn.outerLevels.size(); ++i) {
+        bases[i] = _vm.frameBase(fn.outerLevels[i]);
+    }
+    ++_nesting;
+    u8 result = fn.code(&_vm, _vm._stack.get(), _vm._bp, bases.data());
+    --_nesting;
+    if (result & 1) {
+        auto error = _error;
+        _error = nullptr;
+        std::rethrow_exception(error);
+    }
+    _vm._ip = static_cast<addr_t>(result >> 1);
+    _vm._sp = _vm._bp + _vm.codeInfo(index).depth.at(_vm._ip);
+    _vm.template executeInstruction<false>(_vm._currentInstructions->at(_vm._ip));
+    return true;
+}
+
+template <typename Policy>
+u8 Jit<Policy>::interpret(VM* vm, addr_t ip, addr_t sp) {
+    try {
+        vm->_ip = ip;
+        vm->_sp = sp;
+        vm->template executeInstruction<false>(vm->_currentInstructions->at(ip));
+        return 0;
+    }
+    catch (...) {
+        vm->_jit->_error = std::current_exception();
+        return 1;
+    }
+}
+
+template <typename Policy>
+u8 Jit<Policy>::call(VM* vm, addr_t ip, addr_t sp, u2 index) {
+    try {
+        vm->_ip = ip;
+        vm->_sp = sp;
+        auto frames = vm->_contexts.size();
+        vm->template CALL<false>(index);
+        // the callee is interpreted unless CALL already ran it natively
+        vm->runNested(frames);
+        return 0;
+    }
+    catch (...) {
+        vm->_jit->_error = std::current_exception();
+        return 1;
+    }
+}
+
+template <typename Policy>
+u8 Jit<Policy>::divideByZero(VM* vm, addr_t ip) {
+    vm->_ip = ip;
+    vm->_jit->_error = std::make_exception_ptr(DivideByZero());
+    return 1;
+}
+
+template class Jit<CheckedPolicy>;
+template class Jit<UncheckedPolicy>;
+
+}
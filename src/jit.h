@@ -0,0 +1,71 @@
+#ifndef JIT_H_INCLUDED
+#define JIT_H_INCLUDED
+
+#include "./type.h"
+
+#include <cstddef>
+#include <exception>
+#include <vector>
+
+// the generated code assumes 32-bit slots
+#if defined(__linux__) && defined(__x86_64__) && !defined(C0_WIDE_SLOTS)
+#define C0_JIT_SUPPORTED 1
+#endif
+
+namespace vm {
+
+template <typename Policy>
+class BasicVM;
+
+// Translates verified functions into x86-64 machine code the first time they are called.
+// The native code works in place on the VM stack, so frames, stack traces and the
+// interpreter stay interchangeable: calls, I/O and everything without a native template
+// go back into VM through the helpers below.
+template <typename Policy>
+class Jit {
+public:
+    using VM = BasicVM<Policy>;
+
+    static bool supported();
+
+    explicit Jit(VM& vm);
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+    ~Jit();
+
+    // Runs function `index` natively if it can be compiled, after CALL has pushed its frame.
+    // Returns false if the interpreter has to run it instead.
+    bool enter(u2 index);
+    std::size_t compiledCount() const;
+
+public:
+    // the native code of one function, returns (ip of the executed ret) << 1, or 1 on error
+    using NativeCode = u8 (*)(VM* vm, slot_t* stack, addr_t bp, const addr_t* outerBases);
+
+    // helpers called from native code, they never throw but record the exception and return 1
+    static u8 interpret(VM* vm, addr_t ip, addr_t sp);
+    static u8 call(VM* vm, addr_t ip, addr_t sp, u2 index);
+    static u8 divideByZero(VM* vm, addr_t ip);
+
+private:
+    struct Compiled {
+        bool tried = false;
+        NativeCode code = nullptr;
+        // level differences of the loada instructions reaching out of the frame
+        std::vector<u2> outerLevels;
+    };
+
+    Compiled& compiled(u2 index);
+
+private:
+    VM& _vm;
+    std::vector<Compiled> _functions;
+    std::vector<std::pair<void*, std::size_t>> _mappings;
+    std::exception_ptr _error;
+    // native frames currently on the C++ stack
+    int _nesting;
+};
+
+}
+
+#endif
@@ -0,0 +1,294 @@
+#include "./file.h"
+#include "./type.h"
+#include "./instruction.h"
+#include "./constant.h"
+#include "./function.h"
+#include "./exception.h"
+#include "./verifier.h"
+#include "./util/print.hpp"
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Linking puts the objects compiled from several c0 sources into one file:
+//
+//   functions: shared by name. A function without instructions is a declaration and calls
+//              the one function of that name that some object defines, with as many
+//              parameter slots. Only the functions main and the .start sections call,
+//              directly or not, are kept.
+//   globals:   private to their object. The .start sections run one after the other, and the
+//              globals of an object are moved behind those of the objects before it.
+//   constants: rebuilt from what the kept code uses, equal constants are merged.
+//
+// Line tables are kept, the lines of different objects refer to different sources.
+namespace {
+
+using namespace vm;
+
+bool isJump(OpCode op) {
+    switch (op) {
+    case OpCode::jmp:
+    case OpCode::je: case OpCode::jne: case OpCode::jl:
+    case OpCode::jge: case OpCode::jg: case OpCode::jle:
+    case OpCode::if_icmpeq: case OpCode::if_icmpne: case OpCode::if_icmplt:
+    case OpCode::if_icmpge: case OpCode::if_icmpgt: case OpCode::if_icmple:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// a function of an object
+struct FunctionRef {
+    std::size_t object;
+    u4 index;
+};
+
+class Linker {
+public:
+    explicit Linker(const std::vector<File>& objects) : _objects(objects) {}
+
+    File link() {
+        collectDefinitions();
+        markReachable();
+        numberFunctions();
+
+        File linked(1, {}, {}, {});
+        addr_t globalBase = 0;
+        for (std::size_t i = 0; i < _objects.size(); ++i) {
+            auto& object = _objects[i];
+            if (object.start.empty()) {
+                continue;
+            }
+            if (linked.start.size() + object.start.size() > U2_MAX) {
+                throw LinkError("the .start sections are too long to be merged");
+            }
+            auto codeBase = static_cast<u4>(linked.start.size());
+            // instructions of an object without a line table have no line
+            if (!linked.startLines.empty() && (object.startLines.empty() || object.startLines.front().instruction != 0)) {
+                linked.startLines.push_back(LineEntry{codeBase, 0});
+            }
+            for (auto& entry : object.startLines) {
+                linked.startLines.push_back(LineEntry{entry.instruction + codeBase, entry.line});
+            }
+            relocate(i, object.start, 0, globalBase, codeBase, linked.start);
+            globalBase += globalSlots(i);
+        }
+        globalBase = 0;
+        for (std::size_t i = 0; i < _objects.size(); ++i) {
+            auto& object = _objects[i];
+            for (u4 j = 0; j < object.functions.size(); ++j) {
+                if (_newIndex[i][j] < 0) {
+                    continue;
+                }
+                auto& fun = object.functions[j];
+                Function kept{constant(i, fun.nameIndex), fun.paramSize, fun.level, {}, fun.lines};
+                relocate(i, fun.instructions, fun.level, globalBase, 0, kept.instructions);
+                linked.functions.push_back(std::move(kept));
+            }
+            globalBase += globalSlots(i);
+        }
+        linked.constants = std::move(_constants);
+        return linked;
+    }
+
+private:
+    const str_t& nameOf(FunctionRef ref) const {
+        auto& object = _objects[ref.object];
+        auto nameIndex = object.functions[ref.index].nameIndex;
+        if (nameIndex >= object.constants.size() || object.constants[nameIndex].type != Constant::Type::STRING) {
+            throw InvalidFile("the name of a function is not a string constant");
+        }
+        return std::get<str_t>(object.constants[nameIndex].value);
+    }
+
+    bool isDefinition(FunctionRef ref) const {
+        return !_objects[ref.object].functions[ref.index].instructions.empty();
+    }
+
+    void collectDefinitions() {
+        for (std::size_t i = 0; i < _objects.size(); ++i) {
+            for (u4 j = 0; j < _objects[i].functions.size(); ++j) {
+                FunctionRef ref{i, j};
+                if (isDefinition(ref) && !_definitions.emplace(nameOf(ref), ref).second) {
+                    throw LinkError(strfmt("function {} is defined more than once", nameOf(ref)));
+                }
+            }
+        }
+    }
+
+    // the definition `call index` in `object` runs
+    FunctionRef resolve(std::size_t object, u4 index) const {
+        if (index >= _objects[object].functions.size()) {
+            throw InvalidFile("call to a function that does not exist");
+        }
+        FunctionRef ref{object, index};
+        if (isDefinition(ref)) {
+            return ref;
+        }
+        auto& name = nameOf(ref);
+        auto it = _definitions.find(name);
+        if (it == _definitions.end()) {
+            throw LinkError(strfmt("function {} is declared but never defined", name));
+        }
+        auto declared = _objects[object].functions[index].paramSize;
+        auto defined = _objects[it->second.object].functions[it->second.index].paramSize;
+        if (declared != defined) {
+            throw LinkError(strfmt("function {} is declared with {} parameter slots but defined with {}", name, declared, defined));
+        }
+        return it->second;
+    }
+
+    void markReachable() {
+        _newIndex.resize(_objects.size());
+        for (std::size_t i = 0; i < _objects.size(); ++i) {
+            _newIndex[i].assign(_objects[i].functions.size(), -1);
+        }
+        std::vector<FunctionRef> pending;
+        const auto reach = [&](FunctionRef ref) {
+            auto& index = _newIndex[ref.object][ref.index];
+            if (index < 0) {
+                // numbered later, see numberFunctions()
+                index = 0;
+                pending.push_back(ref);
+            }
+        };
+        const auto reachCalls = [&](std::size_t object, const std::vector<Instruction>& code) {
+            for (auto& ins : code) {
+                if (ins.op == OpCode::call) {
+                    reach(resolve(object, ins.x));
+                }
+            }
+        };
+        auto main = _definitions.find("main");
+        if (main == _definitions.end()) {
+            throw LinkError("main is not defined");
+        }
+        reach(main->second);
+        for (std::size_t i = 0; i < _objects.size(); ++i) {
+            reachCalls(i, _objects[i].start);
+        }
+        while (!pending.empty()) {
+            auto ref = pending.back();
+            pending.pop_back();
+            reachCalls(ref.object, _objects[ref.object].functions[ref.index].instructions);
+        }
+    }
+
+    // the kept functions keep their order, object by object
+    void numberFunctions() {
+        i4 next = 0;
+        for (auto& indices : _newIndex) {
+            for (auto& index : indices) {
+                if (index >= 0) {
+                    index = next++;
+                }
+            }
+        }
+        if (next > U2_MAX) {
+            throw LinkError("too many functions");
+        }
+    }
+
+    // the slots the globals of an object take, which its .start leaves on the stack
+    addr_t globalSlots(std::size_t object) {
+        if (_globalSlots.empty()) {
+            _globalSlots.assign(_objects.size(), -1);
+        }
+        auto& slots = _globalSlots[object];
+        if (slots < 0 && _objects[object].start.empty()) {
+            slots = 0;
+        }
+        if (slots < 0) {
+            auto info = verify(_objects[object]).start;
+            if (!info.verified || info.endDepth < 0) {
+                throw LinkError(strfmt("the globals of file {} cannot be moved: {}", object + 1,
+                    info.verified ? "its .start does not end" : info.reason));
+            }
+            slots = info.endDepth;
+        }
+        return slots;
+    }
+
+    // the index in the linked pool of constant `index` of `object`
+    u2 constant(std::size_t object, u4 index) {
+        auto& constants = _objects[object].constants;
+        if (index >= constants.size()) {
+            throw InvalidFile("constant index out of range");
+        }
+        auto& c = constants[index];
+        std::string key(1, static_cast<char>(c.type));
+        switch (c.type) {
+        case Constant::Type::STRING: key += std::get<str_t>(c.value); break;
+        case Constant::Type::INT: key += std::to_string(std::get<int_t>(c.value)); break;
+        case Constant::Type::DOUBLE: {
+            // by the bits, so that 0.0 and -0.0 stay apart
+            char bits[sizeof(double_t)];
+            auto v = std::get<double_t>(c.value);
+            std::memcpy(bits, &v, sizeof bits);
+            key.append(bits, sizeof bits);
+        } break;
+        }
+        auto [it, inserted] = _merged.emplace(key, static_cast<u4>(_constants.size()));
+        if (inserted) {
+            if (_constants.size() > U2_MAX) {
+                throw LinkError("too many constants");
+            }
+            _constants.push_back(c);
+        }
+        return static_cast<u2>(it->second);
+    }
+
+    // appends `code` of `object` to `out`, running at `level` and moved to `codeBase`
+    void relocate(std::size_t object, const std::vector<Instruction>& code, u2 level,
+        addr_t globalBase, u4 codeBase, std::vector<Instruction>& out) {
+        for (auto ins : code) {
+            if (ins.op == OpCode::call) {
+                auto ref = resolve(object, ins.x);
+                ins.x = static_cast<u4>(_newIndex[ref.object][ref.index]);
+            }
+            else if (ins.op == OpCode::loadc) {
+                ins.x = constant(object, ins.x);
+            }
+            // a frame `level` levels up is the one .start runs in
+            else if (ins.op == OpCode::loada && ins.x == level) {
+                ins.y += static_cast<u4>(globalBase);
+            }
+            else if (isJump(ins.op)) {
+                ins.x += codeBase;
+            }
+            else if (ins.op == OpCode::_case) {
+                ins.y += codeBase;
+            }
+            out.push_back(ins);
+        }
+    }
+
+    const std::vector<File>& _objects;
+    std::unordered_map<str_t, FunctionRef> _definitions;
+    // the index of each function in the linked file, -1 if it is dropped or only declared
+    std::vector<std::vector<i4>> _newIndex;
+    std::vector<addr_t> _globalSlots;
+    std::vector<Constant> _constants;
+    std::unordered_map<std::string, u4> _merged;
+};
+
+}
+
+bool File::hasDeclarations() const {
+    for (std::size_t i = 0; i < functions.size(); ++i) {
+        if (decoded(static_cast<vm::u2>(i)) ? functions[i].instructions.empty() : lazy[i].count == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+File File::link(std::vector<File> objects) {
+    for (auto& object : objects) {
+        object.decode_all();
+    }
+    return Linker(objects).link();
+}
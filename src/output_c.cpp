@@ -0,0 +1,490 @@
+#include "./file.h"
+#include "./type.h"
+#include "./instruction.h"
+#include "./constant.h"
+#include "./function.h"
+#include "./exception.h"
+
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace vm;
+
+// The runtime mirrors VM: the same slot stack, heap layout, address checks and error messages,
+// except that a runtime error ends the program without a stack trace.
+const char* const runtime = R"(#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_STACK_ADDR 0x00ffffff
+#define MIN_HEAP_ADDR  0x01000000
+#define MAX_HEAP_ADDR  0x01ffffff
+
+typedef int32_t slot_t;
+
+struct c0_frame {
+    int32_t prevSP, prevBP, BP;
+    int32_t staticLink, level;
+    int32_t returnSite;
+};
+struct c0_record {
+    int32_t start, count;
+};
+
+static slot_t* c0_stack;
+static slot_t* c0_heap;
+static int32_t c0_sp, c0_bp;
+static struct c0_frame* c0_frames;
+static int32_t c0_frameCount, c0_frameCapacity;
+static struct c0_record* c0_records;
+static int32_t c0_recordCount, c0_recordCapacity;
+
+static inline void c0_fail(const char* msg) {
+    fflush(stdout);
+    fprintf(stderr, "runtime error: %s !\n", msg);
+    exit(1);
+}
+
+static inline void c0_used(int32_t count) {
+    if (c0_bp + count > c0_sp) c0_fail("tried to modify important stack info");
+}
+static inline void c0_rest(int32_t count) {
+    if ((int64_t)c0_sp + count > MAX_STACK_ADDR) c0_fail("stack overflow");
+}
+static inline void c0_push(slot_t v) { c0_rest(1); c0_stack[c0_sp++] = v; }
+static inline slot_t c0_pop(void) { c0_used(1); return c0_stack[--c0_sp]; }
+static inline void c0_pushd(double v) { c0_rest(2); memcpy(c0_stack + c0_sp, &v, sizeof v); c0_sp += 2; }
+static inline double c0_popd(void) { double v; c0_used(2); c0_sp -= 2; memcpy(&v, c0_stack + c0_sp, sizeof v); return v; }
+static inline void c0_popn(int32_t count) { c0_used(count); c0_sp -= count; }
+static inline void c0_snew(int32_t count) { c0_rest(count); c0_sp += count; }
+static inline void c0_dup(int32_t count) {
+    c0_used(count); c0_rest(count);
+    memmove(c0_stack + c0_sp, c0_stack + c0_sp - count, count * sizeof(slot_t));
+    c0_sp += count;
+}
+static inline double c0_bits(uint64_t bits) { double v; memcpy(&v, &bits, sizeof v); return v; }
+static inline slot_t c0_add(slot_t l, slot_t r) { return (slot_t)((uint32_t)l + (uint32_t)r); }
+static inline slot_t c0_sub(slot_t l, slot_t r) { return (slot_t)((uint32_t)l - (uint32_t)r); }
+static inline slot_t c0_mul(slot_t l, slot_t r) { return (slot_t)((uint32_t)l * (uint32_t)r); }
+static inline slot_t c0_div(slot_t l, slot_t r) {
+    if (r == 0) c0_fail("divide integer by zero");
+    return r == -1 ? c0_sub(0, l) : l / r;
+}
+static inline slot_t c0_cmp(slot_t l, slot_t r) { return (l > r) - (l < r); }
+static inline slot_t c0_cmpd(double l, double r) { return (l > r) - (l < r); }
+
+static inline slot_t* c0_addr(int32_t addr, int32_t count) {
+    int64_t end = (int64_t)addr + count;
+    int32_t i;
+    if (0 <= addr && addr < c0_sp) {
+        if (end > c0_sp) c0_fail("tried to access unused stack memory");
+        return c0_stack + addr;
+    }
+    if (MIN_HEAP_ADDR <= addr && addr < MAX_HEAP_ADDR) {
+        for (i = 0; i < c0_recordCount; ++i) {
+            if (c0_records[i].start <= addr && end <= (int64_t)c0_records[i].start + c0_records[i].count) {
+                return c0_heap + (addr - MIN_HEAP_ADDR);
+            }
+        }
+        c0_fail("tried to access unused or constant heap memory");
+    }
+    c0_fail("tried to access unexistent memory");
+    return 0;
+}
+static inline slot_t c0_load(int32_t addr) { return *c0_addr(addr, 1); }
+static inline double c0_loadd(int32_t addr) { double v; memcpy(&v, c0_addr(addr, 2), sizeof v); return v; }
+static inline void c0_store(int32_t addr, slot_t v) { *c0_addr(addr, 1) = v; }
+static inline void c0_stored(int32_t addr, double v) { memcpy(c0_addr(addr, 2), &v, sizeof v); }
+static inline void c0_memcpy(int32_t dst, int32_t src, int32_t count) {
+    slot_t* from;
+    if (count < 0) c0_fail("tried to copy a negative number of slots");
+    if (count == 0) return;
+    from = c0_addr(src, count);
+    memmove(c0_addr(dst, count), from, count * sizeof(slot_t));
+}
+static inline void c0_memset(int32_t dst, slot_t value, int32_t count) {
+    slot_t* to;
+    int32_t i;
+    if (count < 0) c0_fail("tried to set a negative number of slots");
+    if (count == 0) return;
+    to = c0_addr(dst, count);
+    for (i = 0; i < count; ++i) to[i] = value;
+}
+
+static inline int32_t c0_new(int32_t count) {
+    int32_t st = MIN_HEAP_ADDR;
+    /* an empty block still takes a slot, so it gets an address of its own like in the VM */
+    int32_t size = count > 0 ? count : 1;
+    if (count < 0) c0_fail("tried to allocate a negative number of slots");
+    if (c0_recordCount > 0) {
+        struct c0_record* last = &c0_records[c0_recordCount - 1];
+        st = last->start + (last->count > 0 ? last->count : 1);
+    }
+    if ((int64_t)st + size >= MAX_HEAP_ADDR) c0_fail("heap overflow");
+    if (c0_recordCount == c0_recordCapacity) {
+        c0_recordCapacity = c0_recordCapacity ? 2 * c0_recordCapacity : 16;
+        c0_records = (struct c0_record*)realloc(c0_records, c0_recordCapacity * sizeof *c0_records);
+        if (!c0_records) c0_fail("heap overflow");
+    }
+    c0_records[c0_recordCount].start = st;
+    c0_records[c0_recordCount].count = count;
+    ++c0_recordCount;
+    return st;
+}
+static inline void c0_literal(const unsigned char* chars, int32_t length) {
+    slot_t* dst = c0_heap + (c0_new(length + 1) - MIN_HEAP_ADDR);
+    int32_t i;
+    for (i = 0; i < length; ++i) dst[i] = chars[i];
+    dst[length] = 0;
+}
+
+static inline int32_t c0_base(int32_t levelDiff) {
+    int32_t link = c0_frameCount - 1;
+    for (; levelDiff > 0; --levelDiff) link = c0_frames[link].staticLink;
+    return c0_frames[link].BP;
+}
+static inline void c0_enter(int32_t paramSize, int32_t level, int32_t returnSite) {
+    struct c0_frame f;
+    int32_t curLv = c0_frames[c0_frameCount - 1].level;
+    if (level == curLv + 1) {
+        f.staticLink = c0_frameCount - 1;
+    }
+    else if (level <= curLv) {
+        f.staticLink = c0_frames[c0_frameCount - 1].staticLink;
+        for (; curLv > level; --curLv) f.staticLink = c0_frames[f.staticLink].staticLink;
+    }
+    else {
+        c0_fail("invalid control transfer");
+    }
+    f.level = level;
+    f.prevBP = c0_bp;
+    f.returnSite = returnSite;
+    c0_used(paramSize);
+    c0_bp = c0_sp - paramSize;
+    f.prevSP = c0_bp;
+    f.BP = c0_bp;
+    if (c0_frameCount == c0_frameCapacity) {
+        c0_frameCapacity *= 2;
+        c0_frames = (struct c0_frame*)realloc(c0_frames, c0_frameCapacity * sizeof *c0_frames);
+        if (!c0_frames) c0_fail("stack overflow");
+    }
+    c0_frames[c0_frameCount++] = f;
+}
+static inline int32_t c0_leave(void) {
+    struct c0_frame* f;
+    if (c0_frameCount <= 1) c0_fail("invalid control transfer");
+    f = &c0_frames[--c0_frameCount];
+    c0_sp = f->prevSP;
+    c0_bp = f->prevBP;
+    return f->returnSite;
+}
+
+static inline void c0_sprint(int32_t addr) {
+    slot_t ch;
+    while ((ch = c0_load(addr++) & 0xff) != 0) putchar(ch);
+}
+static inline void c0_iscan(void) { int v; if (scanf("%d", &v) != 1) c0_fail("I/O error"); c0_push(v); }
+static inline void c0_dscan(void) { double v; if (scanf("%lf", &v) != 1) c0_fail("I/O error"); c0_pushd(v); }
+static inline void c0_cscan(void) { unsigned char v; if (scanf(" %c", &v) != 1) c0_fail("I/O error"); c0_push(v); }
+)";
+
+class CEmitter {
+public:
+    CEmitter(const File& file, std::ostream& out) : _file(file), _out(out) {}
+
+    void emit() {
+        auto mainIndex = findMain();
+        // make_vm calls main the same way
+        auto start = _file.start;
+        start.push_back(Instruction{OpCode::snew, _file.functions.at(mainIndex).paramSize, 0});
+        start.push_back(Instruction{OpCode::call, static_cast<u4>(mainIndex), 0});
+
+        _out << "/* generated by cc0 --emit-c */\n" << runtime << "\n";
+        literals();
+        _out << "static void c0_run(void) {\n"
+                "    int32_t site = 0;\n"
+                "    slot_t l = 0, r = 0, v = 0;\n"
+                "    double dl = 0, dr = 0;\n"
+                "    (void)l; (void)r; (void)v; (void)dl; (void)dr;\n";
+        code("S", start, false);
+        _out << "    return;\n";
+        for (std::size_t i = 0; i < _file.functions.size(); ++i) {
+            code("F" + std::to_string(i), _file.functions[i].instructions, true);
+            _out << "    c0_fail(\"invalid control transfer\");\n";
+        }
+        _out << "c0_return:\n"
+                "    switch (site) {\n";
+        for (int i = 0; i < _sites; ++i) {
+            _out << "    case " << i << ": goto R" << i << ";\n";
+        }
+        _out << "    }\n"
+                "}\n\n";
+
+        _out << "int main(void) {\n"
+                "    c0_stack = (slot_t*)calloc(MAX_STACK_ADDR, sizeof(slot_t));\n"
+                "    c0_heap = (slot_t*)calloc(MAX_HEAP_ADDR - MIN_HEAP_ADDR, sizeof(slot_t));\n"
+                "    c0_frameCapacity = 64;\n"
+                "    c0_frames = (struct c0_frame*)malloc(c0_frameCapacity * sizeof *c0_frames);\n"
+                "    if (!c0_stack || !c0_heap || !c0_frames) return 2;\n"
+                "    memset(c0_frames, 0, sizeof *c0_frames);\n"
+                "    c0_frameCount = 1;\n";
+        for (std::size_t i = 0; i < _file.constants.size(); ++i) {
+            if (_file.constants[i].type == Constant::Type::STRING) {
+                _out << "    c0_literal(c0_string" << i << ", "
+                     << std::get<str_t>(_file.constants[i].value).size() << ");\n";
+            }
+        }
+        _out << "    c0_run();\n"
+                "    return 0;\n"
+                "}\n";
+    }
+
+private:
+    std::size_t findMain() const {
+        for (std::size_t i = 0; i < _file.functions.size(); ++i) {
+            auto& constant = _file.constants.at(_file.functions[i].nameIndex);
+            if (constant.type != Constant::Type::STRING) {
+                throw InvalidFile("function name not found");
+            }
+            if (std::get<str_t>(constant.value) == "main") {
+                return i;
+            }
+        }
+        throw InvalidFile("main not found");
+    }
+
+    // string literals are allocated in constant order, like BasicVM::buildConstantPool
+    void literals() {
+        addr_t next = 0x01000000;
+        for (std::size_t i = 0; i < _file.constants.size(); ++i) {
+            auto& constant = _file.constants[i];
+            _literalAddr.push_back(next);
+            if (constant.type != Constant::Type::STRING) {
+                continue;
+            }
+            auto& str = std::get<str_t>(constant.value);
+            _out << "static const unsigned char c0_string" << i << "[] = {";
+            for (auto ch : str) {
+                _out << static_cast<int>(static_cast<unsigned char>(ch)) << ",";
+            }
+            _out << "0};\n";
+            next += static_cast<addr_t>(str.size()) + 1;
+        }
+        _out << "\n";
+    }
+
+    static bool isJump(OpCode op) {
+        switch (op) {
+        case OpCode::jmp:
+        case OpCode::je: case OpCode::jne: case OpCode::jl:
+        case OpCode::jge: case OpCode::jg: case OpCode::jle:
+        case OpCode::if_icmpeq: case OpCode::if_icmpne: case OpCode::if_icmplt:
+        case OpCode::if_icmpge: case OpCode::if_icmpgt: case OpCode::if_icmple:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // the label of `target`, or a runtime error if it is out of range
+    std::string jumpTo(u4 target) {
+        if (target >= _code->size()) {
+            return "c0_fail(\"invalid control transfer\");";
+        }
+        _targets.insert(target);
+        return "goto " + _prefix + "_" + std::to_string(target) + ";";
+    }
+
+    // a switch table entry, or a runtime error if the table is malformed
+    const Instruction* entry(std::size_t index, OpCode op) const {
+        if (index >= _code->size() || (*_code)[index].op != op) {
+            return nullptr;
+        }
+        return &(*_code)[index];
+    }
+
+    void code(const std::string& prefix, const std::vector<Instruction>& code, bool inFunction) {
+        _prefix = prefix;
+        _code = &code;
+        _targets.clear();
+        // bodies first, labels only where something jumps to, so the C compiler does not warn
+        std::vector<std::string> lines;
+        for (std::size_t ip = 0; ip < code.size(); ++ip) {
+            lines.push_back(instruction(code[ip], ip, inFunction));
+        }
+        if (inFunction) {
+            _out << prefix << ":\n";
+        }
+        for (std::size_t ip = 0; ip < code.size(); ++ip) {
+            if (_targets.count(ip)) {
+                _out << prefix << "_" << ip << ":\n";
+            }
+            _out << "    " << lines[ip] << "\n";
+        }
+    }
+
+    std::string instruction(const Instruction& ins, std::size_t ip, bool inFunction) {
+        auto x = std::to_string(ins.x);
+        auto ix = std::to_string(static_cast<i4>(ins.x));
+        switch (ins.op) {
+        case OpCode::nop:     return ";";
+        case OpCode::bipush:
+        case OpCode::ipush:   return "c0_push(" + ix + ");";
+        case OpCode::pop:     return "c0_popn(1);";
+        case OpCode::pop2:    return "c0_popn(2);";
+        case OpCode::popn:    return "c0_popn(" + ix + ");";
+        case OpCode::dup:     return "c0_dup(1);";
+        case OpCode::dup2:    return "c0_dup(2);";
+        case OpCode::loadc: {
+            if (ins.x >= _file.constants.size()) {
+                return "c0_fail(\"invalid instruction\");";
+            }
+            auto& constant = _file.constants[ins.x];
+            switch (constant.type) {
+            case Constant::Type::STRING: return "c0_push(" + std::to_string(_literalAddr[ins.x]) + ");";
+            case Constant::Type::INT:    return "c0_push(" + std::to_string(std::get<int_t>(constant.value)) + ");";
+            case Constant::Type::DOUBLE: {
+                auto value = std::get<double_t>(constant.value);
+                u8 bits;
+                std::memcpy(&bits, &value, sizeof bits);
+                return "c0_pushd(c0_bits(" + std::to_string(bits) + "ull));";
+            }
+            }
+            return "c0_fail(\"invalid instruction\");";
+        }
+        case OpCode::loada:
+            return "c0_push(c0_base(" + x + ") + " + std::to_string(static_cast<i4>(ins.y)) + ");";
+        case OpCode::_new:    return "c0_push(c0_new(c0_pop()));";
+        case OpCode::snew:    return "c0_snew(" + ix + ");";
+        case OpCode::_memcpy: return "r = c0_pop(); v = c0_pop(); l = c0_pop(); c0_memcpy(l, v, r);";
+        case OpCode::_memset: return "r = c0_pop(); v = c0_pop(); l = c0_pop(); c0_memset(l, v, r);";
+
+        case OpCode::iload:
+        case OpCode::aload:   return "c0_push(c0_load(c0_pop()));";
+        case OpCode::dload:   return "c0_pushd(c0_loadd(c0_pop()));";
+        case OpCode::iaload:
+        case OpCode::aaload:  return "r = c0_pop(); l = c0_pop(); c0_push(c0_load(l + r));";
+        case OpCode::daload:  return "r = c0_pop(); l = c0_pop(); c0_pushd(c0_loadd(l + 2 * r));";
+        case OpCode::istore:
+        case OpCode::astore:  return "r = c0_pop(); l = c0_pop(); c0_store(l, r);";
+        case OpCode::dstore:  return "dr = c0_popd(); l = c0_pop(); c0_stored(l, dr);";
+        case OpCode::iastore:
+        case OpCode::aastore: return "v = c0_pop(); r = c0_pop(); l = c0_pop(); c0_store(l + r, v);";
+        case OpCode::dastore: return "dr = c0_popd(); r = c0_pop(); l = c0_pop(); c0_stored(l + 2 * r, dr);";
+
+        case OpCode::iadd:    return "r = c0_pop(); l = c0_pop(); c0_push(c0_add(l, r));";
+        case OpCode::isub:    return "r = c0_pop(); l = c0_pop(); c0_push(c0_sub(l, r));";
+        case OpCode::imul:    return "r = c0_pop(); l = c0_pop(); c0_push(c0_mul(l, r));";
+        case OpCode::idiv:    return "r = c0_pop(); l = c0_pop(); c0_push(c0_div(l, r));";
+        case OpCode::ineg:    return "c0_push(c0_sub(0, c0_pop()));";
+        case OpCode::icmp:    return "r = c0_pop(); l = c0_pop(); c0_push(c0_cmp(l, r));";
+        case OpCode::dadd:    return "dr = c0_popd(); dl = c0_popd(); c0_pushd(dl + dr);";
+        case OpCode::dsub:    return "dr = c0_popd(); dl = c0_popd(); c0_pushd(dl - dr);";
+        case OpCode::dmul:    return "dr = c0_popd(); dl = c0_popd(); c0_pushd(dl * dr);";
+        case OpCode::ddiv:    return "dr = c0_popd(); dl = c0_popd(); c0_pushd(dl / dr);";
+        case OpCode::dneg:    return "c0_pushd(-c0_popd());";
+        case OpCode::dcmp:    return "dr = c0_popd(); dl = c0_popd(); c0_push(c0_cmpd(dl, dr));";
+
+        case OpCode::i2d:     return "c0_pushd((double)c0_pop());";
+        case OpCode::d2i:     return "c0_push((slot_t)c0_popd());";
+        case OpCode::i2c:     return "c0_push(c0_pop() & 0xff);";
+
+        case OpCode::jmp:     return jumpTo(ins.x);
+        case OpCode::je:      return "if (c0_pop() == 0) " + jumpTo(ins.x);
+        case OpCode::jne:     return "if (c0_pop() != 0) " + jumpTo(ins.x);
+        case OpCode::jl:      return "if (c0_pop() < 0) " + jumpTo(ins.x);
+        case OpCode::jge:     return "if (c0_pop() >= 0) " + jumpTo(ins.x);
+        case OpCode::jg:      return "if (c0_pop() > 0) " + jumpTo(ins.x);
+        case OpCode::jle:     return "if (c0_pop() <= 0) " + jumpTo(ins.x);
+        case OpCode::if_icmpeq: return "r = c0_pop(); l = c0_pop(); if (l == r) " + jumpTo(ins.x);
+        case OpCode::if_icmpne: return "r = c0_pop(); l = c0_pop(); if (l != r) " + jumpTo(ins.x);
+        case OpCode::if_icmplt: return "r = c0_pop(); l = c0_pop(); if (l < r) " + jumpTo(ins.x);
+        case OpCode::if_icmpge: return "r = c0_pop(); l = c0_pop(); if (l >= r) " + jumpTo(ins.x);
+        case OpCode::if_icmpgt: return "r = c0_pop(); l = c0_pop(); if (l > r) " + jumpTo(ins.x);
+        case OpCode::if_icmple: return "r = c0_pop(); l = c0_pop(); if (l <= r) " + jumpTo(ins.x);
+        case OpCode::tableswitch: {
+            std::string s = "switch ((int64_t)c0_pop() - (" + ix + ")) {";
+            for (u4 i = 0; i < ins.y; ++i) {
+                auto target = entry(ip + 2 + i, OpCode::jmp);
+                if (target == nullptr) {
+                    return "c0_fail(\"invalid instruction\");";
+                }
+                s += " case " + std::to_string(i) + ": " + jumpTo(target->x);
+            }
+            auto fallback = entry(ip + 1, OpCode::jmp);
+            if (fallback == nullptr) {
+                return "c0_fail(\"invalid instruction\");";
+            }
+            return s + " default: " + jumpTo(fallback->x) + " }";
+        }
+        case OpCode::lookupswitch: {
+            std::string s = "r = c0_pop();";
+            for (u4 i = 0; i < ins.x; ++i) {
+                auto item = entry(ip + 2 + i, OpCode::_case);
+                if (item == nullptr) {
+                    return "c0_fail(\"invalid instruction\");";
+                }
+                s += " if (r == " + std::to_string(static_cast<i4>(item->x)) + ") " + jumpTo(item->y);
+            }
+            auto fallback = entry(ip + 1, OpCode::jmp);
+            if (fallback == nullptr) {
+                return "c0_fail(\"invalid instruction\");";
+            }
+            return s + " " + jumpTo(fallback->x);
+        }
+        case OpCode::_case:   return "c0_fail(\"invalid instruction\");";
+
+        case OpCode::call: {
+            if (ins.x >= _file.functions.size()) {
+                return "c0_fail(\"invalid control transfer\");";
+            }
+            auto& fun = _file.functions[ins.x];
+            auto site = std::to_string(_sites++);
+            return "c0_enter(" + std::to_string(fun.paramSize) + ", " + std::to_string(fun.level) + ", " + site
+                + "); goto F" + x + "; R" + site + ":;";
+        }
+        case OpCode::ret:
+            return inFunction ? "site = c0_leave(); goto c0_return;" : "c0_fail(\"invalid control transfer\");";
+        case OpCode::iret:
+        case OpCode::aret:
+            return inFunction ? "r = c0_pop(); site = c0_leave(); c0_push(r); goto c0_return;"
+                              : "c0_fail(\"invalid control transfer\");";
+        case OpCode::dret:
+            return inFunction ? "dr = c0_popd(); site = c0_leave(); c0_pushd(dr); goto c0_return;"
+                              : "c0_fail(\"invalid control transfer\");";
+
+        case OpCode::iprint:  return "printf(\"%d\", c0_pop());";
+        case OpCode::dprint:  return "printf(\"%f\", c0_popd());";
+        case OpCode::cprint:  return "putchar(c0_pop() & 0xff);";
+        case OpCode::sprint:  return "c0_sprint(c0_pop());";
+        case OpCode::printl:  return "putchar('\\n');";
+        case OpCode::iscan:   return "c0_iscan();";
+        case OpCode::dscan:   return "c0_dscan();";
+        case OpCode::cscan:   return "c0_cscan();";
+        default:
+            return ";";
+        }
+    }
+
+private:
+    const File& _file;
+    std::ostream& _out;
+    std::vector<addr_t> _literalAddr;
+    int _sites = 0;
+    std::string _prefix;
+    const std::vector<Instruction>* _code = nullptr;
+    std::set<std::size_t> _targets;
+};
+
+}
+
+void File::output_c(std::ostream& out) {
+    decode_all();
+    CEmitter(*this, out).emit();
+}
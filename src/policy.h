@@ -0,0 +1,42 @@
+#ifndef POLICY_H_INCLUDED
+#define POLICY_H_INCLUDED
+
+namespace vm {
+
+// The runtime checks of BasicVM, fixed at compile time.
+//
+// The verifier proves the stack bounds and the jump targets of the functions it accepts,
+// which lets the unchecked mode drop those checks. What it cannot prove are the addresses
+// computed at runtime and the divisors, which the policy decides about too.
+//
+// There is no mode in between: verified frames only run unchecked under UncheckedPolicy,
+// which refuses files with unverified functions. The checked VM accepts those files but
+// keeps every check on every frame.
+
+// For development: every file runs, every frame on the fully checked path, and bad
+// addresses or divisions are reported as runtime errors.
+struct CheckedPolicy {
+    // functions the verifier rejects still run, with the stack and jump checks
+    static constexpr bool allowUnverified = true;
+    // verified frames keep the stack and jump checks too, so a mistake in the verifier
+    // shows up as a runtime error rather than as corrupted memory
+    static constexpr bool checkVerified = true;
+    // addresses are checked against the stack and the heap blocks
+    static constexpr bool checkMemory = true;
+    // integer division by zero is a runtime error
+    static constexpr bool checkDivision = true;
+};
+
+// For verified binaries: make_vm rejects a file with an unverified function, and the
+// remaining checks compile to nothing. A bad address or a division by zero is undefined.
+// Running out of stack or frames is still reported, it depends on the input.
+struct UncheckedPolicy {
+    static constexpr bool allowUnverified = false;
+    static constexpr bool checkVerified = false;
+    static constexpr bool checkMemory = false;
+    static constexpr bool checkDivision = false;
+};
+
+}
+
+#endif
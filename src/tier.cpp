@@ -0,0 +1,192 @@
+#include "./tier.h"
+#include "./type.h"
+#include "./instruction.h"
+
+#include <vector>
+
+namespace vm {
+
+namespace {
+
+bool isPush(const Instruction& ins) {
+    return ins.op == OpCode::ipush || ins.op == OpCode::bipush;
+}
+
+// the fused form of a single jump, plain if `op` is not one
+FusedOp jumpOf(OpCode op) {
+    switch (op) {
+    case OpCode::jmp:       return FusedOp::jmp;
+    case OpCode::je:        return FusedOp::je;
+    case OpCode::jne:       return FusedOp::jne;
+    case OpCode::jl:        return FusedOp::jl;
+    case OpCode::jge:       return FusedOp::jge;
+    case OpCode::jg:        return FusedOp::jg;
+    case OpCode::jle:       return FusedOp::jle;
+    case OpCode::if_icmpeq: return FusedOp::if_icmpeq;
+    case OpCode::if_icmpne: return FusedOp::if_icmpne;
+    case OpCode::if_icmplt: return FusedOp::if_icmplt;
+    case OpCode::if_icmpge: return FusedOp::if_icmpge;
+    case OpCode::if_icmpgt: return FusedOp::if_icmpgt;
+    case OpCode::if_icmple: return FusedOp::if_icmple;
+    default:                return FusedOp::plain;
+    }
+}
+
+// if_icmpXX against a pushed constant
+FusedOp compareImmOf(OpCode op) {
+    switch (op) {
+    case OpCode::if_icmpeq: return FusedOp::if_immeq;
+    case OpCode::if_icmpne: return FusedOp::if_immne;
+    case OpCode::if_icmplt: return FusedOp::if_immlt;
+    case OpCode::if_icmpge: return FusedOp::if_immge;
+    case OpCode::if_icmpgt: return FusedOp::if_immgt;
+    case OpCode::if_icmple: return FusedOp::if_immle;
+    default:                return FusedOp::plain;
+    }
+}
+
+FusedOp arithmeticOf(OpCode op) {
+    switch (op) {
+    case OpCode::iload:  return FusedOp::iload;
+    case OpCode::istore: return FusedOp::istore;
+    case OpCode::iadd:   return FusedOp::iadd;
+    case OpCode::isub:   return FusedOp::isub;
+    case OpCode::imul:   return FusedOp::imul;
+    case OpCode::idiv:   return FusedOp::idiv;
+    case OpCode::ineg:   return FusedOp::ineg;
+    case OpCode::icmp:   return FusedOp::icmp;
+    default:             return FusedOp::plain;
+    }
+}
+
+int_t negate(int_t value) {
+    return static_cast<int_t>(0u - static_cast<u4>(value));
+}
+
+class Fuser {
+public:
+    explicit Fuser(const std::vector<Instruction>& code) : _code(code), _target(code.size(), false) {
+        for (auto& ins : code) {
+            if (jumpOf(ins.op) != FusedOp::plain && ins.x < code.size()) {
+                _target[ins.x] = true;
+            }
+            else if (ins.op == OpCode::_case && ins.y < code.size()) {
+                _target[ins.y] = true;
+            }
+        }
+    }
+
+    FusedCode run() {
+        FusedCode result;
+        result.entry.assign(_code.size() + 1, -1);
+        for (std::size_t ip = 0; ip < _code.size(); ) {
+            result.entry[ip] = static_cast<addr_t>(result.code.size());
+            std::size_t length = 1;
+            result.code.push_back(match(ip, length));
+            ip += length;
+        }
+        result.entry[_code.size()] = static_cast<addr_t>(result.code.size());
+        result.code.push_back(FusedInstruction{FusedOp::end, static_cast<addr_t>(_code.size()), 0, 0, 0, 0});
+
+        // jump targets are sequence starts, so they all have an entry (the jumps are the last FusedOps).
+        // The verifier does not look at unreachable jumps, those past the code go to the end.
+        for (auto& ins : result.code) {
+            if (ins.op >= FusedOp::jmp) {
+                auto target = static_cast<std::size_t>(static_cast<u4>(ins.target));
+                ins.target = result.entry[target < _code.size() ? target : _code.size()];
+            }
+        }
+        return result;
+    }
+
+private:
+    // whether `length` instructions from `ip` exist and control can only enter them at `ip`
+    bool fits(std::size_t ip, std::size_t length) const {
+        if (ip + length > _code.size()) {
+            return false;
+        }
+        for (std::size_t i = ip + 1; i < ip + length; ++i) {
+            if (_target[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool is(std::size_t ip, OpCode op) const {
+        return _code[ip].op == op;
+    }
+
+    FusedInstruction match(std::size_t ip, std::size_t& length) const {
+        auto& ins = _code[ip];
+        FusedInstruction fused{FusedOp::plain, static_cast<addr_t>(ip), 0, 0, 0, 0};
+
+        if (ins.op == OpCode::loada) {
+            fused.level = static_cast<u2>(ins.x);
+            fused.offset = static_cast<addr_t>(ins.y);
+            if (fits(ip, 6) && is(ip + 1, OpCode::loada) && _code[ip + 1].x == ins.x && _code[ip + 1].y == ins.y
+                && is(ip + 2, OpCode::iload) && isPush(_code[ip + 3])
+                && (is(ip + 4, OpCode::iadd) || is(ip + 4, OpCode::isub)) && is(ip + 5, OpCode::istore)) {
+                auto value = static_cast<int_t>(_code[ip + 3].x);
+                fused.op = ins.x == 0 ? FusedOp::inc_local : FusedOp::inc;
+                fused.value = is(ip + 4, OpCode::iadd) ? value : negate(value);
+                // the iload fails first if the variable is out of reach
+                fused.ip = static_cast<addr_t>(ip + 2);
+                length = 6;
+            }
+            else if (fits(ip, 2) && is(ip + 1, OpCode::iload)) {
+                fused.op = ins.x == 0 ? FusedOp::load_local : FusedOp::load;
+                fused.ip = static_cast<addr_t>(ip + 1);
+                length = 2;
+            }
+            else {
+                fused.op = FusedOp::loada;
+            }
+            return fused;
+        }
+
+        if (isPush(ins)) {
+            fused.value = static_cast<int_t>(ins.x);
+            fused.op = FusedOp::ipush;
+            if (fits(ip, 2)) {
+                auto& next = _code[ip + 1];
+                if (next.op == OpCode::iadd || next.op == OpCode::isub) {
+                    fused.op = FusedOp::add_imm;
+                    fused.value = next.op == OpCode::iadd ? fused.value : negate(fused.value);
+                    length = 2;
+                }
+                else if (next.op == OpCode::imul) {
+                    fused.op = FusedOp::mul_imm;
+                    length = 2;
+                }
+                else if (compareImmOf(next.op) != FusedOp::plain) {
+                    fused.op = compareImmOf(next.op);
+                    fused.target = static_cast<addr_t>(next.x);
+                    length = 2;
+                }
+            }
+            return fused;
+        }
+
+        if (auto op = jumpOf(ins.op); op != FusedOp::plain) {
+            fused.op = op;
+            fused.target = static_cast<addr_t>(ins.x);
+            return fused;
+        }
+
+        fused.op = arithmeticOf(ins.op);
+        return fused;
+    }
+
+private:
+    const std::vector<Instruction>& _code;
+    std::vector<bool> _target;
+};
+
+}
+
+FusedCode fuse(const std::vector<Instruction>& code) {
+    return Fuser(code).run();
+}
+
+}
@@ -0,0 +1,67 @@
+#ifndef TIER_H_INCLUDED
+#define TIER_H_INCLUDED
+
+#include "./type.h"
+#include "./instruction.h"
+
+#include <vector>
+
+namespace vm {
+
+// Operations of the fused tier: common instruction sequences of compiled c0 code
+// collapsed into one dispatch, running without the stack checks of the interpreter.
+enum class FusedOp : u1 {
+    // runs the original instruction through the interpreter
+    plain,
+    // falling off the end of the function
+    end,
+
+    ipush,
+    // loada level,offset
+    loada,
+    // loada 0,offset; iload
+    load_local,
+    // loada level,offset; iload
+    load,
+    // loada 0,offset; loada 0,offset; iload; ipush value; iadd; istore
+    // (isub is folded into a negative value)
+    inc_local,
+    // the same for an enclosing frame
+    inc,
+    iload, istore,
+    iadd, isub, imul, idiv, ineg, icmp,
+    // ipush value; iadd / isub / imul
+    add_imm, mul_imm,
+
+    // the jumps have to stay last
+    jmp,
+    je, jne, jl, jge, jg, jle,
+    if_icmpeq, if_icmpne, if_icmplt, if_icmpge, if_icmpgt, if_icmple,
+    // ipush value; if_icmpXX target
+    if_immeq, if_immne, if_immlt, if_immge, if_immgt, if_immle,
+};
+
+struct FusedInstruction {
+    FusedOp op;
+    // the original instruction, reported by runtime errors and stack traces
+    addr_t ip;
+    u2 level;
+    addr_t offset;
+    int_t value;
+    // index into the fused code
+    addr_t target;
+};
+
+struct FusedCode {
+    std::vector<FusedInstruction> code;
+    // the fused instruction starting at each original instruction, -1 inside a fused sequence
+    std::vector<addr_t> entry;
+};
+
+// Pre-decodes the instructions of a verified function. Sequences are never fused across a
+// jump target, so every place control can reach in the original code has an entry.
+FusedCode fuse(const std::vector<Instruction>& code);
+
+}
+
+#endif
@@ -25,16 +25,22 @@ using i8 = std::int64_t;
 using f4 = float;
 using f8 = double;
 
+#ifdef C0_WIDE_SLOTS
+// every value sits in one aligned 64-bit slot, a double still spans two addresses
+// (the second slot is unused) so the bytecode stays the same
+using slot_t   = i8;
+#else
 using slot_t   = i4;
-using int_t    = slot_t;
+#endif
+using int_t    = i4;
 using double_t = f8;
-using addr_t   = slot_t;
+using addr_t   = i4;
 using char_t   = unsigned char;
 using str_t    = std::string;
 
 template <typename T>
-// sizeof(T)/sizeof(slot_t)
-constexpr int_t slots_count = sizeof(T)/sizeof(slot_t);
+// the addresses a T spans, a double takes two in both slot layouts
+constexpr int_t slots_count = sizeof(T) > sizeof(i4) ? 2 : 1;
 
 /*
 template <class T>
@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <string>
 #include <sstream>
+#include <vector>
 
 inline bool is_hex_digit(unsigned char ch) {
     return '0' <= ch && ch <= '9'
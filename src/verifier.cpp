@@ -0,0 +1,294 @@
+#include "./verifier.h"
+#include "./type.h"
+#include "./instruction.h"
+#include "./constant.h"
+#include "./function.h"
+#include "./util/print.hpp"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace vm {
+
+namespace {
+
+// deeper than any VM stack (see BasicVM::MAX_STACK_SIZE), which also keeps the depths and
+// the frame ends computed from them far from overflowing
+const addr_t MAX_DEPTH = 0x01000000;
+
+// slots popped and pushed by one instruction
+struct StackEffect {
+    addr_t pop;
+    addr_t push;
+};
+
+// what a ret instruction pops, -1 for any other opcode
+addr_t returnSlotsOf(OpCode op) {
+    switch (op) {
+    case OpCode::ret: case OpCode::iret: case OpCode::dret: case OpCode::aret:
+        return infoOf(op).pops;
+    default:
+        return -1;
+    }
+}
+
+class CodeVerifier {
+public:
+    CodeVerifier(const File& file, const VerifyResult& result, const std::vector<Instruction>& code)
+        : _file(file), _result(result), _code(code) {}
+
+    // .start has no caller to return to, so it starts with returnable = false
+    CodeInfo run(addr_t initialDepth, bool returnable) {
+        CodeInfo info;
+        info.depth.assign(_code.size(), -1);
+        info.maxStack = initialDepth;
+        _returnable = returnable;
+        try {
+            if (!_code.empty()) {
+                flow(info, -1, 0, initialDepth);
+            }
+            while (!_pending.empty()) {
+                addr_t ip = _pending.back();
+                _pending.pop_back();
+                step(info, ip);
+            }
+            info.verified = true;
+        }
+        catch (const std::string& reason) {
+            info.verified = false;
+            info.reason = reason;
+        }
+        return info;
+    }
+
+private:
+    [[noreturn]] void fail(addr_t ip, const std::string& msg) {
+        throw strfmt("instruction {}: {}", ip, msg);
+    }
+
+    // records that control reaches `to` from `from` with `depth` slots on the stack
+    void flow(CodeInfo& info, addr_t from, addr_t to, addr_t depth) {
+        if (to < 0 || to >= static_cast<addr_t>(_code.size())) {
+            fail(from, "control transfer out of the function");
+        }
+        if (info.depth[to] == -1) {
+            info.depth[to] = depth;
+            _pending.push_back(to);
+        }
+        else if (info.depth[to] != depth) {
+            fail(to, strfmt("inconsistent stack depth {} and {}", info.depth[to], depth));
+        }
+    }
+
+    StackEffect effectOf(addr_t ip, const Instruction& ins) {
+        switch (ins.op) {
+        case OpCode::popn:    return {static_cast<addr_t>(ins.x), 0};
+        case OpCode::loadc: {
+            if (ins.x >= _file.constants.size()) {
+                fail(ip, "constant index out of range");
+            }
+            switch (_file.constants[ins.x].type) {
+            case Constant::Type::DOUBLE: return {0, 2};
+            default:                     return {0, 1};
+            }
+        }
+        case OpCode::snew:    return {0, static_cast<addr_t>(ins.x)};
+        case OpCode::_case:
+            fail(ip, "unexpected instruction");
+
+        case OpCode::call: {
+            if (ins.x >= _file.functions.size()) {
+                fail(ip, "function index out of range");
+            }
+            addr_t ret = _result.returnSlots[ins.x];
+            if (ret < 0) {
+                fail(ip, "the called function returns inconsistently");
+            }
+            return {_file.functions[ins.x].paramSize, ret};
+        }
+        case OpCode::ret: case OpCode::iret: case OpCode::dret: case OpCode::aret:
+            if (!_returnable) {
+                fail(ip, "return outside of a function");
+            }
+            return {returnSlotsOf(ins.op), 0};
+
+        default: {
+            // everything else is fixed by the opcode
+            auto& info = infoOf(ins.op);
+            if (!info.valid()) {
+                fail(ip, "unexpected instruction");
+            }
+            return {info.pops, info.pushes};
+        }
+        }
+    }
+
+    // the jmp entry at `index` of a switch table
+    const Instruction& tableEntry(addr_t ip, addr_t index, OpCode op) {
+        if (index >= static_cast<addr_t>(_code.size()) || _code[index].op != op) {
+            fail(ip, "malformed switch table");
+        }
+        return _code[index];
+    }
+
+    void step(CodeInfo& info, addr_t ip) {
+        auto& ins = _code[ip];
+        auto effect = effectOf(ip, ins);
+        addr_t depth = info.depth[ip];
+        if (effect.pop < 0 || effect.push < 0 || depth < effect.pop) {
+            fail(ip, "stack underflow");
+        }
+        if (effect.push > MAX_DEPTH - (depth - effect.pop)) {
+            fail(ip, "stack overflow");
+        }
+        depth += effect.push - effect.pop;
+        info.maxStack = std::max(info.maxStack, std::max(depth, info.depth[ip]));
+
+        switch (ins.op) {
+        case OpCode::jmp:
+            flow(info, ip, ins.x, depth);
+            break;
+        case OpCode::je: case OpCode::jne: case OpCode::jl:
+        case OpCode::jge: case OpCode::jg: case OpCode::jle:
+        case OpCode::if_icmpeq: case OpCode::if_icmpne: case OpCode::if_icmplt:
+        case OpCode::if_icmpge: case OpCode::if_icmpgt: case OpCode::if_icmple:
+            flow(info, ip, ins.x, depth);
+            flow(info, ip, ip + 1, depth);
+            break;
+        case OpCode::tableswitch: {
+            // the default entry and one entry per key
+            for (addr_t i = 0; i <= static_cast<addr_t>(ins.y); ++i) {
+                flow(info, ip, tableEntry(ip, ip + 1 + i, OpCode::jmp).x, depth);
+            }
+        } break;
+        case OpCode::lookupswitch: {
+            flow(info, ip, tableEntry(ip, ip + 1, OpCode::jmp).x, depth);
+            for (addr_t i = 0; i < static_cast<addr_t>(ins.x); ++i) {
+                auto& entry = tableEntry(ip, ip + 2 + i, OpCode::_case);
+                if (i > 0 && static_cast<int_t>(_code[ip + 1 + i].x) >= static_cast<int_t>(entry.x)) {
+                    fail(ip, "lookupswitch keys are not sorted");
+                }
+                flow(info, ip, entry.y, depth);
+            }
+        } break;
+        case OpCode::ret: case OpCode::iret: case OpCode::dret: case OpCode::aret:
+            break;
+        default:
+            // falling off the end is reported by the VM itself
+            if (ip + 1 < static_cast<addr_t>(_code.size())) {
+                flow(info, ip, ip + 1, depth);
+            }
+            else {
+                info.endDepth = depth;
+            }
+            break;
+        }
+    }
+
+private:
+    const File& _file;
+    const VerifyResult& _result;
+    const std::vector<Instruction>& _code;
+    std::vector<addr_t> _pending;
+    bool _returnable = true;
+};
+
+// Longest chains of calls over the call graph, which is unbounded as soon as it has a cycle.
+class CallDepth {
+public:
+    explicit CallDepth(const File& file) : _file(file), _depth(file.functions.size(), UNVISITED) {}
+
+    // frames on the longest chain starting with a frame running `code`, -1 if unbounded
+    addr_t of(const std::vector<Instruction>& code) {
+        addr_t deepest = 0;
+        for (auto& ins : code) {
+            if (ins.op != OpCode::call || ins.x >= _file.functions.size()) {
+                continue;
+            }
+            addr_t depth = ofFunction(ins.x);
+            if (depth < 0) {
+                return -1;
+            }
+            deepest = std::max(deepest, depth);
+        }
+        return deepest + 1;
+    }
+
+private:
+    static constexpr addr_t UNVISITED = -2;
+    static constexpr addr_t VISITING = -3;
+
+    addr_t ofFunction(u4 index) {
+        auto& depth = _depth[index];
+        if (depth == VISITING) {
+            return -1;
+        }
+        if (depth == UNVISITED) {
+            depth = VISITING;
+            depth = of(_file.functions[index].instructions);
+        }
+        return depth;
+    }
+
+private:
+    const File& _file;
+    std::vector<addr_t> _depth;
+};
+
+}
+
+addr_t returnSlotsOf(const std::vector<Instruction>& code) {
+    addr_t slots = 0;
+    bool found = false;
+    for (auto& ins : code) {
+        addr_t n = returnSlotsOf(ins.op);
+        if (n < 0) {
+            continue;
+        }
+        if (found && n != slots) {
+            return -1;
+        }
+        slots = n;
+        found = true;
+    }
+    return slots;
+}
+
+VerifyResult verify(const File& file) {
+    VerifyResult result;
+
+    // the return size of a function is needed by its callers, so collect them first
+    bool allDecoded = true;
+    for (u2 i = 0; i < file.functions.size(); ++i) {
+        if (file.decoded(i)) {
+            result.returnSlots.push_back(returnSlotsOf(file.functions[i].instructions));
+        }
+        else {
+            result.returnSlots.push_back(file.lazy[i].returnSlots);
+            allDecoded = false;
+        }
+    }
+
+    // the calls made by code not decoded yet are unknown
+    result.maxCallDepth = allDecoded ? CallDepth(file).of(file.start) : -1;
+    result.start = CodeVerifier(file, result, file.start).run(0, false);
+    for (u2 i = 0; i < file.functions.size(); ++i) {
+        if (file.decoded(i)) {
+            result.functions.push_back(verifyFunction(file, result, i));
+        }
+        else {
+            CodeInfo info;
+            info.reason = "not decoded yet";
+            result.functions.push_back(std::move(info));
+        }
+    }
+    return result;
+}
+
+CodeInfo verifyFunction(const File& file, const VerifyResult& result, u2 index) {
+    auto& fun = file.functions[index];
+    return CodeVerifier(file, result, fun.instructions).run(fun.paramSize, true);
+}
+
+}
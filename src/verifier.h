@@ -0,0 +1,50 @@
+#ifndef VERIFIER_H_INCLUDED
+#define VERIFIER_H_INCLUDED
+
+#include "./type.h"
+#include "./instruction.h"
+#include "./file.h"
+
+#include <string>
+#include <vector>
+
+namespace vm {
+
+// What the verifier proved about one instruction sequence (a function or .start).
+struct CodeInfo {
+    // every reachable instruction has a consistent, in-bounds stack depth,
+    // every jump target is inside the sequence and every switch table is well-formed
+    bool verified = false;
+    // why the code could not be verified
+    std::string reason;
+    // the highest stack depth relative to the frame base, parameters included
+    addr_t maxStack = 0;
+    // stack depth before each instruction, -1 if unreachable
+    std::vector<addr_t> depth;
+    // stack depth after falling off the end, -1 if the code never does;
+    // for .start, the slots taken by the globals
+    addr_t endDepth = -1;
+};
+
+struct VerifyResult {
+    CodeInfo start;
+    std::vector<CodeInfo> functions;
+    // slots pushed on return by each function, -1 if its ret instructions disagree
+    std::vector<addr_t> returnSlots;
+    // frames on the longest chain of calls from .start, .start included, -1 if it can recurse
+    addr_t maxCallDepth = -1;
+};
+
+// Abstractly interprets .start and every decoded function of `file` over stack depths.
+// Never throws on bad bytecode, the offending code is just left unverified. A function not
+// decoded yet is left unverified too, its return size is taken from File::lazy and the call
+// depth counts as unbounded.
+VerifyResult verify(const File& file);
+// Verifies a function of `file` once it has been decoded, against the return sizes in `result`.
+CodeInfo verifyFunction(const File& file, const VerifyResult& result, u2 index);
+// slots pushed by the ret instructions of `code`, 0 if there is none, -1 if they disagree
+addr_t returnSlotsOf(const std::vector<Instruction>& code);
+
+}
+
+#endif
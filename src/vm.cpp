@@ -2,26 +2,87 @@
 #include "./type.h"
 #include "./instruction.h"
 #include "./exception.h"
+#include "./jit.h"
 
 #include <iostream>
+#include <algorithm>
+#include <chrono>
 #include <iomanip>
+#include <iterator>
 #include <cmath>
+#include <cstring>
+#include <functional>
 
 namespace vm {
 
-const addr_t VM::MIN_STACK_ADDR = 0;
-const addr_t VM::MAX_STACK_ADDR = 0x00ffffff;
-const addr_t VM::MAX_STACK_SIZE = 0x01000000;
+namespace {
 
-const addr_t VM::MIN_HEAP_ADDR  = 0x01000000;
-const addr_t VM::MAX_HEAP_ADDR  = 0x01ffffff;
-const addr_t VM::MAX_HEAP_SIZE  = 0x01000000;
+std::vector<CompactInstruction> compactAll(const std::vector<Instruction>& instructions) {
+    std::vector<CompactInstruction> code;
+    code.reserve(instructions.size());
+    std::transform(instructions.begin(), instructions.end(), std::back_inserter(code), compact);
+    return code;
+}
+
+}
+
+template <typename Policy>
+const addr_t BasicVM<Policy>::MIN_STACK_ADDR = 0;
+template <typename Policy>
+const addr_t BasicVM<Policy>::MAX_STACK_ADDR = 0x00ffffff;
+template <typename Policy>
+const addr_t BasicVM<Policy>::MAX_STACK_SIZE = 0x01000000;
 
-VM::VM(File file) noexcept : _file(std::move(file)){
+template <typename Policy>
+const addr_t BasicVM<Policy>::MIN_HEAP_ADDR  = 0x01000000;
+template <typename Policy>
+const addr_t BasicVM<Policy>::MAX_HEAP_ADDR  = 0x01ffffff;
+template <typename Policy>
+const addr_t BasicVM<Policy>::MAX_HEAP_SIZE  = 0x01000000;
+
+template <typename Policy>
+const u4 BasicVM<Policy>::DEFAULT_TIER_UP_THRESHOLD = 1000;
+template <typename Policy>
+const std::size_t BasicVM<Policy>::MAX_CALL_DEPTH = 1 << 20;
+template <typename Policy>
+const addr_t BasicVM<Policy>::MIN_GC_GROWTH = 1 << 20;
+
+template <typename Policy>
+BasicVM<Policy>::BasicVM(File file) noexcept
+    : _file(std::move(file)), _verification(verify(_file)), _gc(false),
+      _tierUpThreshold(DEFAULT_TIER_UP_THRESHOLD), _input(std::cin.rdbuf(), std::cin.tie()) {
     init();
 }
 
-std::unique_ptr<VM> VM::make_vm(File file) {
+template <typename Policy>
+BasicVM<Policy>::~BasicVM() = default;
+
+template <typename Policy>
+bool BasicVM<Policy>::enableJit() {
+    if (!Jit<Policy>::supported()) {
+        return false;
+    }
+    _jit = std::make_unique<Jit<Policy>>(*this);
+    return true;
+}
+
+template <typename Policy>
+void BasicVM<Policy>::setTierUpThreshold(u4 threshold) {
+    _tierUpThreshold = threshold;
+}
+
+template <typename Policy>
+void BasicVM<Policy>::setInput(std::istream& in) {
+    _input = InputReader(in.rdbuf(), in.tie());
+}
+
+template <typename Policy>
+void BasicVM<Policy>::enableGC() {
+    _gc = true;
+}
+
+template <typename Policy>
+std::unique_ptr<BasicVM<Policy>> BasicVM<Policy>::make_vm(File file) {
     // found main function
     vm::u4 mainIndex = 0;
     bool mainFound = false;
@@ -31,8 +92,12 @@ std::unique_ptr<VM> VM::make_vm(File file) {
         }
         if (auto& constant = file.constants.at(fun.nameIndex); constant.type == vm::Constant::Type::STRING) {
             if (std::get<vm::str_t>(constant.value) == "main") {
-                file.start.push_back(Instruction{OpCode::snew, fun.paramSize});
-                file.start.push_back(Instruction{OpCode::call, mainIndex});
+                // the call has no source line
+                if (!file.startLines.empty()) {
+                    file.startLines.push_back(LineEntry{static_cast<u4>(file.start.size()), 0});
+                }
+                file.start.push_back(Instruction{OpCode::snew, fun.paramSize, 0});
+                file.start.push_back(Instruction{OpCode::call, mainIndex, 0});
                 break;
             }
         }
@@ -44,65 +109,139 @@ std::unique_ptr<VM> VM::make_vm(File file) {
     if (mainIndex == file.functions.size()) {
         throw InvalidFile("main not found");
     }
-    auto vm = std::make_unique<VM>(std::move(file));
+    auto vm = std::make_unique<BasicVM>(std::move(file));
+    if constexpr (!Policy::allowUnverified) {
+        // functions not decoded yet are checked by load()
+        auto& verification = vm->_verification;
+        bool verified = verification.start.verified;
+        for (u2 i = 0; i < verification.functions.size(); ++i) {
+            verified = verified && (verification.functions[i].verified || !vm->_file.decoded(i));
+        }
+        if (!verified) {
+            throw InvalidFile("the unchecked VM only runs files the verifier accepts");
+        }
+    }
     vm->_stack = std::make_unique<slot_t[]>(MAX_STACK_ADDR-MIN_STACK_ADDR);
     vm->_heap  = std::make_unique<slot_t[]>(MAX_HEAP_ADDR-MIN_HEAP_ADDR);
     return std::move(vm);
 }
 
-void VM::init() noexcept {
+template <typename Policy>
+void BasicVM<Policy>::init() noexcept {
     prepared = false;
     _sp = 0;
     _bp = 0;
     _ip = 0;
     _counterInstruction = 0;
-    _contexts.clear();
-    _heapRecord.clear();
-    _stringLiteralPool.clear();
-}
-
-void VM::buildStringLiteralPool() {
-    u2 i = 0;
-    for (auto it = _file.constants.begin(), ed = _file.constants.end(); it != ed; ++it) {
+    // without recursion the verifier knows how deep calls go, otherwise MAX_CALL_DEPTH is the limit
+    auto depth = _verification.maxCallDepth;
+    _contexts.reset(depth >= 0 ? std::min<std::size_t>(depth, MAX_CALL_DEPTH) : MAX_CALL_DEPTH);
+    u2 maxLevel = 0;
+    for (auto& fun : _file.functions) {
+        maxLevel = std::max(maxLevel, fun.level);
+    }
+    _display.assign(maxLevel + 1, 0);
+    _heapBlocks.clear();
+    _freeRanges.clear();
+    _freeRanges.emplace(MIN_HEAP_ADDR, MAX_HEAP_ADDR - MIN_HEAP_ADDR);
+    _heapSlots = 0;
+    _nextCollection = MIN_GC_GROWTH;
+    _collections.clear();
+    _constants.clear();
+    _profiles.clear();
+    _profiles.resize(_file.functions.size());
+    _tierUps.clear();
+    _fused = nullptr;
+}
+
+// Copies the string literals to the heap and turns every constant into the slots loadc pushes.
+template <typename Policy>
+void BasicVM<Policy>::buildConstantPool() {
+    _constants.resize(_file.constants.size());
+    auto resolved = _constants.begin();
+    for (auto it = _file.constants.begin(), ed = _file.constants.end(); it != ed; ++it, ++resolved) {
         auto& c = *it;
-        if (c.type == vm::Constant::Type::STRING) {
+        switch (c.type) {
+        case vm::Constant::Type::STRING: {
             str_t str = std::get<str_t>(c.value);
             addr_t addr = NEW(str.length()+1);
-            _stringLiteralPool[i] = addr;
             slot_t* dst =  toHeapPtr(addr);
             for (auto ch : str) {
                 *dst++ = ch & 0xff;
             }
             *dst = '\0';
+            _heapBlocks.at(addr).pinned = true;
+            *resolved = ResolvedConstant{{addr, 0}, 1};
+        } break;
+        case vm::Constant::Type::INT:
+            *resolved = ResolvedConstant{{std::get<int_t>(c.value), 0}, 1};
+            break;
+        case vm::Constant::Type::DOUBLE: {
+            auto value = std::get<double_t>(c.value);
+            *resolved = ResolvedConstant{{0, 0}, 2};
+            std::memcpy(resolved->slots, &value, sizeof(value));
+        } break;
+        }
+    }
+}
+
+// Packs .start and the decoded functions into CompactInstructions, load() does the others.
+template <typename Policy>
+void BasicVM<Policy>::buildCode() {
+    _startCode = compactAll(_file.start);
+    _code.clear();
+    _code.resize(_file.functions.size());
+    for (u2 i = 0; i < _code.size(); ++i) {
+        if (_file.decoded(i)) {
+            _code[i] = compactAll(_file.functions[i].instructions);
         }
-        ++i;
     }
 }
 
-void VM::start() {
+template <typename Policy>
+void BasicVM<Policy>::start() {
     init();
-    buildStringLiteralPool();
+    buildConstantPool();
+    buildCode();
     Context globalContext;
     globalContext.prevPC = 0;
     globalContext.prevSP = 0;
     globalContext.prevBP = 0;
     globalContext.BP = 0;
-    globalContext.staticLink = 0;
+    globalContext.savedDisplay = 0;
     globalContext.functionIndex = -1;
-    globalContext.functionName = "__START__";
     globalContext.functionLevel = 0;
-    _currentInstructions = _file.start;
+    globalContext.fused = nullptr;
+    _currentInstructions = &_startCode;
+    _checked = runsChecked(codeInfo(-1));
     _contexts.push_back(globalContext);
     prepared = true;
     run();
 }
 
-void VM::run() {
+template <typename Policy>
+void BasicVM<Policy>::run() {
     try {
-        while (_ip < _currentInstructions.size()) {
-            executeInstruction(_currentInstructions.at(_ip));
-            ++_ip;
-            ++_counterInstruction;
+        // .start gets the one check CALL makes for a verified function
+        if (codeInfo(-1).verified && codeInfo(-1).maxStack > MAX_STACK_ADDR) {
+            throw StackOverflow();
+        }
+        // CALL and RET switch between the modes
+        while (static_cast<std::size_t>(_ip) < _currentInstructions->size()) {
+            if (_fused) {
+                executeFused();
+            }
+            else if constexpr (Policy::allowUnverified) {
+                if (_checked) {
+                    execute<true>();
+                }
+                else {
+                    execute<false>();
+                }
+            }
+            else {
+                execute<false>();
+            }
         }
         if (_contexts.size() != 1) {
             // no ret at the end of funtion
@@ -116,54 +255,182 @@ void VM::run() {
     }
 }
 
-void VM::printStackTrace(std::ostream& out) {
-    auto red = _contexts.rend();
-    auto rit = _contexts.rbegin();
-    if (red == rit) {
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::execute() {
+    while (_checked == Checked && !_fused && static_cast<std::size_t>(_ip) < _currentInstructions->size()) {
+        if constexpr (Checked) {
+            executeInstruction<Checked>(_currentInstructions->at(_ip));
+        }
+        else {
+            executeInstruction<Checked>((*_currentInstructions)[_ip]);
+        }
+        ++_ip;
+        ++_counterInstruction;
+    }
+}
+
+// Runs the frames above `frames` in the interpreter, right after CALL has pushed them.
+template <typename Policy>
+void BasicVM<Policy>::runNested(std::size_t frames) {
+    while (_contexts.size() > frames) {
+        ++_ip;
+        if (static_cast<std::size_t>(_ip) >= _currentInstructions->size()) {
+            // no ret at the end of funtion
+            throw InvalidControlTransfer();
+        }
+        if constexpr (Policy::allowUnverified) {
+            if (_checked) {
+                executeInstruction<true>(_currentInstructions->at(_ip));
+                ++_counterInstruction;
+                continue;
+            }
+        }
+        executeInstruction<false>((*_currentInstructions)[_ip]);
+        ++_counterInstruction;
+    }
+}
+
+// Returns the fused code of `functionIndex`, fusing it first if it just became hot.
+template <typename Policy>
+const FusedCode* BasicVM<Policy>::tierUp(u2 functionIndex) {
+    auto& profile = _profiles.at(functionIndex);
+    if (!profile.fused && !_jit && codeInfo(functionIndex).verified
+        && static_cast<u8>(profile.calls) + profile.backEdges > _tierUpThreshold) {
+        profile.fused = std::make_unique<FusedCode>(fuse(_file.functions.at(functionIndex).instructions));
+        _tierUps.push_back(TierUp{functionIndex, _counterInstruction, profile.calls, profile.backEdges});
+    }
+    return profile.fused.get();
+}
+
+// A frame stuck in a long loop switches over right at the loop header,
+// which is a jump target and so has an entry in the fused code.
+template <typename Policy>
+void BasicVM<Policy>::countBackEdge() {
+    auto& context = _contexts.back();
+    if (context.functionIndex < 0) {
+        return;
+    }
+    ++_profiles[context.functionIndex].backEdges;
+    if (!context.fused && (context.fused = tierUp(context.functionIndex))) {
+        _fused = context.fused;
+    }
+}
+
+template <typename Policy>
+const std::string& BasicVM<Policy>::functionName(u2 functionIndex) const {
+    return std::get<str_t>(_file.constants.at(_file.functions.at(functionIndex).nameIndex).value);
+}
+
+// Walking the static chain past .start stays at .start.
+template <typename Policy>
+addr_t BasicVM<Policy>::frameBase(u2 levelDiff) const {
+    int level = _contexts.back().functionLevel - levelDiff;
+    return _contexts[level >= 0 ? _display[level] : 0].BP;
+}
+
+template <typename Policy>
+void BasicVM<Policy>::printStats(std::ostream& out) const {
+    println(out, "instructions executed:", _counterInstruction);
+    if (_jit) {
+        println(out, "native functions:", _jit->compiledCount());
+    }
+    println(out, "tier-ups:", _tierUps.size());
+    for (auto& event : _tierUps) {
+        auto& fused = *_profiles.at(event.functionIndex).fused;
+        printfmt(out, "          {} after {} calls and {} back edges, at instruction {}: {} -> {} instructions\n",
+            functionName(event.functionIndex), event.calls, event.backEdges, event.instructions,
+            _file.functions.at(event.functionIndex).instructions.size(), fused.code.size() - 1);
+    }
+    if (_gc) {
+        println(out, "collections:", _collections.size());
+        for (auto& collection : _collections) {
+            printfmt(out, "          {} ms pause: {} blocks, {} slots reclaimed, {} slots live\n",
+                collection.pauseMs, collection.reclaimedBlocks, collection.reclaimedSlots, collection.liveSlots);
+        }
+    }
+    println(out, "functions:");
+    for (u2 i = 0; i < _profiles.size(); ++i) {
+        auto& profile = _profiles[i];
+        const char* tier = !_file.decoded(i) ? "not loaded" : profile.fused ? "fused" : runsChecked(codeInfo(i)) ? "checked" : "unchecked";
+        // where the function starts in the source, if the file says
+        auto& lines = _file.functions[i].lines;
+        auto name = lines.empty() ? functionName(i) : strfmt("{} (line {})", functionName(i), lines.front().line);
+        printfmt(out, "          {}: {} calls, {} back edges, {}\n", name, profile.calls, profile.backEdges, tier);
+    }
+}
+
+template <typename Policy>
+void BasicVM<Policy>::printStackTrace(std::ostream& out) {
+    if (_contexts.size() == 0) {
         return;
     }
+    // frames only keep the function index, the names are looked up here
+    const auto nameOf = [this](const Context& context) -> std::string {
+        return context.functionIndex == -1 ? "__START__" : functionName(context.functionIndex);
+    };
+    // "instruction 3", with the source line if the file has a line table
+    const auto where = [this](const Context& context, addr_t pc) -> std::string {
+        auto& lines = context.functionIndex == -1 ? _file.startLines : _file.functions.at(context.functionIndex).lines;
+        auto line = lineOf(lines, pc);
+        return line == 0 ? strfmt("instruction {}", pc) : strfmt("instruction {} (line {})", pc, line);
+    };
+    auto i = _contexts.size() - 1;
     auto pc = this->_ip;
-    if (pc >= _currentInstructions.size()) {
-        println(out, "          control reaches the end of function", rit->functionName, "without return");
+    auto& current = _contexts[i].functionIndex == -1 ? _file.start : _file.functions.at(_contexts[i].functionIndex).instructions;
+    if (static_cast<std::size_t>(pc) >= current.size()) {
+        println(out, "          control reaches the end of function", nameOf(_contexts[i]), "without return");
     }
     else {
-        println(out, "          function", rit->functionName, "at instruction", pc, ":", _currentInstructions.at(pc));
+        println(out, "          function", nameOf(_contexts[i]), "at", where(_contexts[i], pc), ":", current.at(pc));
     }
-    while (true) {
-        pc = rit->prevPC;
-        ++rit;
-        if (rit == red) {
-            return;
-        }
-        if (rit->functionIndex == -1) {
-            println(out, "called by .start at instruction", pc, ":", _file.start.at(pc));
+    while (i > 0) {
+        pc = _contexts[i].prevPC;
+        auto& caller = _contexts[--i];
+        if (caller.functionIndex == -1) {
+            println(out, "called by .start at", where(caller, pc), ":", _file.start.at(pc));
             return;
         }
-        println(out, "called by function", rit->functionName, "at instruction", pc, ":", _file.functions.at(rit->functionIndex).instructions.at(pc));
+        println(out, "called by function", nameOf(caller), "at", where(caller, pc), ":", _file.functions.at(caller.functionIndex).instructions.at(pc));
     }
 }
 
-void VM::ensureStackRest(addr_t count) {
-    if (_sp + count > MAX_STACK_ADDR) {
-        throw StackOverflow();
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::ensureStackRest(addr_t count) {
+    if constexpr (Checked) {
+        if (_sp + count > MAX_STACK_ADDR) {
+            throw StackOverflow();
+        }
     }
 }
 
-void VM::ensureStackUsed(addr_t count) {
-    if (_bp + count > _sp) {
-        throw InvalidMemoryAccess("tried to modify important stack info");
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::ensureStackUsed(addr_t count) {
+    if constexpr (Checked) {
+        if (_bp + count > _sp) {
+            throw InvalidMemoryAccess("tried to modify important stack info");
+        }
     }
 }
 
-slot_t* VM::toStackPtr(addr_t addr) {
+template <typename Policy>
+slot_t* BasicVM<Policy>::toStackPtr(addr_t addr) {
     return _stack.get() + addr;
 }
-slot_t* VM::toHeapPtr(addr_t addr) {
+template <typename Policy>
+slot_t* BasicVM<Policy>::toHeapPtr(addr_t addr) {
     return _heap.get() + (addr-MIN_HEAP_ADDR);
 }
 
-slot_t* VM::checkAddr(addr_t addr, addr_t count) {
-    addr_t end = addr + count;
+template <typename Policy>
+slot_t* BasicVM<Policy>::checkAddr(addr_t addr, addr_t count) {
+    if constexpr (!Policy::checkMemory) {
+        return addr >= MIN_HEAP_ADDR ? toHeapPtr(addr) : toStackPtr(addr);
+    }
+    // 64 bits, a block instruction may pass any count
+    i8 end = static_cast<i8>(addr) + count;
     if (MIN_STACK_ADDR <= addr && addr < this->_sp) {
         if (end > this->_sp) {
             throw InvalidMemoryAccess("tried to access unused stack memory");
@@ -171,401 +438,646 @@ slot_t* VM::checkAddr(addr_t addr, addr_t count) {
         return toStackPtr(addr);
     }
     if (MIN_HEAP_ADDR <= addr && addr < MAX_HEAP_ADDR) {
-        for (auto& p : _heapRecord) {
-            if (p.first <= addr && end <= p.first+p.second) {
-                return toHeapPtr(addr);
-            }
+        if (auto block = findBlock(addr); block != _heapBlocks.end() && end <= block->first + block->second.size) {
+            return toHeapPtr(addr);
         }
         throw InvalidMemoryAccess("tried to access unused or constant heap memory");
     }
     throw InvalidMemoryAccess("tried to access unexistent memory");
 }
 
+template <typename Policy>
+typename BasicVM<Policy>::HeapBlocks::iterator BasicVM<Policy>::findBlock(addr_t addr) {
+    auto block = _heapBlocks.upper_bound(addr);
+    if (block == _heapBlocks.begin()) {
+        return _heapBlocks.end();
+    }
+    --block;
+    return addr < block->first + std::max<addr_t>(block->second.size, 1) ? block : _heapBlocks.end();
+}
+
+template <typename Policy>
+void BasicVM<Policy>::freeRange(addr_t start, addr_t size) {
+    auto next = _freeRanges.lower_bound(start);
+    if (next != _freeRanges.end() && start + size == next->first) {
+        size += next->second;
+        next = _freeRanges.erase(next);
+    }
+    if (next != _freeRanges.begin()) {
+        if (auto prev = std::prev(next); prev->first + prev->second == start) {
+            prev->second += size;
+            return;
+        }
+    }
+    _freeRanges.emplace_hint(next, start, size);
+}
+
+// Mark-sweep without moving anything: every stack slot and every slot of a reachable block
+// that holds an address inside a block keeps that block alive, whether it is meant as an
+// address or not. Freed slots are zeroed, so new blocks still start out zeroed.
+template <typename Policy>
+void BasicVM<Policy>::collect() {
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<typename HeapBlocks::iterator> pending;
+    auto mark = [&](slot_t value) {
+        if (value < MIN_HEAP_ADDR || value >= MAX_HEAP_ADDR) {
+            return;
+        }
+        if (auto block = findBlock(static_cast<addr_t>(value)); block != _heapBlocks.end() && !block->second.marked) {
+            block->second.marked = true;
+            pending.push_back(block);
+        }
+    };
+    for (addr_t i = 0; i < _sp; ++i) {
+        mark(_stack[i]);
+    }
+    while (!pending.empty()) {
+        auto block = pending.back();
+        pending.pop_back();
+        auto slots = toHeapPtr(block->first);
+        for (addr_t i = 0; i < block->second.size; ++i) {
+            mark(slots[i]);
+        }
+    }
 
-void VM::DEC_SP(addr_t count) {
-    ensureStackUsed(count);
+    Collection collection{0, 0, 0, 0};
+    for (auto block = _heapBlocks.begin(); block != _heapBlocks.end(); ) {
+        if (block->second.marked || block->second.pinned) {
+            block->second.marked = false;
+            ++block;
+            continue;
+        }
+        auto size = std::max<addr_t>(block->second.size, 1);
+        std::fill_n(toHeapPtr(block->first), size, 0);
+        freeRange(block->first, size);
+        ++collection.reclaimedBlocks;
+        collection.reclaimedSlots += size;
+        block = _heapBlocks.erase(block);
+    }
+    _heapSlots -= collection.reclaimedSlots;
+    collection.liveSlots = _heapSlots;
+    // collect again when the live data has doubled
+    _nextCollection = _heapSlots + std::max(_heapSlots, MIN_GC_GROWTH);
+    collection.pauseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    _collections.push_back(collection);
+}
+
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::DEC_SP(addr_t count) {
+    ensureStackUsed<Checked>(count);
     _sp -= count;
 }
 
-void VM::INC_SP(addr_t count) {
-    ensureStackRest(count);
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::INC_SP(addr_t count) {
+    ensureStackRest<Checked>(count);
     _sp += count;
 }
 
-addr_t VM::NEW(addr_t count) {
-    addr_t st = MIN_HEAP_ADDR;
-    if (!_heapRecord.empty()) {
-        auto& last = _heapRecord.back();
-        st = last.first + last.second;
+// First fit in address order: without the collector there is only the range above the last block.
+template <typename Policy>
+addr_t BasicVM<Policy>::NEW(addr_t count) {
+    if (count < 0) {
+        throw InvalidMemoryAccess("tried to allocate a negative number of slots");
+    }
+    // an empty block still gets an address of its own
+    addr_t size = std::max<addr_t>(count, 1);
+    if (_gc && _heapSlots + size > _nextCollection) {
+        collect();
     }
-    if (st + count >= MAX_HEAP_ADDR) {
+    auto firstFit = [&]() {
+        return std::find_if(_freeRanges.begin(), _freeRanges.end(), [size](auto& range) { return range.second >= size; });
+    };
+    auto range = firstFit();
+    if (range == _freeRanges.end() && _gc) {
+        collect();
+        range = firstFit();
+    }
+    if (range == _freeRanges.end()) {
         throw HeapOverflow();
     }
-    _heapRecord.emplace_back(st, count);
-    return st;
+    addr_t start = range->first;
+    addr_t rest = range->second - size;
+    _freeRanges.erase(range);
+    if (rest > 0) {
+        _freeRanges.emplace(start + size, rest);
+    }
+    _heapBlocks.emplace(start, HeapBlock{count, false, false});
+    _heapSlots += size;
+    return start;
 }
 
-void VM::DUP() {
-    ensureStackUsed(1);
-    ensureStackRest(1);
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::DUP() {
+    ensureStackUsed<Checked>(1);
+    ensureStackRest<Checked>(1);
     _stack[_sp] = _stack[_sp-1];
     ++_sp;
 }
 
-void VM::DUP2() {
-    ensureStackUsed(2);
-    ensureStackRest(2);
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::DUP2() {
+    ensureStackUsed<Checked>(2);
+    ensureStackRest<Checked>(2);
     _stack[_sp] = _stack[_sp-2];
     _stack[_sp+1] = _stack[_sp-1];
     _sp += 2;
 }
 
-template<>
-char_t VM::POP<char_t>() {
-    ensureStackUsed(1);
-    return static_cast<char_t>(_stack[--_sp]);
-}
-
-template<>
-int_t VM::POP<int_t>() {
-    ensureStackUsed(1);
-    return static_cast<int_t>(_stack[--_sp]);
-}
+// a char still takes a whole slot
+template <typename T>
+constexpr addr_t slots_of = slots_count<T>;
 
-template<>
-double_t VM::POP<double_t>() {
-    ensureStackUsed(2);
-    _sp -= 2;
-    double_t* p = reinterpret_cast<double_t*>(toStackPtr(_sp));
-    return *p;
+// Doubles are copied in and out of the slots: with 32-bit slots they are only 4-byte aligned,
+// with C0_WIDE_SLOTS this is one aligned 8-byte access.
+static double_t loadDouble(const slot_t* slot) {
+    double_t value;
+    std::memcpy(&value, slot, sizeof(value));
+    return value;
 }
 
-template<>
-void VM::PUSH<char_t>(char_t value) {
-    ensureStackRest(1);
-    _stack[_sp++] = 0x000000ff & value;
+static void storeDouble(slot_t* slot, double_t value) {
+    std::memcpy(slot, &value, sizeof(value));
 }
 
-template<>
-void VM::PUSH<int_t>(int_t value) {
-    ensureStackRest(1);
-    _stack[_sp++] = value;
+template <typename Policy>
+template <bool Checked, typename T>
+T BasicVM<Policy>::POP() {
+    ensureStackUsed<Checked>(slots_of<T>);
+    _sp -= slots_of<T>;
+    if constexpr (std::is_same_v<T, double_t>) {
+        return loadDouble(toStackPtr(_sp));
+    }
+    else {
+        return static_cast<T>(_stack[_sp]);
+    }
 }
 
-template<>
-void VM::PUSH<double_t>(double_t val) {
-    ensureStackRest(2);
-    double_t* p = reinterpret_cast<double_t*>(_stack.get() + _sp);
-    *p = val;
-    _sp += 2;
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::PUSH(T value) {
+    ensureStackRest<Checked>(slots_of<T>);
+    if constexpr (std::is_same_v<T, double_t>) {
+        storeDouble(toStackPtr(_sp), value);
+    }
+    else if constexpr (std::is_same_v<T, char_t>) {
+        _stack[_sp] = 0x000000ff & value;
+    }
+    else {
+        _stack[_sp] = value;
+    }
+    _sp += slots_of<T>;
 }
 
-template<>
-int_t VM::READ<int_t>(addr_t addr) {
-    return *reinterpret_cast<int_t*>(checkAddr(addr, 1));
+template <typename Policy>
+template <typename T>
+T BasicVM<Policy>::READ(addr_t addr) {
+    if constexpr (std::is_same_v<T, double_t>) {
+        return loadDouble(checkAddr(addr, 2));
+    }
+    else if constexpr (std::is_same_v<T, char_t>) {
+        return 0xff & *checkAddr(addr, 1);
+    }
+    else {
+        return static_cast<T>(*checkAddr(addr, 1));
+    }
 }
 
-template<>
-char_t VM::READ<char_t>(addr_t addr) {
-    return 0xff & (*reinterpret_cast<int_t*>(checkAddr(addr, 1)));
+template <typename Policy>
+template <typename T>
+void BasicVM<Policy>::WRITE(addr_t addr, T value) {
+    if constexpr (std::is_same_v<T, double_t>) {
+        storeDouble(checkAddr(addr, 2), value);
+    }
+    else if constexpr (std::is_same_v<T, char_t>) {
+        *checkAddr(addr, 1) = 0x000000ff & value;
+    }
+    else {
+        *checkAddr(addr, 1) = value;
+    }
 }
 
-template<>
-double_t VM::READ<double_t>(addr_t addr) {
-    return *reinterpret_cast<double_t*>(checkAddr(addr, 2));
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::JUMP(u2 offset, bool dispatch) {
+    if constexpr (Checked) {
+        if (0 > offset || offset >= _currentInstructions->size()) {
+            throw InvalidControlTransfer();
+        }
+    }
+    if (!dispatch && static_cast<addr_t>(offset) <= _ip) {
+        countBackEdge();
+    }
+    this->_ip = offset - 1;
 }
 
-template<>
-void VM::WRITE<int_t>(addr_t addr, int_t value) {
-    *reinterpret_cast<int_t*>(checkAddr(addr, 1)) = value;
+template <typename Policy>
+template <bool Checked>
+const CompactInstruction& BasicVM<Policy>::SWITCH_ENTRY(addr_t index, OpCode op) {
+    if constexpr (Checked) {
+        if (0 > index || static_cast<std::size_t>(index) >= _currentInstructions->size()) {
+            throw InvalidControlTransfer();
+        }
+        auto& entry = _currentInstructions->at(index);
+        if (entry.op != op) {
+            throw InvalidInstruction();
+        }
+        return entry;
+    }
+    else {
+        return (*_currentInstructions)[index];
+    }
 }
 
-template<>
-void VM::WRITE<char_t>(addr_t addr, char_t value) {
-    *reinterpret_cast<int_t*>(checkAddr(addr, 1)) = 0x000000ff & value;
+template <typename Policy>
+const CodeInfo& BasicVM<Policy>::codeInfo(int functionIndex) const {
+    if (functionIndex == -1) {
+        return _verification.start;
+    }
+    return _verification.functions.at(functionIndex);
 }
 
-
-template<>
-void VM::WRITE<double_t>(addr_t addr, double_t value) {
-    *reinterpret_cast<double_t*>(checkAddr(addr, 2)) = value;
+template <typename Policy>
+bool BasicVM<Policy>::runsChecked(const CodeInfo& info) const {
+    return Policy::checkVerified || !info.verified;
 }
 
-void VM::JUMP(u2 offset) {
-    if (0 > offset || offset >= _currentInstructions.size()) {
-        throw InvalidControlTransfer();
+template <typename Policy>
+void BasicVM<Policy>::load(u2 functionIndex) {
+    _file.decode(functionIndex);
+    _code[functionIndex] = compactAll(_file.functions[functionIndex].instructions);
+    // the callers were verified with the return size in the function index
+    if (returnSlotsOf(_file.functions[functionIndex].instructions) != _verification.returnSlots[functionIndex]) {
+        throw InvalidFile("invalid binary file: the function index disagrees with the code");
+    }
+    auto& info = _verification.functions[functionIndex];
+    info = verifyFunction(_file, _verification, functionIndex);
+    if constexpr (!Policy::allowUnverified) {
+        if (!info.verified) {
+            throw InvalidFile("the unchecked VM only runs files the verifier accepts");
+        }
     }
-    this->_ip = offset - 1;
 }
 
-void VM::CALL(u2 index) {
-    if (0 > index || index >= this->_file.functions.size()) {
-        throw InvalidControlTransfer();
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::CALL(u2 index) {
+    if constexpr (Checked) {
+        if (0 > index || index >= this->_file.functions.size()) {
+            throw InvalidControlTransfer();
+        }
     }
-    Function& calledFunction = this->_file.functions.at(index);
+    if (_contexts.full()) {
+        throw StackOverflow();
+    }
+    if (!_file.decoded(index)) {
+        load(index);
+    }
+    Function& calledFunction = this->_file.functions[index];
     Context newContext;
     newContext.functionIndex = index;
-    newContext.functionName = std::get<str_t>(this->_file.constants.at(calledFunction.nameIndex).value);
 
     newContext.functionLevel = calledFunction.level;
     int newLv = newContext.functionLevel;
     int curLv = _contexts.back().functionLevel;
-    if (newLv == curLv + 1) {
-        newContext.staticLink = _contexts.size()-1;
-    }
-    else if (newLv <= curLv) {
-        int staticLink = _contexts.back().staticLink;
-        for (; curLv > newLv; --curLv) {
-            staticLink = _contexts.at(staticLink).staticLink;
-        }
-        newContext.staticLink = staticLink;
-    }
-    else {
+    // the static link is the frame of level newLv-1 in the display, which the callee inherits
+    if (newLv > curLv + 1) {
         throw InvalidControlTransfer();
     }
     newContext.prevBP = this->_bp;
     newContext.prevPC = this->_ip;
-    ensureStackUsed(calledFunction.paramSize);
+    ensureStackUsed<Checked>(calledFunction.paramSize);
     this->_bp = this->_sp - calledFunction.paramSize;
     newContext.prevSP = this->_bp;
     newContext.BP = this->_bp;
+    ++_profiles[index].calls;
+    newContext.fused = tierUp(index);
+    newContext.savedDisplay = _display[newLv];
+    _display[newLv] = _contexts.size();
     _contexts.push_back(newContext);
     this->_ip = -1;
-    this->_currentInstructions = calledFunction.instructions;
+    this->_currentInstructions = &_code[index];
+
+    // a verified function never grows the stack beyond maxStack, so one check covers the whole frame
+    auto& info = codeInfo(index);
+    _checked = runsChecked(info);
+    _fused = _contexts.back().fused;
+    if (info.verified && _bp + info.maxStack > MAX_STACK_ADDR) {
+        throw StackOverflow();
+    }
+    if (_jit && info.verified) {
+        _jit->enter(index);
+    }
 }
 
-void VM::RET() {
-    if (_contexts.size() <= 1) {
-        throw InvalidControlTransfer();
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::RET() {
+    if constexpr (Checked) {
+        if (_contexts.size() <= 1) {
+            throw InvalidControlTransfer();
+        }
     }
-    Context curContext = _contexts.back();
+    auto& curContext = _contexts.back();
+    _display[curContext.functionLevel] = curContext.savedDisplay;
     this->_sp = curContext.prevSP;
     this->_bp = curContext.prevBP;
     this->_ip = curContext.prevPC;
     _contexts.pop_back();
-    if (_contexts.size() != 1) {
-        this->_currentInstructions = _file.functions.at(_contexts.back().functionIndex).instructions;
+    auto& caller = _contexts.back();
+    if (caller.functionIndex != -1) {
+        this->_currentInstructions = &_code[caller.functionIndex];
     }
     else {
-        this->_currentInstructions = _file.start;
+        this->_currentInstructions = &_startCode;
     }
+    _checked = runsChecked(codeInfo(caller.functionIndex));
+    _fused = caller.fused;
 }
 
-void VM::ipush(int_t value) {
-    PUSH(value);
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::ipush(int_t value) {
+    PUSH<Checked>(value);
 }
 
-void VM::popn(addr_t count) {
-    DEC_SP(count);
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::popn(addr_t count) {
+    DEC_SP<Checked>(count);
 }
 
-void VM::dup() {
-    DUP();
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::dup() {
+    DUP<Checked>();
 }
 
-void VM::dup2() {
-    DUP2();
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::dup2() {
+    DUP2<Checked>();
 }
 
-void VM::loadc(u2 index) {
-    if (index < 0 || index >= _file.constants.size()) {
-        throw;
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::loadc(u2 index) {
+    if constexpr (Checked) {
+        if (index >= _constants.size()) {
+            throw InvalidInstruction();
+        }
     }
-    auto& constant = _file.constants.at(index);
-    switch (constant.type)
-    {
-    case Constant::Type::STRING: PUSH(_stringLiteralPool.at(index)); break;
-    case Constant::Type::INT:    PUSH(std::get<int_t>(constant.value));    break;
-    case Constant::Type::DOUBLE: PUSH(std::get<double_t>(constant.value)); break;
-    default: throw; break;
+    auto& constant = _constants[index];
+    ensureStackRest<Checked>(constant.size);
+    _stack[_sp] = constant.slots[0];
+    if (constant.size == 2) {
+        _stack[_sp+1] = constant.slots[1];
     }
+    _sp += constant.size;
 }
 
-void VM::loada(u2 level_diff, addr_t offset) {
-    int staticLink = _contexts.size()-1;
-    for (int ld = level_diff; ld > 0; --ld) {
-        staticLink = _contexts.at(staticLink).staticLink;
-    }
-    addr_t bp = _contexts.at(staticLink).BP;
-    PUSH<addr_t>(bp+offset);
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::loada(u2 level_diff, addr_t offset) {
+    PUSH<Checked, addr_t>(frameBase(level_diff)+offset);
 }
 
-void VM::_new() {
-    PUSH(NEW(POP<int_t>()));
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::_new() {
+    PUSH<Checked>(NEW(POP<Checked, int_t>()));
 }
 
-void VM::snew(addr_t count) {
-    INC_SP(count);
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::snew(addr_t count) {
+    INC_SP<Checked>(count);
 }
 
-template <typename T>
-void VM::Tload() {
-    PUSH(READ<T>(POP<addr_t>()));
+// The block instructions check the whole range once, then copy with the library routines.
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::_memcpy() {
+    auto count = POP<Checked, int_t>();
+    auto src = POP<Checked, addr_t>();
+    auto dst = POP<Checked, addr_t>();
+    if (Policy::checkMemory && count < 0) {
+        throw InvalidMemoryAccess("tried to copy a negative number of slots");
+    }
+    if (count <= 0) {
+        return;
+    }
+    auto from = checkAddr(src, count);
+    auto to = checkAddr(dst, count);
+    std::memmove(to, from, count * sizeof(slot_t));
+}
+
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::_memset() {
+    auto count = POP<Checked, int_t>();
+    auto value = POP<Checked, int_t>();
+    auto dst = POP<Checked, addr_t>();
+    if (Policy::checkMemory && count < 0) {
+        throw InvalidMemoryAccess("tried to set a negative number of slots");
+    }
+    if (count <= 0) {
+        return;
+    }
+    std::fill_n(checkAddr(dst, count), count, static_cast<slot_t>(value));
 }
 
-template <typename T>
-void VM::Taload() {
-    addr_t addr = slots_count<T> * POP<addr_t>();
-    addr += POP<addr_t>();
-    PUSH(READ<T>(addr));
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tload() {
+    PUSH<Checked>(READ<T>(POP<Checked, addr_t>()));
 }
 
-template <typename T>
-void VM::Tstore() {
-    auto value = POP<T>();
-    auto addr = POP<addr_t>();
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Taload() {
+    addr_t addr = slots_count<T> * POP<Checked, addr_t>();
+    addr += POP<Checked, addr_t>();
+    PUSH<Checked>(READ<T>(addr));
+}
+
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tstore() {
+    auto value = POP<Checked, T>();
+    auto addr = POP<Checked, addr_t>();
     WRITE(addr, value);
 }
 
-template <typename T>
-void VM::Tastore() {
-    auto value = POP<T>();
-    addr_t addr = slots_count<T> * POP<addr_t>();
-    addr += POP<addr_t>();
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tastore() {
+    auto value = POP<Checked, T>();
+    addr_t addr = slots_count<T> * POP<Checked, addr_t>();
+    addr += POP<Checked, addr_t>();
     WRITE(addr, value);
 }
 
-template <typename T>
-void VM::Tadd() {
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tadd() {
     static_assert(std::is_arithmetic_v<T>);
-    auto rhs = POP<T>();
-    auto lhs = POP<T>();
-    PUSH(lhs+rhs);
+    auto rhs = POP<Checked, T>();
+    auto lhs = POP<Checked, T>();
+    PUSH<Checked, T>(lhs+rhs);
 }
 
-template <typename T>
-void VM::Tsub() {
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tsub() {
     static_assert(std::is_arithmetic_v<T>);
-    auto rhs = POP<T>();
-    auto lhs = POP<T>();
-    PUSH(lhs-rhs);
+    auto rhs = POP<Checked, T>();
+    auto lhs = POP<Checked, T>();
+    PUSH<Checked, T>(lhs-rhs);
 }
 
-template <typename T>
-void VM::Tmul() {
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tmul() {
     static_assert(std::is_arithmetic_v<T>);
-    auto rhs = POP<T>();
-    auto lhs = POP<T>();
-    PUSH(lhs*rhs);
+    auto rhs = POP<Checked, T>();
+    auto lhs = POP<Checked, T>();
+    PUSH<Checked, T>(lhs*rhs);
 }
 
-template <typename T>
-void VM::Tdiv() {
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tdiv() {
     static_assert(std::is_arithmetic_v<T>);
-    auto rhs = POP<T>();
-    auto lhs = POP<T>();
-    if constexpr (std::is_integral_v<T>) {
+    auto rhs = POP<Checked, T>();
+    auto lhs = POP<Checked, T>();
+    if constexpr (std::is_integral_v<T> && Policy::checkDivision) {
         if (rhs == 0) {
             throw DivideByZero();
         }
     }
-    PUSH(lhs/rhs);
+    PUSH<Checked, T>(lhs/rhs);
 }
 
-template <typename T>
-void VM::Tneg() {
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tneg() {
     static_assert(std::is_arithmetic_v<T>);
-    PUSH(-POP<T>());
+    PUSH<Checked, T>(-POP<Checked, T>());
 }
 
-template <typename T>
-void VM::Tcmp() {
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tcmp() {
     static_assert(std::is_arithmetic_v<T>);
-    auto rhs = POP<T>();
-    auto lhs = POP<T>();
+    auto rhs = POP<Checked, T>();
+    auto lhs = POP<Checked, T>();
     if constexpr (std::is_floating_point_v<T>) {
         if (std::isnan(lhs) || std::isnan(rhs)) {
-            PUSH(0);
+            PUSH<Checked, int_t>(0);
             return;
         }
         else if (std::isinf(lhs) && std::isinf(rhs) && lhs * rhs > 0) {
-            PUSH(0);
+            PUSH<Checked, int_t>(0);
             return;
         }
     }
     if (lhs > rhs) {
-        PUSH(1);
+        PUSH<Checked, int_t>(1);
     }
     else if (lhs < rhs) {
-        PUSH(-1);
+        PUSH<Checked, int_t>(-1);
     }
     else {
-        PUSH(0);
+        PUSH<Checked, int_t>(0);
     }
 }
 
-template <typename T1, typename T2>
-void VM::T2T() {
+template <typename Policy>
+template <bool Checked, typename T1, typename T2>
+void BasicVM<Policy>::T2T() {
     // static_assert(std::is_arithmetic_v<T1> && std::is_arithmetic_v<T2>);
     static_assert(!std::is_same_v<T1, T2>);
-    PUSH(static_cast<T2>(POP<T1>()));
-}
-
-void VM::jmp(u2 offset) {
-    JUMP(offset);
+    PUSH<Checked>(static_cast<T2>(POP<Checked, T1>()));
 }
 
-void VM::je(u2 offset) {
-    auto cond = POP<int_t>();
-    if (cond == 0) {
-        JUMP(offset);
+// jCOND: compares the popped value against 0
+template <typename Policy>
+template <bool Checked, typename Compare>
+void BasicVM<Policy>::jcond(u2 offset) {
+    auto cond = POP<Checked, int_t>();
+    if (Compare()(cond, 0)) {
+        JUMP<Checked>(offset);
     }
 }
 
-void VM::jne(u2 offset) {
-    auto cond = POP<int_t>();
-    if (cond != 0) {
-        JUMP(offset);
+template <typename Policy>
+template <bool Checked, typename Compare>
+void BasicVM<Policy>::if_icmp(u2 offset) {
+    auto rhs = POP<Checked, int_t>();
+    auto lhs = POP<Checked, int_t>();
+    if (Compare()(lhs, rhs)) {
+        JUMP<Checked>(offset);
     }
 }
 
-void VM::jl(u2 offset) {
-    auto cond = POP<int_t>();
-    if (cond < 0) {
-        JUMP(offset);
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::tableswitch(int_t low, u2 count) {
+    auto value = POP<Checked, int_t>();
+    // the default entry is right after the tableswitch, the entry of `low` follows
+    addr_t entry = _ip + 1;
+    if (i8 key = static_cast<i8>(value) - low; 0 <= key && key < count) {
+        entry += 1 + static_cast<addr_t>(key);
     }
-}
-
-void VM::jge(u2 offset) {
-    auto cond = POP<int_t>();
-    if (cond >= 0) {
-        JUMP(offset);
+    JUMP<Checked>(SWITCH_ENTRY<Checked>(entry, OpCode::jmp).wide, true);
+}
+
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::lookupswitch(u2 count) {
+    auto value = POP<Checked, int_t>();
+    // binary search over the case entries, which are sorted by key
+    addr_t lo = _ip + 2, hi = _ip + 2 + count;
+    while (lo < hi) {
+        addr_t mid = lo + (hi - lo) / 2;
+        auto& entry = SWITCH_ENTRY<Checked>(mid, OpCode::_case);
+        auto key = static_cast<int_t>(entry.wide);
+        if (key == value) {
+            JUMP<Checked>(entry.narrow, true);
+            return;
+        }
+        if (key < value) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
     }
+    JUMP<Checked>(SWITCH_ENTRY<Checked>(_ip + 1, OpCode::jmp).wide, true);
 }
 
-void VM::jg(u2 offset) {
-    auto cond = POP<int_t>();
-    if (cond > 0) {
-        JUMP(offset);
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tret() {
+    if constexpr (std::is_void_v<T>) {
+        RET<Checked>();
     }
-}
-
-void VM::jle(u2 offset) {
-    auto cond = POP<int_t>();
-    if (cond <= 0) {
-        JUMP(offset);
+    else {
+        auto rtv = POP<Checked, T>();
+        RET<Checked>();
+        PUSH<Checked>(rtv);
     }
 }
 
-void VM::call(u2 index) {
-    CALL(index);
-}
-
-template <typename T>
-void VM::Tret() {
-    auto rtv = POP<T>();
-    RET();
-    PUSH(rtv);
-}
-
-template <>
-void VM::Tret<void>() {
-    RET();
-}
-
-template <typename T>
-void VM::Tprint() {
-    auto value = POP<T>();
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tprint() {
+    auto value = POP<Checked, T>();
     if constexpr (std::is_floating_point_v<T>) {
         std::cout << std::fixed << std::setprecision(6) << value;
     }
@@ -574,8 +1086,10 @@ void VM::Tprint() {
     }
 }
 
-void VM::sprint() {
-    auto str = POP<addr_t>();
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::sprint() {
+    auto str = POP<Checked, addr_t>();
     // std::cout << reinterpret_cast<const char*>(str);
     char_t ch;
     while ((ch = READ<char_t>(str++)) != '\0') {
@@ -583,94 +1097,195 @@ void VM::sprint() {
     }
 }
 
-void VM::printl() {
+template <typename Policy>
+void BasicVM<Policy>::printl() {
     std::cout << std::endl;
 }
 
-template <typename T>
-void VM::Tscan() {
-    if (T value; std::cin >> value) {
-        PUSH(value);
+template <typename Policy>
+template <bool Checked, typename T>
+void BasicVM<Policy>::Tscan() {
+    if (T value; _input.read(value)) {
+        PUSH<Checked>(value);
     }
     else {
         throw IOError();
     }
 }
 
-void VM::executeInstruction(const Instruction& ins) {
+template <typename Policy>
+template <bool Checked>
+void BasicVM<Policy>::executeInstruction(const CompactInstruction& ins) {
     //println(std::cout, "execute", ins);
     switch (ins.op)
     {
     case OpCode::nop: break;
     case OpCode::bipush:
-    case OpCode::ipush:   ipush(ins.x); break;
-    case OpCode::pop:     popn(1);      break;
-    case OpCode::pop2:    popn(2);      break;
-    case OpCode::popn:    popn(ins.x);  break;
-    case OpCode::dup:     dup();        break;
-    case OpCode::dup2:    dup2();       break;
-    case OpCode::loadc:   loadc(ins.x); break;
-    case OpCode::loada:   loada(ins.x, ins.y);break;
-    case OpCode::_new:    _new();       break;
-    case OpCode::snew:    snew(ins.x);  break;
+    case OpCode::ipush:   ipush<Checked>(ins.wide); break;
+    case OpCode::pop:     popn<Checked>(1);      break;
+    case OpCode::pop2:    popn<Checked>(2);      break;
+    case OpCode::popn:    popn<Checked>(ins.wide);  break;
+    case OpCode::dup:     dup<Checked>();        break;
+    case OpCode::dup2:    dup2<Checked>();       break;
+    case OpCode::loadc:   loadc<Checked>(ins.wide); break;
+    case OpCode::loada:   loada<Checked>(ins.narrow, ins.wide);break;
+    case OpCode::_new:    _new<Checked>();       break;
+    case OpCode::snew:    snew<Checked>(ins.wide);  break;
+    case OpCode::_memcpy: _memcpy<Checked>();    break;
+    case OpCode::_memset: _memset<Checked>();    break;
     
-    case OpCode::iload:   Tload<int_t>();      break;
-    case OpCode::dload:   Tload<double_t>();   break;
-    case OpCode::aload:   Tload<addr_t>();     break;
-    case OpCode::iaload:  Taload<int_t>();     break;
-    case OpCode::daload:  Taload<double_t>();  break;
-    case OpCode::aaload:  Taload<addr_t>();    break;
+    case OpCode::iload:   Tload<Checked, int_t>();      break;
+    case OpCode::dload:   Tload<Checked, double_t>();   break;
+    case OpCode::aload:   Tload<Checked, addr_t>();     break;
+    case OpCode::iaload:  Taload<Checked, int_t>();     break;
+    case OpCode::daload:  Taload<Checked, double_t>();  break;
+    case OpCode::aaload:  Taload<Checked, addr_t>();    break;
     
-    case OpCode::istore:  Tstore<int_t>();     break;
-    case OpCode::dstore:  Tstore<double_t>();  break;
-    case OpCode::astore:  Tstore<addr_t>();    break;
-    case OpCode::iastore: Tastore<int_t>();    break;
-    case OpCode::dastore: Tastore<double_t>(); break;
-    case OpCode::aastore: Tastore<addr_t>();   break;
+    case OpCode::istore:  Tstore<Checked, int_t>();     break;
+    case OpCode::dstore:  Tstore<Checked, double_t>();  break;
+    case OpCode::astore:  Tstore<Checked, addr_t>();    break;
+    case OpCode::iastore: Tastore<Checked, int_t>();    break;
+    case OpCode::dastore: Tastore<Checked, double_t>(); break;
+    case OpCode::aastore: Tastore<Checked, addr_t>();   break;
     
-    case OpCode::iadd:    Tadd<int_t>();       break;
-    case OpCode::dadd:    Tadd<double_t>();    break;
-    case OpCode::isub:    Tsub<int_t>();       break;
-    case OpCode::dsub:    Tsub<double_t>();    break;
-    case OpCode::imul:    Tmul<int_t>();       break;
-    case OpCode::dmul:    Tmul<double_t>();    break;
-    case OpCode::idiv:    Tdiv<int_t>();       break;
-    case OpCode::ddiv:    Tdiv<double_t>();    break;
-    case OpCode::ineg:    Tneg<int_t>();       break;
-    case OpCode::dneg:    Tneg<double_t>();    break;
-
-    case OpCode::icmp:    Tcmp<int_t>();       break;
-    case OpCode::dcmp:    Tcmp<double_t>();    break;
+    case OpCode::iadd:    Tadd<Checked, int_t>();       break;
+    case OpCode::dadd:    Tadd<Checked, double_t>();    break;
+    case OpCode::isub:    Tsub<Checked, int_t>();       break;
+    case OpCode::dsub:    Tsub<Checked, double_t>();    break;
+    case OpCode::imul:    Tmul<Checked, int_t>();       break;
+    case OpCode::dmul:    Tmul<Checked, double_t>();    break;
+    case OpCode::idiv:    Tdiv<Checked, int_t>();       break;
+    case OpCode::ddiv:    Tdiv<Checked, double_t>();    break;
+    case OpCode::ineg:    Tneg<Checked, int_t>();       break;
+    case OpCode::dneg:    Tneg<Checked, double_t>();    break;
+
+    case OpCode::icmp:    Tcmp<Checked, int_t>();       break;
+    case OpCode::dcmp:    Tcmp<Checked, double_t>();    break;
     
-    case OpCode::i2d:     T2T<int_t, double_t>(); break;
-    case OpCode::d2i:     T2T<double_t, int_t>(); break;
-    case OpCode::i2c:     T2T<int_t, char_t>();   break;
+    case OpCode::i2d:     T2T<Checked, int_t, double_t>(); break;
+    case OpCode::d2i:     T2T<Checked, double_t, int_t>(); break;
+    case OpCode::i2c:     T2T<Checked, int_t, char_t>();   break;
     
-    case OpCode::jmp:     jmp(ins.x);   break;
-    case OpCode::je:      je(ins.x);    break;
-    case OpCode::jne:     jne(ins.x);   break;
-    case OpCode::jl:      jl(ins.x);    break;
-    case OpCode::jge:     jge(ins.x);   break;
-    case OpCode::jg:      jg(ins.x);    break;
-    case OpCode::jle:     jle(ins.x);   break;
-
-    case OpCode::call:    call(ins.x);      break;
-    case OpCode::ret:     Tret<void>();     break;
-    case OpCode::iret:    Tret<int_t>();    break;
-    case OpCode::dret:    Tret<double_t>(); break;
-    case OpCode::aret:    Tret<addr_t>();   break;
-
-    case OpCode::iprint:  Tprint<int_t>();    break;
-    case OpCode::dprint:  Tprint<double_t>(); break;
-    case OpCode::cprint:  Tprint<char_t>();   break;
-    case OpCode::sprint:  sprint();           break;
-    case OpCode::printl:  printl();           break;
-    case OpCode::iscan:   Tscan<int_t>();     break;
-    case OpCode::dscan:   Tscan<double_t>();  break;
-    case OpCode::cscan:   Tscan<char_t>();    break;
+    case OpCode::jmp:     JUMP<Checked>(ins.wide); break;
+    case OpCode::je:      jcond<Checked, std::equal_to<int_t>>(ins.wide);      break;
+    case OpCode::jne:     jcond<Checked, std::not_equal_to<int_t>>(ins.wide);  break;
+    case OpCode::jl:      jcond<Checked, std::less<int_t>>(ins.wide);          break;
+    case OpCode::jge:     jcond<Checked, std::greater_equal<int_t>>(ins.wide); break;
+    case OpCode::jg:      jcond<Checked, std::greater<int_t>>(ins.wide);       break;
+    case OpCode::jle:     jcond<Checked, std::less_equal<int_t>>(ins.wide);    break;
+    case OpCode::if_icmpeq: if_icmp<Checked, std::equal_to<int_t>>(ins.wide);      break;
+    case OpCode::if_icmpne: if_icmp<Checked, std::not_equal_to<int_t>>(ins.wide);  break;
+    case OpCode::if_icmplt: if_icmp<Checked, std::less<int_t>>(ins.wide);          break;
+    case OpCode::if_icmpge: if_icmp<Checked, std::greater_equal<int_t>>(ins.wide); break;
+    case OpCode::if_icmpgt: if_icmp<Checked, std::greater<int_t>>(ins.wide);       break;
+    case OpCode::if_icmple: if_icmp<Checked, std::less_equal<int_t>>(ins.wide);    break;
+    case OpCode::tableswitch:  tableswitch<Checked>(ins.wide, ins.narrow); break;
+    case OpCode::lookupswitch: lookupswitch<Checked>(ins.wide);       break;
+    case OpCode::_case:   throw InvalidInstruction();
+
+    case OpCode::call:    CALL<Checked>(ins.wide);      break;
+    case OpCode::ret:     Tret<Checked, void>();     break;
+    case OpCode::iret:    Tret<Checked, int_t>();    break;
+    case OpCode::dret:    Tret<Checked, double_t>(); break;
+    case OpCode::aret:    Tret<Checked, addr_t>();   break;
+
+    case OpCode::iprint:  Tprint<Checked, int_t>();    break;
+    case OpCode::dprint:  Tprint<Checked, double_t>(); break;
+    case OpCode::cprint:  Tprint<Checked, char_t>();   break;
+    case OpCode::sprint:  sprint<Checked>();           break;
+    case OpCode::printl:  printl();                    break;
+    case OpCode::iscan:   Tscan<Checked, int_t>();     break;
+    case OpCode::dscan:   Tscan<Checked, double_t>();  break;
+    case OpCode::cscan:   Tscan<Checked, char_t>();    break;
     default:
         break;
     }
 }
 
-}
\ No newline at end of file
+// Runs the current frame from its fused code until control leaves it through a call or return.
+// The fused code only exists for verified functions, so the stack checks are left out.
+template <typename Policy>
+void BasicVM<Policy>::executeFused() {
+    const FusedCode& fused = *_fused;
+    const FusedInstruction* code = fused.code.data();
+    addr_t pc = fused.entry[_ip];
+    // wraps around like the interpreter does in practice
+    const auto wrap = [](u4 value) { return static_cast<int_t>(value); };
+    while (true) {
+        auto& ins = code[pc++];
+        _ip = ins.ip;
+        ++_counterInstruction;
+        switch (ins.op)
+        {
+        case FusedOp::plain:
+            executeInstruction<false>((*_currentInstructions)[_ip]);
+            ++_ip;
+            if (_fused != &fused || static_cast<std::size_t>(_ip) >= _currentInstructions->size()) {
+                return;
+            }
+            // a recursive call or return lands in the same code, and a taken switch anywhere in it
+            pc = fused.entry[_ip];
+            break;
+        case FusedOp::end:
+            return;
+
+        case FusedOp::ipush:      PUSH<false>(ins.value); break;
+        case FusedOp::loada:      PUSH<false, addr_t>(frameBase(ins.level) + ins.offset); break;
+        case FusedOp::load_local: PUSH<false>(READ<int_t>(_bp + ins.offset)); break;
+        case FusedOp::load:       PUSH<false>(READ<int_t>(frameBase(ins.level) + ins.offset)); break;
+        case FusedOp::inc_local: {
+            auto slot = checkAddr(_bp + ins.offset, 1);
+            *slot = wrap(static_cast<u4>(*slot) + static_cast<u4>(ins.value));
+        } break;
+        case FusedOp::inc: {
+            auto slot = checkAddr(frameBase(ins.level) + ins.offset, 1);
+            *slot = wrap(static_cast<u4>(*slot) + static_cast<u4>(ins.value));
+        } break;
+        case FusedOp::iload:      Tload<false, int_t>();  break;
+        case FusedOp::istore:     Tstore<false, int_t>(); break;
+        case FusedOp::iadd:       Tadd<false, int_t>();   break;
+        case FusedOp::isub:       Tsub<false, int_t>();   break;
+        case FusedOp::imul:       Tmul<false, int_t>();   break;
+        case FusedOp::idiv:       Tdiv<false, int_t>();   break;
+        case FusedOp::ineg:       Tneg<false, int_t>();   break;
+        case FusedOp::icmp:       Tcmp<false, int_t>();   break;
+        case FusedOp::add_imm:
+            PUSH<false>(wrap(static_cast<u4>(POP<false, int_t>()) + static_cast<u4>(ins.value)));
+            break;
+        case FusedOp::mul_imm:
+            PUSH<false>(wrap(static_cast<u4>(POP<false, int_t>()) * static_cast<u4>(ins.value)));
+            break;
+
+        case FusedOp::jmp: pc = ins.target; break;
+        case FusedOp::je:  if (POP<false, int_t>() == 0) pc = ins.target; break;
+        case FusedOp::jne: if (POP<false, int_t>() != 0) pc = ins.target; break;
+        case FusedOp::jl:  if (POP<false, int_t>() < 0)  pc = ins.target; break;
+        case FusedOp::jge: if (POP<false, int_t>() >= 0) pc = ins.target; break;
+        case FusedOp::jg:  if (POP<false, int_t>() > 0)  pc = ins.target; break;
+        case FusedOp::jle: if (POP<false, int_t>() <= 0) pc = ins.target; break;
+        case FusedOp::if_icmpeq: { auto rhs = POP<false, int_t>(); if (POP<false, int_t>() == rhs) pc = ins.target; } break;
+        case FusedOp::if_icmpne: { auto rhs = POP<false, int_t>(); if (POP<false, int_t>() != rhs) pc = ins.target; } break;
+        case FusedOp::if_icmplt: { auto rhs = POP<false, int_t>(); if (POP<false, int_t>() < rhs)  pc = ins.target; } break;
+        case FusedOp::if_icmpge: { auto rhs = POP<false, int_t>(); if (POP<false, int_t>() >= rhs) pc = ins.target; } break;
+        case FusedOp::if_icmpgt: { auto rhs = POP<false, int_t>(); if (POP<false, int_t>() > rhs)  pc = ins.target; } break;
+        case FusedOp::if_icmple: { auto rhs = POP<false, int_t>(); if (POP<false, int_t>() <= rhs) pc = ins.target; } break;
+        case FusedOp::if_immeq: if (POP<false, int_t>() == ins.value) pc = ins.target; break;
+        case FusedOp::if_immne: if (POP<false, int_t>() != ins.value) pc = ins.target; break;
+        case FusedOp::if_immlt: if (POP<false, int_t>() < ins.value)  pc = ins.target; break;
+        case FusedOp::if_immge: if (POP<false, int_t>() >= ins.value) pc = ins.target; break;
+        case FusedOp::if_immgt: if (POP<false, int_t>() > ins.value)  pc = ins.target; break;
+        case FusedOp::if_immle: if (POP<false, int_t>() <= ins.value) pc = ins.target; break;
+        }
+    }
+}
+
+template class BasicVM<CheckedPolicy>;
+template class BasicVM<UncheckedPolicy>;
+
+// the JIT runs single instructions and calls through these
+template void VM::executeInstruction<false>(const CompactInstruction&);
+template void VM::CALL<false>(u2);
+template void UncheckedVM::executeInstruction<false>(const CompactInstruction&);
+template void UncheckedVM::CALL<false>(u2);
+
+}
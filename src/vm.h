@@ -6,16 +6,33 @@
 #include "./constant.h"
 #include "./function.h"
 #include "./file.h"
+#include "./verifier.h"
+#include "./jit.h"
+#include "./tier.h"
+#include "./input.h"
+#include "./policy.h"
 
 #include <memory>
 #include <cstdint>
+#include <istream>
+#include <map>
 #include <string>
 #include <vector>
+#include <type_traits>
 #include <variant>
 
 namespace vm {
 
-class VM {
+// A constant as the slots loadc pushes: doubles are pre-split, strings are their heap address.
+struct ResolvedConstant {
+    slot_t slots[2];
+    addr_t size;
+};
+
+// `Policy` (see policy.h) decides which runtime checks are compiled in.
+template <typename Policy>
+class BasicVM {
+    friend class Jit<Policy>;
 private:
     static const addr_t MIN_STACK_ADDR;
     static const addr_t MAX_STACK_ADDR;
@@ -23,127 +40,283 @@ private:
     static const addr_t MIN_HEAP_ADDR;
     static const addr_t MAX_HEAP_ADDR;
     static const addr_t MAX_HEAP_SIZE;
+    // calls plus loop iterations after which a function runs in the fused tier
+    static const u4 DEFAULT_TIER_UP_THRESHOLD;
+    // frames allowed when recursion leaves the call depth unbounded
+    static const std::size_t MAX_CALL_DEPTH;
+    // the heap grows by at least this many slots between two collections
+    static const addr_t MIN_GC_GROWTH;
 
 private:
     bool prepared;
     File _file;
+    VerifyResult _verification;
+    // whether the current frame runs with the per-instruction checks
+    bool _checked;
     //std::vector<std::shared_ptr<Stack>> stacks;
     std::unique_ptr<slot_t[]> _stack;
     std::unique_ptr<slot_t[]> _heap;
-    std::vector<std::pair<addr_t, addr_t>> _heapRecord;
+
+    struct HeapBlock {
+        addr_t size;
+        // string literals are never collected
+        bool pinned;
+        bool marked;
+    };
+    using HeapBlocks = std::map<addr_t, HeapBlock>;
+    // allocated blocks by address, an empty block still takes one slot
+    HeapBlocks _heapBlocks;
+    // the unallocated address ranges (start -> size), adjacent ranges are merged
+    std::map<addr_t, addr_t> _freeRanges;
+    // slots taken by the allocated blocks
+    addr_t _heapSlots;
+    bool _gc;
+    // _heapSlots at which the next allocation collects first
+    addr_t _nextCollection;
+    struct Collection {
+        double pauseMs;
+        addr_t reclaimedBlocks;
+        addr_t reclaimedSlots;
+        addr_t liveSlots;
+    };
+    std::vector<Collection> _collections;
     addr_t _sp;
     addr_t _bp;
     addr_t _ip;
-    int _counterInstruction;
+    u8 _counterInstruction;
     // int _counterMicroIns;
     
+    // trivially copyable, the function name is only looked up for stack traces
     struct Context {
         addr_t prevPC;
         addr_t prevSP;
         addr_t prevBP;
         addr_t BP;
-        int staticLink; // index in contexts
+        // the _display entry of functionLevel this frame replaced
+        int savedDisplay;
         int functionIndex;
-        std::string functionName;
         vm::u2 functionLevel;
+        // the fused code this frame runs in, null for the interpreter
+        const FusedCode* fused;
+    };
+    static_assert(std::is_trivially_copyable_v<Context>);
+
+    // Frames live in one allocation made when the VM starts, so CALL never allocates.
+    class FrameStack {
+    public:
+        void reset(std::size_t capacity) {
+            if (capacity != _capacity) {
+                // left uninitialized, untouched pages cost nothing
+                _frames.reset(new Context[capacity]);
+                _capacity = capacity;
+            }
+            _size = 0;
+        }
+        bool full() const { return _size == _capacity; }
+        std::size_t size() const { return _size; }
+        void push_back(const Context& context) { _frames[_size++] = context; }
+        void pop_back() { --_size; }
+        Context& back() { return _frames[_size - 1]; }
+        const Context& back() const { return _frames[_size - 1]; }
+        Context& operator[](std::size_t index) { return _frames[index]; }
+        const Context& operator[](std::size_t index) const { return _frames[index]; }
+
+    private:
+        std::unique_ptr<Context[]> _frames;
+        std::size_t _capacity = 0;
+        std::size_t _size = 0;
+    };
+    FrameStack _contexts;
+    // the innermost frame (index in contexts) of each lexical level along the current static chain
+    std::vector<int> _display;
+    // .start and the decoded functions in the layout the interpreter runs, see buildCode()
+    std::vector<CompactInstruction> _startCode;
+    std::vector<std::vector<CompactInstruction>> _code;
+    // the instructions of the current frame, one of the above
+    const std::vector<CompactInstruction>* _currentInstructions;
+    std::vector<ResolvedConstant> _constants;
+    std::unique_ptr<Jit<Policy>> _jit;
+
+    struct Profile {
+        u4 calls = 0;
+        u4 backEdges = 0;
+        std::unique_ptr<FusedCode> fused;
+    };
+    struct TierUp {
+        u2 functionIndex;
+        u8 instructions;
+        u4 calls;
+        u4 backEdges;
     };
-    std::vector<Context> _contexts;
-    std::vector<Instruction> _currentInstructions;
-    std::unordered_map<vm::u2, addr_t> _stringLiteralPool;
+    std::vector<Profile> _profiles;
+    std::vector<TierUp> _tierUps;
+    u4 _tierUpThreshold;
+    const FusedCode* _fused;
+    // what the scan instructions read, std::cin unless setInput is called
+    InputReader _input;
     
 public:
-    VM(File) noexcept;
-    VM(const VM&) = delete;
-    VM(VM&&) = delete;
-    VM& operator=(VM) = delete;
+    BasicVM(File) noexcept;
+    ~BasicVM();
+    BasicVM(const BasicVM&) = delete;
+    BasicVM(BasicVM&&) = delete;
+    BasicVM& operator=(BasicVM) = delete;
 
 public:
-    static std::unique_ptr<VM> make_vm(File file);
+    // throws InvalidFile if the policy needs a verified file and `file` is not
+    static std::unique_ptr<BasicVM> make_vm(File file);
+    // compiles verified functions to native code when they are called, false if the platform has no JIT
+    bool enableJit();
+    // 0 promotes every verified function on its first call
+    void setTierUpThreshold(u4 threshold);
+    // reads the scan instructions from `in` from now on, which has to outlive the VM
+    void setInput(std::istream& in);
+    // frees heap blocks the program cannot reach any more, see collect()
+    void enableGC();
     void start();
+    // executed instructions, call and loop counters and the tier-up events
+    void printStats(std::ostream& out) const;
 
 private: 
     void init() noexcept;
-    void buildStringLiteralPool();
+    void buildConstantPool();
+    void buildCode();
     void run();
+    template <bool Checked>
+    void execute();
+    void runNested(std::size_t frames);
+    void executeFused();
+    const FusedCode* tierUp(u2 functionIndex);
+    void countBackEdge();
+    const std::string& functionName(u2 functionIndex) const;
+    addr_t frameBase(u2 levelDiff) const;
+    const CodeInfo& codeInfo(int functionIndex) const;
+    // whether a frame running `info` takes the per-instruction stack and jump checks
+    bool runsChecked(const CodeInfo& info) const;
+    // decodes and verifies a function of a version 2 file on its first call
+    void load(u2 functionIndex);
+    template <bool Checked>
     void ensureStackRest(addr_t count);
+    template <bool Checked>
     void ensureStackUsed(addr_t count);
     slot_t* checkAddr(addr_t addr, addr_t count);
+    // the block whose slots contain `addr`, end() if there is none
+    typename HeapBlocks::iterator findBlock(addr_t addr);
+    void freeRange(addr_t start, addr_t size);
+    void collect();
     slot_t* toHeapPtr(addr_t);
     slot_t* toStackPtr(addr_t);
     void printStackTrace(std::ostream&);
 
+    template <bool Checked>
     void    DEC_SP(addr_t count);
+    template <bool Checked>
     void    INC_SP(addr_t count);
     addr_t  NEW(addr_t count);
+    template <bool Checked>
     void    DUP();
+    template <bool Checked>
     void    DUP2();
-    template<typename T>
+    template <bool Checked, typename T>
     T       POP();
-    template<typename T>
+    template <bool Checked, typename T>
     void    PUSH(T val);
-    template<typename T>
+    template <typename T>
     T       READ(addr_t addr);
-    template<typename T>
+    template <typename T>
     void    WRITE(addr_t addr, T value);
 
-    void    JUMP(u2 offset);
+    // a backward jump counts as a loop iteration unless it is the `dispatch` of a switch,
+    // whose table sits after the case bodies
+    template <bool Checked>
+    void    JUMP(u2 offset, bool dispatch = false);
+    template <bool Checked>
+    const CompactInstruction& SWITCH_ENTRY(addr_t index, OpCode op);
+    template <bool Checked>
     void    CALL(u2 index);
+    template <bool Checked>
     void    RET();
 
 private:
-    void executeInstruction(const Instruction&);
+    // Checked = false is only used for code the verifier accepted, under UncheckedPolicy,
+    // where the verifier makes the stack bounds and jump target checks redundant
+    template <bool Checked>
+    void executeInstruction(const CompactInstruction&);
 
+    template <bool Checked>
     void ipush(int_t value);
+    template <bool Checked>
     void popn(addr_t count);
-    void dup(); void dup2();
+    template <bool Checked>
+    void dup();
+    template <bool Checked>
+    void dup2();
+    template <bool Checked>
     void loadc(u2 index);
+    template <bool Checked>
     void loada(u2 level_diff, addr_t offset);
     
+    template <bool Checked>
     void _new();
+    template <bool Checked>
     void snew(addr_t count);
+    template <bool Checked>
+    void _memcpy();
+    template <bool Checked>
+    void _memset();
     
-    template<typename T>
+    template <bool Checked, typename T>
     void Tload();
-    template<typename T>
+    template <bool Checked, typename T>
     void Taload();
-    template<typename T>
+    template <bool Checked, typename T>
     void Tstore();
-    template<typename T>
+    template <bool Checked, typename T>
     void Tastore();
 
-    template <typename T>
+    template <bool Checked, typename T>
     void Tadd();
-    template <typename T>
+    template <bool Checked, typename T>
     void Tsub();
-    template <typename T>
+    template <bool Checked, typename T>
     void Tmul();
-    template <typename T>
+    template <bool Checked, typename T>
     void Tdiv();
-    template <typename T>
+    template <bool Checked, typename T>
     void Tneg();
-    template <typename T>
+    template <bool Checked, typename T>
     void Tcmp();
 
-    template <typename T1, typename T2>
+    template <bool Checked, typename T1, typename T2>
     void T2T();
 
-    void jmp(u2 offset);
-    void je(u2 offset); void jne(u2 offset); 
-    void jl(u2 offset); void jge(u2 offset); 
-    void jg(u2 offset); void jle(u2 offset);
+    template <bool Checked, typename Compare>
+    void jcond(u2 offset);
+    template <bool Checked, typename Compare>
+    void if_icmp(u2 offset);
+    template <bool Checked>
+    void tableswitch(int_t low, u2 count);
+    template <bool Checked>
+    void lookupswitch(u2 count);
 
-    void call(u2 index);
-    template <typename T>
+    template <bool Checked, typename T>
     void Tret();
     
-    template <typename T> 
+    template <bool Checked, typename T> 
     void Tprint();
+    template <bool Checked>
     void sprint(); 
     void printl();
-    template <typename T>
+    template <bool Checked, typename T>
     void Tscan();
 };
 
+extern template class BasicVM<CheckedPolicy>;
+extern template class BasicVM<UncheckedPolicy>;
+
+using VM = BasicVM<CheckedPolicy>;
+using UncheckedVM = BasicVM<UncheckedPolicy>;
+
 }
 
 
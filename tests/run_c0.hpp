@@ -0,0 +1,70 @@
+#pragma once
+
+#include "tokenizer/tokenizer.h"
+#include "analyser/analyser.h"
+#include "src/file.h"
+#include "src/vm.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace test {
+	// Compiles a c0 program the same way as `cc0 -c`: source -> .s0 text -> File.
+	// `lines` records the line table like `cc0 -c -g`, `object` compiles one of several
+	// sources for File::link, which need not define main.
+	inline File compile(const std::string& source, bool lines = false, bool object = false) {
+		std::stringstream in(source);
+		miniplc0::Tokenizer tkz(in);
+		auto tks = tkz.AllTokens();
+		if (tks.second.has_value()) {
+			throw std::runtime_error("tokenization error");
+		}
+		miniplc0::Analyser analyser(tks.first);
+		if (analyser.Analyse().second.has_value()) {
+			throw std::runtime_error("syntactic analysis error");
+		}
+		std::stringstream text;
+		analyser.OutputText(text, lines);
+		return File::parse_file_text(text, object);
+	}
+
+	// Parses a hand-written .s0 program.
+	inline File assemble(const std::string& text) {
+		std::stringstream in(text);
+		return File::parse_file_text(in);
+	}
+
+	// Runs the program on `input` and returns everything it printed, runtime errors included.
+	// `setup` gets the VM (a vm::VM unless given) before it starts.
+	template <typename VM = vm::VM, typename Setup>
+	inline std::string run_with(File file, const std::string& input, Setup setup) {
+		std::stringstream in(input), out, err;
+		auto cin = std::cin.rdbuf(in.rdbuf());
+		auto cout = std::cout.rdbuf(out.rdbuf());
+		auto cerr = std::cerr.rdbuf(err.rdbuf());
+		try {
+			auto avm = VM::make_vm(std::move(file));
+			setup(*avm);
+			avm->start();
+		}
+		catch (...) {
+			std::cin.rdbuf(cin);
+			std::cout.rdbuf(cout);
+			std::cerr.rdbuf(cerr);
+			throw;
+		}
+		std::cin.rdbuf(cin);
+		std::cout.rdbuf(cout);
+		std::cerr.rdbuf(cerr);
+		return out.str() + err.str();
+	}
+
+	inline std::string run(File file, const std::string& input = "", bool jit = false) {
+		return run_with(std::move(file), input, [jit](vm::VM& avm) {
+			if (jit) {
+				avm.enableJit();
+			}
+		});
+	}
+}
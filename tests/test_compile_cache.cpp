@@ -0,0 +1,78 @@
+#include "catch2/catch.hpp"
+
+#include "src/compile_cache.h"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace {
+	std::filesystem::path freshDirectory() {
+		auto dir = std::filesystem::temp_directory_path() / "cc0_compile_cache_test";
+		std::filesystem::remove_all(dir);
+		return dir;
+	}
+
+	void writeFile(const std::filesystem::path& path, const std::string& content) {
+		std::ofstream out(path, std::ios::out | std::ios::trunc | std::ios::binary);
+		out << content;
+	}
+
+	std::string readFile(const std::filesystem::path& path) {
+		std::ifstream in(path, std::ios::in | std::ios::binary);
+		std::stringstream ss;
+		ss << in.rdbuf();
+		return ss.str();
+	}
+}
+
+TEST_CASE("the compile cache returns what was stored under the same key") {
+	auto dir = freshDirectory();
+	auto compiled = dir.parent_path() / "cc0_compile_cache_test.o0";
+	auto output = dir.parent_path() / "cc0_compile_cache_test.out";
+	CompileCache cache(dir);
+
+	auto key = CompileCache::key("void main() {}", "format=1 lines=false");
+	REQUIRE(key == CompileCache::key("void main() {}", "format=1 lines=false"));
+	// every part of the key counts
+	REQUIRE(key != CompileCache::key("void main() { }", "format=1 lines=false"));
+	REQUIRE(key != CompileCache::key("void main() {}", "format=2 lines=false"));
+	REQUIRE(CompileCache::key("ab", "c") != CompileCache::key("a", "bc"));
+
+	REQUIRE_FALSE(cache.fetch(key, output));
+	writeFile(compiled, "first");
+	cache.store(key, compiled);
+	writeFile(compiled, "changed afterwards");
+	REQUIRE(cache.fetch(key, output));
+	REQUIRE(readFile(output) == "first");
+
+	auto stats = CompileCache(dir).stats();
+	REQUIRE(stats.hits == 1);
+	REQUIRE(stats.misses == 1);
+	REQUIRE(stats.entries == 1);
+	REQUIRE(stats.bytes == 5);
+}
+
+TEST_CASE("the compile cache evicts the least recently used entries beyond its size") {
+	auto dir = freshDirectory();
+	auto compiled = dir.parent_path() / "cc0_compile_cache_test.o0";
+	auto output = dir.parent_path() / "cc0_compile_cache_test.out";
+	CompileCache cache(dir, 25);
+	writeFile(compiled, std::string(10, 'x'));
+
+	auto old = std::filesystem::file_time_type::clock::now() - std::chrono::hours(1);
+	cache.store(1, compiled);
+	cache.store(2, compiled);
+	for (auto& entry : std::filesystem::directory_iterator(dir)) {
+		std::filesystem::last_write_time(entry.path(), old);
+	}
+	// a hit makes 1 the most recently used, so 2 goes when 3 does not fit
+	REQUIRE(cache.fetch(1, output));
+	cache.store(3, compiled);
+	REQUIRE(cache.stats().entries == 2);
+	REQUIRE(cache.stats().bytes == 20);
+	REQUIRE(cache.fetch(1, output));
+	REQUIRE_FALSE(cache.fetch(2, output));
+	REQUIRE(cache.fetch(3, output));
+}
@@ -0,0 +1,121 @@
+#include "catch2/catch.hpp"
+
+#include "run_c0.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace {
+	bool hasCompiler() {
+		static const bool found = std::system("cc --version > /dev/null 2>&1") == 0;
+		return found;
+	}
+
+	// translates `file` into C, builds it with the system compiler and returns what it printed on `input`
+	std::string runEmitted(File file, const std::string& input) {
+		auto dir = std::filesystem::temp_directory_path();
+		auto source = (dir / "cc0_emit_c_test.c").string();
+		auto exe = (dir / "cc0_emit_c_test").string();
+		auto in = (dir / "cc0_emit_c_test.in").string();
+		auto out = (dir / "cc0_emit_c_test.out").string();
+		{
+			std::ofstream c(source), i(in);
+			file.output_c(c);
+			i << input;
+		}
+		REQUIRE(std::system(("cc -O1 -o " + exe + " " + source).c_str()) == 0);
+		std::system((exe + " < " + in + " > " + out + " 2>&1").c_str());
+		std::ifstream result(out);
+		std::stringstream ss;
+		ss << result.rdbuf();
+		return ss.str();
+	}
+
+	void sameAsVM(const std::string& source, const std::string& input = "") {
+		if (!hasCompiler()) {
+			WARN("no C compiler found, skipped");
+			return;
+		}
+		auto file = test::compile(source);
+		auto expected = test::run(file, input);
+		INFO(expected);
+		REQUIRE(runEmitted(file, input) == expected);
+	}
+}
+
+TEST_CASE("emit-c: arithmetic, globals and switches") {
+	sameAsVM(
+		"const int k = 7;\n"
+		"int g = 5, h;\n"
+		"int classify(int x) {\n"
+		"switch (x) { case 0: return 10; case 1: case 2: return 12; case 4: return 14; default: return -1; }\n"
+		"}\n"
+		"int sparse(int x) {\n"
+		"switch (x) { case -100000: return 1; case 3: return 2; case 99999: return 3; }\n"
+		"return 0;\n"
+		"}\n"
+		"void main() {\n"
+		"int i = 0 - 20, s = 0;\n"
+		"while (i < 20) { s = s + i * k - classify(i) + sparse(i * 33333); h = s / 3 + g; i = i + 1; }\n"
+		"print(s, g, h, 'c', \"str\");\n"
+		"print(sparse(0-100000), sparse(99999));\n"
+		"}");
+}
+
+TEST_CASE("emit-c: recursion and I/O") {
+	sameAsVM(
+		"int fib(int n) {\n"
+		"if (n <= 1) return n;\n"
+		"return fib(n - 1) + fib(n - 2);\n"
+		"}\n"
+		"int depth(int n) { if (n == 0) return 0; return depth(n - 1) + 1; }\n"
+		"void main() {\n"
+		"int n;\n"
+		"char c;\n"
+		"scan(n);\n"
+		"scan(c);\n"
+		"print(fib(n), c, depth(20000));\n"
+		"}",
+		"15 120");
+}
+
+TEST_CASE("emit-c: runtime errors") {
+	if (!hasCompiler()) {
+		WARN("no C compiler found, skipped");
+		return;
+	}
+	auto file = test::compile(
+		"int f(int x) { return 10 / x; }\n"
+		"void main() { print(f(2)); print(f(0)); }");
+	auto output = runEmitted(file, "");
+	REQUIRE(output.find("5\n") == 0);
+	REQUIRE(output.find("runtime error: divide integer by zero !") != std::string::npos);
+}
+
+TEST_CASE("emit-c: empty heap blocks get addresses of their own") {
+	if (!hasCompiler()) {
+		WARN("no C compiler found, skipped");
+		return;
+	}
+	auto file = test::assemble(
+		".constants:\n"
+		"0 S \"main\"\n"
+		".start:\n"
+		".functions:\n"
+		"0 0 0 1\n"
+		".F0:\n"
+		"0 ipush 0\n"
+		"1 new\n"
+		"2 ipush 0\n"
+		"3 new\n"
+		"4 isub\n"
+		"5 iprint\n"
+		"6 printl\n"
+		"7 ret\n");
+	auto expected = test::run(file);
+	REQUIRE(expected == "-1\n");
+	REQUIRE(runEmitted(file, "") == expected);
+}
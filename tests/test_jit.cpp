@@ -0,0 +1,89 @@
+#include "catch2/catch.hpp"
+
+#include "src/jit.h"
+#include "run_c0.hpp"
+
+#include <string>
+
+namespace {
+	// runs `source` in the interpreter and with the JIT, which must behave the same
+	void differential(const std::string& source, const std::string& input = "") {
+		auto file = test::compile(source);
+		auto expected = test::run(file, input);
+		INFO(expected);
+		REQUIRE(test::run(file, input, true) == expected);
+	}
+}
+
+TEST_CASE("jit: arithmetic, locals and globals") {
+	differential(
+		"const int k = 7;\n"
+		"int g = 5, h;\n"
+		"int mix(int a, int b) {\n"
+		"int t = a * b - k;\n"
+		"h = t / 3 + g;\n"
+		"g = g + 1;\n"
+		"return -t + h * 2 - (a - b) / -2;\n"
+		"}\n"
+		"void main() {\n"
+		"int i = 0 - 20, s = 0;\n"
+		"char c = 'a';\n"
+		"while (i < 20) { s = s + mix(i, i + 3); i = i + 1; }\n"
+		"print(s, g, h, c, 'b', \"str\");\n"
+		"}");
+}
+
+TEST_CASE("jit: conditions, loops and switches") {
+	differential(
+		"int classify(int x) {\n"
+		"switch (x) { case 0: return 10; case 1: case 2: return 12; case 4: return 14; default: return -1; }\n"
+		"}\n"
+		"int sparse(int x) {\n"
+		"switch (x) { case -100000: return 1; case 3: return 2; case 99999: return 3; }\n"
+		"return 0;\n"
+		"}\n"
+		"void main() {\n"
+		"int i = 0 - 3, n = 0;\n"
+		"while (i <= 6) {\n"
+		"if (i == 3) { i = i + 1; }\n"
+		"else if (i > 0) n = n + classify(i);\n"
+		"else n = n - classify(i);\n"
+		"if (i != 2) n = n + 1; else n = n * 2;\n"
+		"if (i >= 5) break;\n"
+		"i = i + 1;\n"
+		"}\n"
+		"print(n, sparse(0-100000), sparse(3), sparse(99999), sparse(4));\n"
+		"}");
+}
+
+TEST_CASE("jit: recursion and I/O") {
+	differential(
+		"int fib(int n) { if (n < 2) return n; return fib(n-1) + fib(n-2); }\n"
+		"int ack(int m, int n) {\n"
+		"if (m == 0) return n + 1;\n"
+		"if (n == 0) return ack(m - 1, 1);\n"
+		"return ack(m - 1, ack(m, n - 1));\n"
+		"}\n"
+		"void main() {\n"
+		"int n; char c;\n"
+		"scan(n); scan(c);\n"
+		"print(fib(n), ack(2, 3), c);\n"
+		"}",
+		"20 z");
+}
+
+TEST_CASE("jit: runtime errors report the same stack trace") {
+	differential(
+		"int f(int a, int b) { return a / b; }\n"
+		"int g(int x) { return f(x, x - 3); }\n"
+		"void main() {\n"
+		"int i = 0;\n"
+		"while (i < 5) { print(g(i)); i = i + 1; }\n"
+		"}");
+}
+
+TEST_CASE("jit: deep recursion falls back to the interpreter") {
+	differential(
+		"int depth(int n) { if (n == 0) return 0; return depth(n - 1) + 1; }\n"
+		"void main() { print(depth(20000)); }");
+}
@@ -0,0 +1,83 @@
+#include "catch2/catch.hpp"
+
+#include "run_c0.hpp"
+#include "src/exception.h"
+
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+	File link(const std::vector<std::string>& sources) {
+		std::vector<File> objects;
+		for (auto& source : sources) {
+			objects.push_back(test::compile(source, false, true));
+		}
+		return File::link(std::move(objects));
+	}
+}
+
+TEST_CASE("linking resolves prototypes and keeps the globals of every source apart") {
+	auto linked = link({
+		"int g = 7;\n"
+		"int bump(int by);\n"
+		"double scaled(int x);\n"
+		"void show(int v);\n"
+		"void main() {\n"
+		"    show(bump(g));\n"
+		"    print(\"value\", scaled(g));\n"
+		"}\n",
+
+		"int counter = 10;\n"
+		"double scale = 1.5;\n"
+		"int bump(int by) { counter = counter + by; return counter; }\n"
+		"double scaled(int x) { return x * scale; }\n"
+		"void unused() { print(\"never kept\"); }\n",
+
+		"int shown = 0;\n"
+		"int bump(int by);\n"
+		"void show(int v) { shown = shown + 1; print(\"value\", v, shown); }\n"
+		"void again() { show(bump(0)); }\n",
+	});
+	REQUIRE(test::run(linked) == "value 17 1\nvalue 10.500000\n");
+
+	// unused and again are dropped, and with them the constants only they used
+	REQUIRE(linked.functions.size() == 4);
+	std::size_t values = 0;
+	for (auto& constant : linked.constants) {
+		if (constant.type == vm::Constant::Type::STRING) {
+			auto& s = std::get<vm::str_t>(constant.value);
+			REQUIRE(s != "unused");
+			REQUIRE(s != "never kept");
+			values += s == "value";
+		}
+	}
+	REQUIRE(values == 1);
+	REQUIRE_FALSE(linked.hasDeclarations());
+
+	// the result is an ordinary file
+	std::stringstream binary;
+	linked.output_binary(binary);
+	REQUIRE(test::run(File::parse_file_binary(binary)) == "value 17 1\nvalue 10.500000\n");
+}
+
+TEST_CASE("a prototype can come before its definition in the same source") {
+	auto file = test::compile(
+		"int f(int a, int b);\n"
+		"void main() { print(f(1, 2)); }\n"
+		"int f(int x, int y) { int a; a = x - y; return a; }\n");
+	REQUIRE(file.hasDeclarations());
+	REQUIRE(test::run(File::link({file})) == "-1\n");
+	// a definition has to match its prototype
+	REQUIRE_THROWS(test::compile("int f(double a);\nvoid main() {}\nint f(int x) { return x; }\n"));
+}
+
+TEST_CASE("linking reports functions that do not match up") {
+	std::string main = "void h(int a);\nvoid main() { h(1); }\n";
+	REQUIRE_THROWS_AS(link({main}), LinkError);
+	REQUIRE_THROWS_AS(link({main, "void h(int a, int b) {}\n"}), LinkError);
+	REQUIRE_THROWS_AS(link({main, "void h(int a) {}\n", "void h(int a) {}\n"}), LinkError);
+	REQUIRE_THROWS_AS(link({"void h(int a) {}\n"}), LinkError);
+	REQUIRE_NOTHROW(link({main, "void h(int a) {}\n"}));
+}
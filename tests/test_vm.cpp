@@ -0,0 +1,912 @@
+#include "catch2/catch.hpp"
+
+#include "src/file.h"
+#include "src/vm.h"
+#include "src/verifier.h"
+#include "src/exception.h"
+#include "run_c0.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+TEST_CASE("switch lowers dense cases to tableswitch") {
+	std::string input =
+		"void main() {\n"
+		"int i = 0;\n"
+		"while (i < 7) {\n"
+		"switch (i) {\n"
+		"case 1: print(10); break;\n"
+		"case 2:\n"
+		"case 3: print(23); break;\n"
+		"case 4: print(4);\n"
+		"default: print(0);\n"
+		"}\n"
+		"i = i + 1;\n"
+		"}\n"
+		"}";
+	auto file = test::compile(input);
+	std::stringstream text;
+	file.output_text(text);
+	REQUIRE(text.str().find("tableswitch 1,4") != std::string::npos);
+	REQUIRE(test::run(std::move(file)) == "0\n10\n23\n23\n4\n0\n0\n0\n");
+}
+
+TEST_CASE("switch lowers sparse cases to lookupswitch") {
+	std::string input =
+		"int f(int x) {\n"
+		"switch (x) {\n"
+		"case -1000: return 1;\n"
+		"case 'a': return 2;\n"
+		"case 7: return 3;\n"
+		"case 100000: return 4;\n"
+		"}\n"
+		"return 0;\n"
+		"}\n"
+		"void main() {\n"
+		"print(f(0-1000), f(97), f(7), f(100000), f(8));\n"
+		"}";
+	auto file = test::compile(input);
+	std::stringstream text;
+	file.output_text(text);
+	REQUIRE(text.str().find("lookupswitch 4") != std::string::npos);
+	REQUIRE(text.str().find("case -1000,") != std::string::npos);
+	REQUIRE(test::run(std::move(file)) == "1 2 3 4 0\n");
+}
+
+TEST_CASE("break leaves the innermost while") {
+	std::string input =
+		"void main() {\n"
+		"int i = 0;\n"
+		"while (1) {\n"
+		"if (i == 3) break;\n"
+		"i = i + 1;\n"
+		"}\n"
+		"print(i);\n"
+		"}";
+	REQUIRE(test::run(test::compile(input)) == "3\n");
+}
+
+TEST_CASE("switch tables survive the binary round trip") {
+	auto file = test::compile(
+		"void main() {\n"
+		"int i = 0-2;\n"
+		"switch (i) { case -2: print(1); break; case -1: print(2); break; case 0: print(3); }\n"
+		"}");
+	std::stringstream bin;
+	file.output_binary(bin);
+	auto parsed = File::parse_file_binary(bin);
+	std::stringstream before, after;
+	file.output_text(before);
+	parsed.output_text(after);
+	REQUIRE(before.str() == after.str());
+	REQUIRE(after.str().find("tableswitch -2,3") != std::string::npos);
+	REQUIRE(test::run(std::move(parsed)) == "1\n");
+}
+
+TEST_CASE("conditions compare directly without subtracting") {
+	std::string input =
+		"void main() {\n"
+		"int min = 0 - 2147483647 - 1;\n"
+		"int max = 2147483647;\n"
+		"if (min < 1) print(1); else print(0);\n"
+		"if (max > 0 - 1) print(1); else print(0);\n"
+		"if (max >= min) print(1); else print(0);\n"
+		"if (min <= max) print(1); else print(0);\n"
+		"if (min == max) print(0); else print(1);\n"
+		"if (min != min) print(0); else print(1);\n"
+		"}";
+	auto file = test::compile(input);
+	std::stringstream text;
+	file.output_text(text);
+	REQUIRE(text.str().find("if_icmpge") != std::string::npos);
+	REQUIRE(text.str().find("jge") == std::string::npos);
+	REQUIRE(test::run(std::move(file)) == "1\n1\n1\n1\n1\n1\n");
+}
+
+TEST_CASE("the verifier accepts compiled programs") {
+	auto file = test::compile(
+		"int fib(int n) {\n"
+		"if (n < 2) return n;\n"
+		"return fib(n-1) + fib(n-2);\n"
+		"}\n"
+		"void main() {\n"
+		"int i = 0;\n"
+		"while (i < 10) { switch (i) { case 3: print(fib(i)); break; default: ; } i = i + 1; }\n"
+		"}");
+	auto result = vm::verify(file);
+	REQUIRE(result.start.verified);
+	for (auto& info : result.functions) {
+		INFO(info.reason);
+		REQUIRE(info.verified);
+	}
+	// fib: the parameter, then lhs, rhs and the argument of the inner call
+	REQUIRE(result.functions.at(0).maxStack == 4);
+	// main calls the recursive fib
+	auto called = file;
+	called.start.push_back(vm::Instruction{vm::OpCode::call, 1, 0});
+	REQUIRE(vm::verify(called).maxCallDepth == -1);
+	REQUIRE(test::run(std::move(file)) == "2\n");
+}
+
+TEST_CASE("unverifiable functions keep the checked path") {
+	auto file = test::assemble(
+		".constants:\n"
+		"0 S \"f\"\n"
+		"1 S \"main\"\n"
+		".start:\n"
+		".functions:\n"
+		"0 0 0 1\n"
+		"1 1 0 1\n"
+		".F0:\n"
+		"0 ipush 0\n"
+		"1 je 3\n"
+		"2 ipush 7\n"
+		"3 pop\n"
+		"4 ret\n"
+		".F1:\n"
+		"0 call 0\n"
+		"1 ret\n");
+	auto result = vm::verify(file);
+	REQUIRE_FALSE(result.functions.at(0).verified);
+	REQUIRE(result.functions.at(0).reason.find("inconsistent stack depth") != std::string::npos);
+	REQUIRE(result.functions.at(1).verified);
+	// the jump is taken, so the pop underflows into the frame and is caught at run time
+	REQUIRE(test::run(std::move(file)).find("runtime error:") != std::string::npos);
+}
+
+TEST_CASE("hot functions move to the fused tier") {
+	auto file = test::compile(
+		"int g;\n"
+		"int sum(int n) {\n"
+		"int i = 0, s = 0;\n"
+		"while (i < n) { s = s + i * 3; if (s > 1000) s = s - 1000; i = i + 1; }\n"
+		"g = g - 1;\n"
+		"return s;\n"
+		"}\n"
+		"int fib(int n) { if (n <= 1) return n; return fib(n - 1) + fib(n - 2); }\n"
+		"int div(int a, int b) { return a / b; }\n"
+		"void main() {\n"
+		"int k = 0, t = 0;\n"
+		"while (k < 50) { t = t + sum(k); switch (k) { case 7: print(fib(k)); } k = k + 1; }\n"
+		"print(t, g, fib(15));\n"
+		"print(div(t, k - 50));\n"
+		"}");
+	auto interpreted = test::run_with(file, "", [](vm::VM& avm) { avm.setTierUpThreshold(~0u); });
+	REQUIRE(interpreted.find("runtime error: divide integer by zero !") != std::string::npos);
+	// the stack trace points at the original instructions in either tier
+	REQUIRE(test::run_with(file, "", [](vm::VM& avm) { avm.setTierUpThreshold(0); }) == interpreted);
+	REQUIRE(test::run_with(file, "", [](vm::VM& avm) { avm.setTierUpThreshold(20); }) == interpreted);
+
+	std::stringstream out, dump;
+	auto cout = std::cout.rdbuf(out.rdbuf());
+	auto cerr = std::cerr.rdbuf(out.rdbuf());
+	auto avm = vm::VM::make_vm(file);
+	avm->setTierUpThreshold(20);
+	avm->start();
+	std::cout.rdbuf(cout);
+	std::cerr.rdbuf(cerr);
+	avm->printStats(dump);
+	INFO(dump.str());
+	REQUIRE(dump.str().find("tier-ups: 3\n") != std::string::npos);
+	// main is called once and switches over inside its loop
+	REQUIRE(dump.str().find("main: 1 calls, 20 back edges, fused") != std::string::npos);
+	REQUIRE(dump.str().find("sum: 50 calls") != std::string::npos);
+	REQUIRE(dump.str().find("div: 1 calls, 0 back edges, checked") != std::string::npos);
+}
+
+TEST_CASE("switch dispatch is not counted as a loop back edge") {
+	auto file = test::compile(
+		"int pick(int x) {\n"
+		"switch (x) { case 0: return 10; case 1: return 11; case 2: return 12; }\n"
+		"switch (x) { case -100000: return 1; case 99999: return 2; default: return 3; }\n"
+		"}\n"
+		"void main() {\n"
+		"print(pick(0), pick(1), pick(2), pick(3));\n"
+		"}");
+	std::stringstream out, dump;
+	auto cout = std::cout.rdbuf(out.rdbuf());
+	auto avm = vm::VM::make_vm(file);
+	avm->start();
+	std::cout.rdbuf(cout);
+	avm->printStats(dump);
+	INFO(dump.str());
+	REQUIRE(out.str() == "10 11 12 3\n");
+	REQUIRE(dump.str().find("pick: 4 calls, 0 back edges") != std::string::npos);
+}
+
+TEST_CASE("the fused tier keeps unreachable jumps past the code") {
+	auto file = test::assemble(
+		".constants:\n"
+		"0 S \"f\"\n"
+		"1 S \"main\"\n"
+		".start:\n"
+		".functions:\n"
+		"0 0 0 1\n"
+		"1 1 0 1\n"
+		".F0:\n"
+		"0 ret\n"
+		"1 jmp 60000\n"
+		".F1:\n"
+		"0 call 0\n"
+		"1 ipush 7\n"
+		"2 iprint\n"
+		"3 ret\n");
+	REQUIRE(vm::verify(file).functions.at(0).verified);
+	REQUIRE(test::run_with(file, "", [](vm::VM& avm) { avm.setTierUpThreshold(0); }) == "7");
+}
+
+TEST_CASE("nested functions see the frames of their static chain") {
+	auto file = test::assemble(
+		".constants:\n"
+		"0 S \"outer\"\n"
+		"1 S \"inner\"\n"
+		"2 S \"top\"\n"
+		"3 S \"inner2\"\n"
+		"4 S \"main\"\n"
+		".start:\n"
+		"0 ipush 100\n"
+		".functions:\n"
+		"0 0 0 1\n"
+		"1 1 0 2\n"
+		"2 2 0 1\n"
+		"3 3 0 2\n"
+		"4 4 0 1\n"
+		".F0:\n"
+		"0 ipush 5\n"
+		"1 call 1\n"
+		"2 loada 0,0\n"
+		"3 iload\n"
+		"4 iprint\n"
+		"5 printl\n"
+		"6 ret\n"
+		// inner calls out to level 1 and back, then to its sibling
+		".F1:\n"
+		"0 ipush 7\n"
+		"1 call 2\n"
+		"2 loada 1,0\n"
+		"3 iload\n"
+		"4 loada 0,0\n"
+		"5 iload\n"
+		"6 iadd\n"
+		"7 loada 2,0\n"
+		"8 iload\n"
+		"9 iadd\n"
+		"10 iprint\n"
+		"11 printl\n"
+		"12 loada 1,0\n"
+		"13 ipush 42\n"
+		"14 istore\n"
+		"15 call 3\n"
+		"16 ret\n"
+		".F2:\n"
+		"0 loada 1,0\n"
+		"1 iload\n"
+		"2 iprint\n"
+		"3 printl\n"
+		"4 ret\n"
+		".F3:\n"
+		"0 loada 1,0\n"
+		"1 iload\n"
+		"2 iprint\n"
+		"3 printl\n"
+		"4 ret\n"
+		".F4:\n"
+		"0 call 0\n"
+		"1 ret\n");
+	// .start, main, outer, inner and then top or inner2
+	auto called = file;
+	called.start.push_back(vm::Instruction{vm::OpCode::call, 4, 0});
+	REQUIRE(vm::verify(called).maxCallDepth == 5);
+	REQUIRE(test::run(file) == "100\n112\n42\n42\n");
+	REQUIRE(test::run_with(file, "", [](vm::VM& avm) { avm.setTierUpThreshold(0); }) == "100\n112\n42\n42\n");
+}
+
+TEST_CASE("loadc pushes pre-resolved constants") {
+	auto file = test::assemble(
+		".constants:\n"
+		"0 S \"main\"\n"
+		"1 I 0x7B\n"
+		"2 D 2.5\n"
+		"3 S \"hi\"\n"
+		"4 D -0.125\n"
+		".start:\n"
+		".functions:\n"
+		"0 0 0 1\n"
+		".F0:\n"
+		"0 loadc 1\n"
+		"1 iprint\n"
+		"2 loadc 2\n"
+		"3 loadc 4\n"
+		"4 dadd\n"
+		"5 dprint\n"
+		"6 loadc 3\n"
+		"7 sprint\n"
+		"8 loadc 0\n"
+		"9 sprint\n"
+		"10 printl\n"
+		"11 ret\n");
+	REQUIRE(test::run(file) == "1232.375000himain\n");
+	REQUIRE(test::run(file, "", true) == "1232.375000himain\n");
+}
+
+TEST_CASE("doubles compile to the d opcodes with implicit conversions") {
+	auto file = test::compile(
+		"const double pi = 3.14159;\n"
+		"double area(double r) { return pi * r * r; }\n"
+		"int trunc(double x) { return x; }\n"
+		"double mix(double a, int b, double c) { return a + b / 2 + c; }\n"
+		"void main() {\n"
+		"double x = 1.5, y;\n"
+		"char c = 'a';\n"
+		"y = .25e1;\n"
+		"print(x + y, 3 - x, -x, 1e-3);\n"
+		"print(area(2), trunc(7.9), mix(1.5, 5, 0.25));\n"
+		"print((int)x, (double)7 / 2, (char)(c + 1.2));\n"
+		"while (x < 5) x = x + 1;\n"
+		"if (x == 5.5) print(x);\n"
+		"scan(y);\n"
+		"print(y / 4);\n"
+		"}");
+	std::string expected =
+		"4.000000 1.500000 -1.500000 0.001000\n"
+		"12.566360 7 3.750000\n"
+		"1 3.500000 b\n"
+		"5.500000\n"
+		"2.625000\n";
+	REQUIRE(test::run(file, "10.5") == expected);
+	REQUIRE(test::run(file, "10.5", true) == expected);
+	// the mixed operands are converted before the operation, not after
+	REQUIRE(test::run(test::compile("void main() { print(1 / 2 + 0.5, 0.5 + 1 / 2, 3 * 0.5); }")) == "0.500000 0.500000 1.500000\n");
+	REQUIRE_THROWS(test::compile("void main() { switch (1.5) { case 1: print(1); } }"));
+}
+
+TEST_CASE("scan parses values across input blocks") {
+	auto file = test::compile(
+		"void main() {\n"
+		"int n, i = 0, s = 0, x;\n"
+		"double d;\n"
+		"scan(n);\n"
+		"while (i < n) { scan(x); s = s + x; i = i + 1; }\n"
+		"scan(d);\n"
+		"print(s, d);\n"
+		"}");
+	// far more than one block of the reader
+	std::stringstream input;
+	int n = 200000, sum = 0;
+	input << n + 2 << "\n-2147483648 +2147483647";
+	for (int i = 0; i < n; ++i) {
+		int value = i % 2 ? -i : i;
+		sum += value;
+		input << (i % 7 ? " " : "\r\n\t") << value;
+	}
+	input << "  -1.25e1";
+	REQUIRE(test::run(file, input.str()) == std::to_string(sum - 1) + " -12.500000\n");
+
+	std::stringstream redirected("2 20 22 .5");
+	auto output = test::run_with(file, "1 1 1", [&](vm::VM& avm) { avm.setInput(redirected); });
+	REQUIRE(output == "42 0.500000\n");
+
+	REQUIRE(test::run(file, "2 1 x").find("runtime error: I/O error !") != std::string::npos);
+	REQUIRE(test::run(file, "1 2147483648 1.0").find("runtime error: I/O error !") != std::string::npos);
+	REQUIRE(test::run(file, "1 1 1e").find("runtime error: I/O error !") != std::string::npos);
+}
+
+TEST_CASE("the collector frees unreachable heap blocks") {
+	// b is only reachable through a[0] while 300 blocks of 100000 slots are dropped,
+	// twice the heap without the collector
+	auto file = test::assemble(
+		".constants:\n"
+		"0 S \"main\"\n"
+		"1 S \" pinned\"\n"
+		".start:\n"
+		".functions:\n"
+		"0 0 0 1\n"
+		".F0:\n"
+		"0 ipush 4\n"
+		"1 new\n"
+		"2 ipush 8\n"
+		"3 new\n"
+		"4 ipush 0\n"
+		"5 loada 0,0\n"
+		"6 iload\n"
+		"7 ipush 0\n"
+		"8 loada 0,1\n"
+		"9 iload\n"
+		"10 iastore\n"
+		"11 loada 0,1\n"
+		"12 iload\n"
+		"13 ipush 3\n"
+		"14 ipush 42\n"
+		"15 iastore\n"
+		"16 loada 0,1\n"
+		"17 ipush 0\n"
+		"18 istore\n"
+		"19 loada 0,2\n"
+		"20 iload\n"
+		"21 ipush 300\n"
+		"22 if_icmpge 34\n"
+		"23 ipush 100000\n"
+		"24 new\n"
+		"25 pop\n"
+		"26 loada 0,2\n"
+		"27 loada 0,2\n"
+		"28 iload\n"
+		"29 ipush 1\n"
+		"30 iadd\n"
+		"31 istore\n"
+		"32 jmp 19\n"
+		"33 nop\n"
+		"34 loada 0,0\n"
+		"35 iload\n"
+		"36 ipush 0\n"
+		"37 iaload\n"
+		"38 ipush 3\n"
+		"39 iaload\n"
+		"40 iprint\n"
+		"41 loadc 1\n"
+		"42 sprint\n"
+		"43 printl\n"
+		"44 ret\n");
+	REQUIRE(test::run(file).find("runtime error: heap overflow !") != std::string::npos);
+	REQUIRE(test::run_with(file, "", [](vm::VM& avm) { avm.enableGC(); }) == "42 pinned\n");
+	REQUIRE(test::run_with(file, "", [](vm::VM& avm) { avm.enableGC(); avm.enableJit(); }) == "42 pinned\n");
+
+	std::stringstream out, dump;
+	auto cout = std::cout.rdbuf(out.rdbuf());
+	auto avm = vm::VM::make_vm(file);
+	avm->enableGC();
+	avm->setTierUpThreshold(0);
+	avm->start();
+	std::cout.rdbuf(cout);
+	avm->printStats(dump);
+	INFO(dump.str());
+	REQUIRE(out.str() == "42 pinned\n");
+	// a collection whenever the heap has grown by 2^20 slots: every tenth block
+	REQUIRE(dump.str().find("collections: 29\n") != std::string::npos);
+	REQUIRE(dump.str().find("10 blocks, 1000000 slots reclaimed, 25 slots live") != std::string::npos);
+}
+
+TEST_CASE("block instructions copy and fill whole ranges") {
+	// a = new 10 filled with 7, b = new 10 with a[0..5) copied to b[2..7), then b shifted down by one in place
+	auto program = [](const std::string& last) {
+		return test::assemble(
+			".constants:\n"
+			"0 S \"main\"\n"
+			".start:\n"
+			".functions:\n"
+			"0 0 0 1\n"
+			".F0:\n"
+			"0 ipush 10\n"
+			"1 new\n"
+			"2 ipush 10\n"
+			"3 new\n"
+			"4 loada 0,0\n"
+			"5 iload\n"
+			"6 ipush 7\n"
+			"7 ipush 10\n"
+			"8 memset\n"
+			"9 loada 0,1\n"
+			"10 iload\n"
+			"11 ipush 2\n"
+			"12 iadd\n"
+			"13 loada 0,0\n"
+			"14 iload\n"
+			"15 ipush 5\n"
+			"16 memcpy\n"
+			"17 loada 0,1\n"
+			"18 iload\n"
+			"19 loada 0,1\n"
+			"20 iload\n"
+			"21 ipush 1\n"
+			"22 iadd\n"
+			"23 ipush 9\n"
+			"24 memcpy\n"
+			"25 loada 0,1\n"
+			"26 iload\n"
+			"27 ipush 0\n"
+			"28 iaload\n"
+			"29 iprint\n"
+			"30 loada 0,1\n"
+			"31 iload\n"
+			"32 ipush 1\n"
+			"33 iaload\n"
+			"34 iprint\n"
+			"35 loada 0,1\n"
+			"36 iload\n"
+			"37 ipush 5\n"
+			"38 iaload\n"
+			"39 iprint\n"
+			"40 loada 0,1\n"
+			"41 iload\n"
+			"42 ipush 6\n"
+			"43 iaload\n"
+			"44 iprint\n"
+			"45 printl\n"
+			"46 loada 0,0\n"
+			"47 iload\n"
+			+ last +
+			"\n50 memset\n"
+			"51 ret\n");
+	};
+	REQUIRE(test::run(program("48 ipush 0\n49 ipush 0")) == "0770\n");
+	REQUIRE(test::run(program("48 ipush 0\n49 ipush 0"), "", true) == "0770\n");
+	REQUIRE(test::run(program("48 ipush 0\n49 ipush 11")).find("runtime error: tried to access unused or constant heap memory !") != std::string::npos);
+	REQUIRE(test::run(program("48 ipush 0\n49 ipush -1")).find("runtime error: tried to set a negative number of slots !") != std::string::npos);
+
+	// runs of uninitialized variables are zeroed with one memset
+	auto file = test::compile(
+		"int g0, g1, g2, g3, g4, g5, g6 = 6;\n"
+		"void main() {\n"
+		"int a, b;\n"
+		"double c, d;\n"
+		"char e;\n"
+		"int f = a + 1, h;\n"
+		"print(g1, g5, g6, a, b, c, d, e + 0, f, h);\n"
+		"}");
+	std::stringstream text;
+	file.output_text(text);
+	REQUIRE(text.str().find("snew 6") != std::string::npos);
+	REQUIRE(text.str().find("snew 7") != std::string::npos);
+	std::string expected = "0 0 6 0 0 0.000000 0.000000 0 1 0\n";
+	REQUIRE(test::run(file) == expected);
+	REQUIRE(test::run(file, "", true) == expected);
+}
+
+TEST_CASE("the unchecked VM runs verified files without the runtime checks") {
+	auto file = test::compile(
+		"int fib(int n) {\n"
+		"if (n < 2) return n;\n"
+		"return fib(n-1) + fib(n-2);\n"
+		"}\n"
+		"void main() {\n"
+		"int i = 0, n;\n"
+		"scan(n);\n"
+		"while (i < n) { print(fib(i), i / 2); i = i + 1; }\n"
+		"}");
+	auto checked = test::run(file, "6");
+	auto none = [](vm::UncheckedVM&) {};
+	REQUIRE(test::run_with<vm::UncheckedVM>(file, "6", none) == checked);
+	REQUIRE(test::run_with<vm::UncheckedVM>(file, "6", [](vm::UncheckedVM& avm) { avm.enableJit(); }) == checked);
+	REQUIRE(test::run_with<vm::UncheckedVM>(file, "6", [](vm::UncheckedVM& avm) { avm.setTierUpThreshold(0); }) == checked);
+
+	// only the unchecked VM drops the checks of verified frames
+	const auto stats = [&](auto avm) {
+		std::stringstream in("6"), out, dump;
+		auto cout = std::cout.rdbuf(out.rdbuf());
+		avm->setInput(in);
+		avm->setTierUpThreshold(~0u);
+		avm->start();
+		std::cout.rdbuf(cout);
+		avm->printStats(dump);
+		return dump.str();
+	};
+	REQUIRE(stats(vm::VM::make_vm(file)).find("fib: 34 calls, 0 back edges, checked") != std::string::npos);
+	REQUIRE(stats(vm::UncheckedVM::make_vm(file)).find("fib: 34 calls, 0 back edges, unchecked") != std::string::npos);
+
+	// the checked VM runs an unverifiable function on the checked path, the unchecked one refuses the file
+	auto unverifiable = test::assemble(
+		".constants:\n"
+		"0 S \"main\"\n"
+		".start:\n"
+		".functions:\n"
+		"0 0 0 1\n"
+		".F0:\n"
+		"0 ipush 0\n"
+		"1 je 3\n"
+		"2 ipush 7\n"
+		"3 pop\n"
+		"4 ret\n");
+	REQUIRE(test::run(unverifiable).find("runtime error:") != std::string::npos);
+	REQUIRE_THROWS_AS(vm::UncheckedVM::make_vm(unverifiable), InvalidFile);
+}
+
+TEST_CASE(".start is checked against the stack size like a called function") {
+	const auto withStart = [](const std::string& start) {
+		return test::assemble(
+			".constants:\n"
+			"0 S \"main\"\n"
+			".start:\n" + start +
+			".functions:\n"
+			"0 0 0 1\n"
+			".F0:\n"
+			"0 ret\n");
+	};
+	auto none = [](vm::UncheckedVM&) {};
+	// deeper than the verifier accepts
+	auto tooDeep = withStart("0 snew 33554432\n1 ipush 7\n");
+	REQUIRE(test::run(tooDeep).find("runtime error: stack overflow") != std::string::npos);
+	REQUIRE_THROWS_AS(vm::UncheckedVM::make_vm(tooDeep), InvalidFile);
+	// verified, but still more than the stack holds
+	auto full = withStart("0 snew 16777215\n1 ipush 7\n");
+	REQUIRE(vm::verify(full).start.verified);
+	REQUIRE(test::run(full).find("runtime error: stack overflow") != std::string::npos);
+	REQUIRE(test::run_with<vm::UncheckedVM>(full, "", none).find("runtime error: stack overflow") != std::string::npos);
+}
+
+TEST_CASE("the mapped loader decodes what the stream loader does") {
+	auto file = test::compile(
+		"const double half = 0.5;\n"
+		"int twice(int x) { return x * 2; }\n"
+		"void main() { print(\"twice\", twice(21), half); }");
+	const std::string path = "mapped_loader_test.o0";
+	{
+		std::ofstream out(path, std::ios::out | std::ios::trunc | std::ios::binary);
+		file.output_binary(out);
+	}
+	std::ifstream in(path, std::ios::in | std::ios::binary);
+	auto streamed = File::parse_file_binary(in);
+	in.close();
+	auto mapped = File::load_file_binary(path);
+	std::stringstream expected, actual;
+	streamed.output_text(expected);
+	mapped.output_text(actual);
+	REQUIRE(actual.str() == expected.str());
+	REQUIRE(test::run(std::move(mapped)) == "twice 42 0.500000\n");
+
+	// a truncated image fails the same way through both loaders
+	std::stringstream bin;
+	file.output_binary(bin);
+	{
+		std::ofstream out(path, std::ios::out | std::ios::trunc | std::ios::binary);
+		out << bin.str().substr(0, bin.str().size() - 1);
+	}
+	REQUIRE_THROWS_AS(File::load_file_binary(path), InvalidFile);
+	std::remove(path.c_str());
+	REQUIRE_THROWS_AS(File::load_file_binary(path), InvalidFile);
+}
+
+TEST_CASE("version 2 files decode a function on its first call") {
+	auto file = test::compile(
+		"int twice(int x) { return x * 2; }\n"
+		"double unused(double x) { return x / 2; }\n"
+		"void main() { print(twice(21)); }");
+	std::stringstream v1, v2;
+	file.output_binary(v1);
+	file.output_binary(v2, 2);
+	auto loaded = File::parse_file_binary(v2);
+	REQUIRE(loaded.version == 2);
+	REQUIRE_FALSE(loaded.decoded(0));
+	REQUIRE_FALSE(loaded.decoded(1));
+
+	// written back in either format, it is the same program
+	auto decoded = loaded;
+	std::stringstream expected, actual, again;
+	file.output_text(expected);
+	decoded.output_text(actual);
+	REQUIRE(actual.str() == expected.str());
+	decoded.output_binary(again);
+	REQUIRE(again.str() == v1.str());
+	REQUIRE_FALSE(loaded.decoded(1));
+
+	REQUIRE(test::run(loaded) == "42\n");
+	REQUIRE(test::run_with<vm::UncheckedVM>(loaded, "", [](vm::UncheckedVM&) {}) == "42\n");
+	std::stringstream out, dump;
+	auto cout = std::cout.rdbuf(out.rdbuf());
+	auto avm = vm::VM::make_vm(loaded);
+	avm->start();
+	std::cout.rdbuf(cout);
+	avm->printStats(dump);
+	INFO(dump.str());
+	REQUIRE(dump.str().find("twice: 1 calls, 0 back edges, checked") != std::string::npos);
+	REQUIRE(dump.str().find("unused: 0 calls, 0 back edges, not loaded") != std::string::npos);
+
+	// the code of a function is only looked at when it is called, a bad opcode in unused
+	// is no error until then
+	auto image = v2.str();
+	image[loaded.lazy[1].offset] = '\xff';
+	std::stringstream corrupted(image);
+	auto broken = File::parse_file_binary(corrupted);
+	REQUIRE(test::run(broken) == "42\n");
+	std::stringstream text;
+	REQUIRE_THROWS_AS(broken.output_text(text), InvalidFile);
+}
+
+TEST_CASE("the text assembler reads mnemonics, numbers and labels as before") {
+	auto file = test::assemble(
+		".constants:\n"
+		"0 S \"tw\\x69ce\"\n"
+		"1 I 0x10\n"
+		"2 S \"main\"\n"
+		".start:\n"
+		"0 IPUSH 0xFFFFFFFF\n"
+		".functions:\n"
+		"0 0 1 1\n"
+		"1 2 0 1\n"
+		".f0:\n"
+		"  0 loada 0, 0\n"
+		"1 iload\n"
+		"2 ipush 2\n"
+		"3 imul\n"
+		"4 iret\n"
+		"main:\n"
+		"0 Ipush 21\n"
+		"1 call 0\n"
+		"2 iprint\n"
+		"3 loadc 1\n"
+		"4 iprint\n"
+		"5 ret\n");
+	std::stringstream text;
+	file.output_text(text);
+	REQUIRE(text.str().find("0 S \"twice\"") != std::string::npos);
+	REQUIRE(text.str().find("0 ipush -1\n") != std::string::npos);
+	REQUIRE(file.functions.at(1).instructions.size() == 6);
+	REQUIRE(test::run(file) == "4216");
+
+	std::stringstream err;
+	auto cerr = std::cerr.rdbuf(err.rdbuf());
+	const auto message = [](const std::string& text) -> std::string {
+		try {
+			test::assemble(text);
+		}
+		catch (const InvalidFile& e) {
+			return e.what();
+		}
+		return "";
+	};
+	CHECK(message(".constants:\n0 S \"main\"\n.start:\n0 push 1\n") == "no such opcode");
+	CHECK(message(".constants:\n0 S \"main\"\n.start:\n0 loada 1\n") == "2 parameters expected, 1 got");
+	CHECK(message(".constants:\n0 S \"main\"\n.start:\n0 ipush x\n") == "invalid first parameter:  x");
+	CHECK(message(".constants:\n0 S \"main\"\n.start:\n.functions:\n0 0 0 1\n.F1:\n") == "\".F0:\" expected");
+	std::cerr.rdbuf(cerr);
+	REQUIRE(err.str().find("line 4 :\n    0 push 1\n") != std::string::npos);
+}
+
+TEST_CASE("the opcode table names every opcode once") {
+	static_assert(vm::mnemonics.find("IPUSH") == vm::OpCode::ipush);
+	static_assert(!vm::mnemonics.find("push"));
+	static_assert(vm::infoOf(vm::OpCode::loada).operandCount() == 2);
+	for (int byte = 0; byte < 256; ++byte) {
+		auto& info = vm::opCodeInfo[byte];
+		if (!info.valid()) {
+			continue;
+		}
+		INFO(info.mnemonic);
+		REQUIRE(vm::mnemonics.find(info.mnemonic) == static_cast<vm::OpCode>(byte));
+		for (auto size : info.operandSizes) {
+			REQUIRE((size == 0 || size == 1 || size == 2 || size == 4));
+		}
+	}
+	// bytes between the opcodes decode as invalid instead of as something else
+	std::string image;
+	{
+		std::stringstream out;
+		test::assemble(".constants:\n0 S \"main\"\n.start:\n0 nop\n.functions:\n0 0 0 1\n.F0:\n0 ret\n").output_binary(out);
+		image = out.str();
+	}
+	image[image.find('\x88')] = '\x03';
+	std::stringstream err;
+	auto cerr = std::cerr.rdbuf(err.rdbuf());
+	std::stringstream in(image);
+	REQUIRE_THROWS_AS(File::parse_file_binary(in), InvalidFile);
+	std::cerr.rdbuf(cerr);
+}
+
+TEST_CASE("compact instructions keep the operands of every opcode") {
+	static_assert(sizeof(vm::CompactInstruction) == 8);
+	auto loada = vm::compact({vm::OpCode::loada, 3, 0x12345678});
+	REQUIRE((loada.narrow == 3 && loada.wide == 0x12345678));
+	auto tableswitch = vm::compact({vm::OpCode::tableswitch, static_cast<vm::u4>(-5), 7});
+	REQUIRE((static_cast<vm::int_t>(tableswitch.wide) == -5 && tableswitch.narrow == 7));
+	auto entry = vm::compact({vm::OpCode::_case, 0x80000000, 0xffff});
+	REQUIRE((entry.wide == 0x80000000 && entry.narrow == 0xffff));
+	auto ipush = vm::compact({vm::OpCode::ipush, 0xffffffff, 0});
+	REQUIRE((ipush.op == vm::OpCode::ipush && ipush.wide == 0xffffffff));
+}
+
+TEST_CASE("version 3 files merge constants and shorten operands") {
+	auto file = test::assemble(
+		".constants:\n"
+		"0 S \"hi\"\n"
+		"1 D 1.5\n"
+		"2 S \"hi\"\n"
+		"3 S \"main\"\n"
+		"4 D 1.5\n"
+		".start:\n"
+		".functions:\n"
+		"0 3 0 1\n"
+		".F0:\n"
+		"0 loadc 0\n"
+		"1 sprint\n"
+		"2 loadc 2\n"
+		"3 sprint\n"
+		"4 loadc 4\n"
+		"5 dprint\n"
+		"6 ipush -70000\n"
+		"7 iprint\n"
+		"8 ipush 2147483647\n"
+		"9 iprint\n"
+		"10 ipush -2147483648\n"
+		"11 iprint\n"
+		"12 ret\n");
+	std::stringstream v1, v3;
+	file.output_binary(v1);
+	file.output_binary(v3, 3);
+	REQUIRE(v3.str().size() < v1.str().size());
+	auto loaded = File::parse_file_binary(v3);
+	REQUIRE(loaded.version == 3);
+	REQUIRE(loaded.constants.size() == 3);
+	REQUIRE(loaded.functions.at(0).nameIndex == 2);
+	REQUIRE(test::run(loaded) == test::run(file));
+	REQUIRE(test::run(loaded) == "hihi1.500000-700002147483647-2147483648");
+
+	// written again, nothing is left to merge
+	std::stringstream again;
+	loaded.output_binary(again, 3);
+	REQUIRE(again.str() == v3.str());
+
+	auto image = v3.str();
+	std::stringstream truncated(image.substr(0, image.size() - 1));
+	REQUIRE_THROWS_AS(File::parse_file_binary(truncated), InvalidFile);
+	// a varint running past 5 bytes
+	image.insert(8, "\xff\xff\xff\xff\xff\x01", 6);
+	std::stringstream overlong(image);
+	REQUIRE_THROWS_AS(File::parse_file_binary(overlong), InvalidFile);
+}
+
+TEST_CASE("the line table maps runtime errors back to the source") {
+	std::string source =
+		"int div(int a, int b) {\n"
+		"    int c = a / b;\n"
+		"    return c;\n"
+		"}\n"
+		"\n"
+		"void main() {\n"
+		"    int i = 0;\n"
+		"    while (i < 2) {\n"
+		"        print(div(6, 1 - i));\n"
+		"        i = i + 1;\n"
+		"    }\n"
+		"}\n";
+	auto plain = test::compile(source);
+	REQUIRE_FALSE(plain.hasLines());
+	auto file = test::compile(source, true);
+	REQUIRE(file.hasLines());
+	REQUIRE(file.functions.at(0).lines.front().line == 2);
+	REQUIRE(vm::lineOf(file.functions.at(1).lines, 0) == 7);
+	// the jump back to the condition belongs to the while
+	auto& main = file.functions.at(1);
+	REQUIRE(vm::lineOf(main.lines, static_cast<vm::u4>(main.instructions.size() - 2)) == 8);
+	REQUIRE(vm::lineOf(main.lines, static_cast<vm::u4>(main.instructions.size() - 1)) == 12);
+
+	auto output = test::run(file);
+	INFO(output);
+	REQUIRE(output.find("function div at instruction 4 (line 2) : idiv") != std::string::npos);
+	REQUIRE(output.find("function main at instruction 10 (line 9) : call 0") != std::string::npos);
+	// the same program without the table is traced as before
+	REQUIRE(test::run(plain).find("function div at instruction 4 : idiv") != std::string::npos);
+
+	// every format keeps the table, the instructions are unchanged
+	std::stringstream text;
+	file.output_text(text);
+	REQUIRE(text.str().find(".lines:\n.F0 0 2\n") != std::string::npos);
+	for (vm::u4 version : {1, 2, 3}) {
+		std::stringstream binary, withLines, withoutLines;
+		file.output_binary(binary, version);
+		auto loaded = File::parse_file_binary(binary);
+		loaded.decode_all();
+		REQUIRE(test::run(loaded) == output);
+		loaded.output_text(withLines);
+		file.output_text(withoutLines);
+		REQUIRE(withLines.str() == withoutLines.str());
+		std::stringstream shorter;
+		plain.output_binary(shorter, version);
+		REQUIRE(shorter.str().size() < binary.str().size());
+	}
+
+	std::stringstream out, dump;
+	auto cout = std::cout.rdbuf(out.rdbuf());
+	auto cerr = std::cerr.rdbuf(out.rdbuf());
+	auto avm = vm::VM::make_vm(file);
+	avm->start();
+	std::cout.rdbuf(cout);
+	std::cerr.rdbuf(cerr);
+	avm->printStats(dump);
+	INFO(dump.str());
+	REQUIRE(dump.str().find("div (line 2): 2 calls") != std::string::npos);
+
+	// entries past the code or out of order are rejected
+	std::stringstream bad(".constants:\n0 S \"main\"\n.start:\n.functions:\n0 0 0 1\n.F0:\n0 ret\n.lines:\n.F0 1 3\n");
+	REQUIRE_THROWS_AS(File::parse_file_text(bad), InvalidFile);
+}
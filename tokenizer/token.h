@@ -33,6 +33,7 @@ namespace miniplc0 {
 		SCAN,						// scan
 
 		UNSIGNED_INTEGER,			// int
+		DOUBLE_VALUE,				// 1.5 .5 1. 1e-3, the value is the literal text
 		LEFTBRACE,					// {
 		RIGHTBRACE,					// }
 		PLUS_SIGN,					// +
@@ -52,6 +53,7 @@ namespace miniplc0 {
 		CHAR_VALUE,					// '
 		STRING_VALUE,				// "
 		COMMA,						// ,
+		COLON,						// :
 
 	};
 
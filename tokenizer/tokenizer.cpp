@@ -1,6 +1,8 @@
 #include "tokenizer/tokenizer.h"
 
 #include <cctype>
+#include <cmath>
+#include <cstdlib>
 #include <sstream>
 #include <string.h>
 
@@ -192,6 +194,20 @@ namespace miniplc0 {
 					case ',':
 						current_state = DFAState::COMMA_STATE;
 						break;
+					case ':':
+						current_state = DFAState::COLON_STATE;
+						break;
+					// 浮点数可以省略整数部分（.5），但 '.' 后面必须是数字
+					case '.': {
+						auto nxt = nextChar();
+						if (nxt.has_value())
+							unreadLast();
+						if (nxt.has_value() && miniplc0::isdigit(nxt.value()))
+							current_state = DFAState::DOUBLE_STATE;
+						else
+							invalid = true;
+						break;
+					}
 					default:
 						invalid = true;
 						break;
@@ -251,6 +267,14 @@ namespace miniplc0 {
 				// 如果读到的字符是数字，则存储读到的字符
 				if (miniplc0::isdigit(ch))
 					ss << ch;
+				// 十进制整数后面的 '.' 或指数部分说明这是一个浮点数
+				else if ((ch == '.' || ch == 'e' || ch == 'E') && !(ss.str().length() > 1 && (ss.str().at(1) == 'x' || ss.str().at(1) == 'X'))) {
+					if (ch == '.')
+						ss << ch;
+					else
+						unreadLast();
+					current_state = DFAState::DOUBLE_STATE;
+				}
 				// 如果读到的是字母，则判断是否为16进制
 				else if (miniplc0::isalpha(ch)) {
 					std::string tmp = ss.str();
@@ -302,6 +326,36 @@ namespace miniplc0 {
 				}
 				break;
 			}
+			// 当前状态是浮点数，ss 中是已经读到的整数部分和 '.'
+			// <digit-sequence>['.'[<digit-sequence>]][<exponent>]，剩下的部分在这里一次读完
+			case DOUBLE_STATE: {
+				auto ch = current_char;
+				while (ch.has_value() && miniplc0::isdigit(ch.value())) {
+					ss << ch.value();
+					ch = nextChar();
+				}
+				// <exponent> ::= ('e'|'E')['+'|'-']<digit-sequence>
+				if (ch.has_value() && (ch.value() == 'e' || ch.value() == 'E')) {
+					ss << ch.value();
+					ch = nextChar();
+					if (ch.has_value() && (ch.value() == '+' || ch.value() == '-')) {
+						ss << ch.value();
+						ch = nextChar();
+					}
+					if (!ch.has_value() || !miniplc0::isdigit(ch.value()))
+						return std::make_pair(std::optional<Token>(), std::make_optional<CompilationError>(pos, ErrorCode::ErrInvalidInput));
+					while (ch.has_value() && miniplc0::isdigit(ch.value())) {
+						ss << ch.value();
+						ch = nextChar();
+					}
+				}
+				if (ch.has_value())
+					unreadLast();
+				std::string str = ss.str();
+				if (std::isinf(std::strtod(str.c_str(), nullptr)))
+					return std::make_pair(std::optional<Token>(), std::make_optional<CompilationError>(pos, ErrorCode::ErrDoubleOverflow));
+				return std::make_pair(std::make_optional<Token>(TokenType::DOUBLE_VALUE, str, pos, currentPos()), std::optional<CompilationError>());
+			}
 			case IDENTIFIER_STATE: {
 				// 请填空：
 				// 如果当前已经读到了文件尾，则解析已经读到的字符串
@@ -440,6 +494,11 @@ namespace miniplc0 {
 			case COMMA_STATE: {
 				unreadLast(); // Yes, we unread last char even if it's an EOF.
 				return std::make_pair(std::make_optional<Token>(TokenType::COMMA, ',', pos, currentPos()), std::optional<CompilationError>());
+			}
+								  // :
+			case COLON_STATE: {
+				unreadLast(); // Yes, we unread last char even if it's an EOF.
+				return std::make_pair(std::make_optional<Token>(TokenType::COLON, ':', pos, currentPos()), std::optional<CompilationError>());
 			}
 			case DIV_ANNOTATION_STATE: {
 				if (!current_char.has_value())
@@ -22,6 +22,7 @@ namespace miniplc0 {
 		enum DFAState {
 			INITIAL_STATE,
 			UNSIGNED_INTEGER_STATE,					// int
+			DOUBLE_STATE,							// double
 			PLUS_SIGN_STATE,						// +
 			MINUS_SIGN_STATE,						// -
 			DIVISION_SIGN_STATE,					// /
@@ -42,6 +43,7 @@ namespace miniplc0 {
 			CHAR_STATE,								// '
 			STRING_STATE,							// "
 			COMMA_STATE,							// ,
+			COLON_STATE,							// :
 			DIV_ANNOTATION_STATE,
 			STAR_ANNOTATION_STATE
 		};